@@ -0,0 +1,299 @@
+//
+// Copyright 2023, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+//
+// EPSCI Group
+// Thomas Jefferson National Accelerator Facility
+// 12000, Jefferson Ave, Newport News, VA 23606
+// (757)-269-7100
+
+/**
+ * @file
+ * Check that a backend's state reports allocate no memory of their own.
+ * The global operator new, and with glibc malloc, calloc and realloc as well so that gRPC core and
+ * protobuf are covered, are replaced by ones which count the allocations made by the calling thread.
+ * After warming up against the simulated control plane in this same process, it counts those made
+ * by N calls to LbControlPlaneClient::update(), which must be none, and by N calls to
+ * LbControlPlaneClient::SendState(). gRPC itself allocates a few times in each blocking call
+ * (call stack, deadline and subchannel pick) which nothing outside it can avoid, so the same number
+ * of bare stub calls sending an identical message is counted as well. SendState must make no
+ * allocations beyond those. The smallest count of a few rounds is used so that gRPC's
+ * occasional timer and housekeeping allocations do not matter.
+ * It exits with 0 if both checks pass and 1 if not.
+ */
+
+#include <memory>
+#include <string>
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cinttypes>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "lb_cplane.h"
+
+
+using namespace std::chrono;
+
+
+/** If true, allocations by this thread are counted. */
+static thread_local bool counting = false;
+
+/** Number of allocations counted for this thread. */
+static thread_local uint64_t allocations = 0;
+
+
+#ifdef __GLIBC__
+extern "C" {
+    // glibc's own allocator, so that gRPC core's and protobuf's allocations are counted too
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *p, size_t size);
+
+    void *malloc(size_t size) {
+        if (counting) allocations++;
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t count, size_t size) {
+        if (counting) allocations++;
+        return __libc_calloc(count, size);
+    }
+
+    void *realloc(void *p, size_t size) {
+        if (counting) allocations++;
+        return __libc_realloc(p, size);
+    }
+}
+#endif
+
+
+void * operator new(size_t size) {
+#ifndef __GLIBC__
+    if (counting) allocations++;
+#endif
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+
+/**
+ * Print out help.
+ * @param programName name to use for this program.
+ */
+static void printHelp(char *programName) {
+    fprintf(stderr,
+            "\nusage: %s\n%s\n%s\n%s\n\n",
+            programName,
+            "        [-h]",
+            "        [-p <grpc server port (default 19550)>]",
+            "        [-calls <# of calls counted in each round (default 1000)>]");
+
+    fprintf(stderr, "        This checks that reporting the state of a backend to the control plane\n");
+    fprintf(stderr, "        allocates no memory beyond what gRPC itself needs for each call.\n");
+}
+
+
+/**
+ * Parse all command line options.
+ *
+ * @param argc        arg count from main().
+ * @param argv        arg list from main().
+ * @param port        filled with port of gRPC server.
+ * @param calls       filled with number of calls counted in each round.
+ */
+static void parseArgs(int argc, char **argv, uint16_t *port, int *calls) {
+
+    int c, i_tmp;
+    bool help = false;
+
+    /* 1 multiple character command-line option */
+    static struct option long_options[] =
+            { {"calls", 1, nullptr, 1},
+              {0,       0, 0,       0}
+            };
+
+
+    while ((c = getopt_long_only(argc, argv, "hp:", long_options, 0)) != EOF) {
+
+        if (c == -1)
+            break;
+
+        switch (c) {
+
+            case 'p':
+                // PORT
+                i_tmp = (int) strtol(optarg, nullptr, 0);
+                if (i_tmp > 1023 && i_tmp < 65535) {
+                    *port = i_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -p, 1023 < port < 65536\n\n");
+                    printHelp(argv[0]);
+                    exit(-1);
+                }
+                break;
+
+            case 1:
+                // Calls per round
+                i_tmp = (int) strtol(optarg, nullptr, 0);
+                if (i_tmp > 0 && i_tmp <= 1000000) {
+                    *calls = i_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -calls, 0 < calls <= 1000000\n");
+                    exit(-1);
+                }
+                break;
+
+            case 'h':
+                help = true;
+                break;
+
+            default:
+                printHelp(argv[0]);
+                exit(2);
+        }
+    }
+
+    if (help) {
+        printHelp(argv[0]);
+        exit(2);
+    }
+}
+
+
+int main(int argc, char **argv) {
+
+    uint16_t port = 19550;
+    int calls = 1000;
+    const int rounds = 5, warmup = 1000;
+
+    parseArgs(argc, argv, &port, &calls);
+
+    LoadBalancerServiceImpl service;
+    std::unique_ptr<Server> server = service.buildServer(port);
+    if (server == nullptr) {
+        fprintf(stderr, "Cannot start control plane on port %hu\n", port);
+        return 1;
+    }
+
+    std::string target = LbChannelPool::target("127.0.0.1", port);
+    LbControlPlaneClient client("127.0.0.1", port, "127.0.0.1", 17750, PortRange(0),
+                                "allocCheck", "token", "lb", 1.F);
+    if (client.Register() != 0) {
+        fprintf(stderr, "Cannot register with control plane\n");
+        return 1;
+    }
+
+    // Bare stub calls, on the client's own channel but for a session of their own,
+    // sending what SendState sends
+    std::unique_ptr<LoadBalancer::Stub> stub = LoadBalancer::NewStub(LbChannelPool::getChannel(target));
+    SendStateRequest request;
+    SendStateReply reply;
+    {
+        RegisterRequest regRequest;
+        RegisterReply regReply;
+        regRequest.set_token("token");
+        regRequest.set_name("allocCheckBare");
+        regRequest.set_lbid("lb");
+        regRequest.set_weight(1.F);
+        regRequest.set_ipaddress("127.0.0.1");
+        regRequest.set_udpport(17751);
+        regRequest.set_portrange(PortRange(0));
+
+        ClientContext context;
+        if (!stub->Register(&context, regRequest, &regReply).ok()) {
+            fprintf(stderr, "Cannot register bare session with control plane\n");
+            return 1;
+        }
+        request.set_token(regReply.token());
+        request.set_lbid("lb");
+        request.set_sessionid(regReply.sessionid());
+    }
+    request.set_isready(true);
+
+    auto bareCall = [&](int i) {
+        struct timespec t1;
+        clock_gettime(CLOCK_REALTIME, &t1);
+        request.mutable_timestamp()->set_seconds(t1.tv_sec);
+        request.mutable_timestamp()->set_nanos(t1.tv_nsec);
+        request.set_fillpercent(0.5F + 1e-5F*i);
+        request.set_controlsignal(0.1F);
+
+        ClientContext context;
+        uint32_t deadline = client.getRpcPolicy().deadline;
+        if (deadline > 0) context.set_deadline(system_clock::now() + milliseconds(deadline));
+        return stub->SendState(&context, request, &reply).ok() ? 0 : 1;
+    };
+
+    auto clientCall = [&](int i) {
+        client.update(0.5F + 1e-5F*i, 0.1F);
+        return client.SendState();
+    };
+
+    // Warm up, so buffers, the channel's connection and the sessions exist
+    int errors = 0;
+    for (int i=0; i < warmup; i++) {
+        errors += bareCall(i);
+        errors += clientCall(i);
+    }
+
+    uint64_t updateMin = UINT64_MAX, bareMin = UINT64_MAX, clientMin = UINT64_MAX;
+
+    for (int r=0; r < rounds; r++) {
+        allocations = 0;
+        counting = true;
+        for (int i=0; i < calls; i++) {
+            client.update(0.5F + 1e-5F*i, 0.1F, i % 2 == 0);
+        }
+        counting = false;
+        updateMin = std::min(updateMin, allocations);
+
+        allocations = 0;
+        counting = true;
+        for (int i=0; i < calls; i++) {
+            errors += bareCall(i);
+        }
+        counting = false;
+        bareMin = std::min(bareMin, allocations);
+
+        allocations = 0;
+        counting = true;
+        for (int i=0; i < calls; i++) {
+            errors += clientCall(i);
+        }
+        counting = false;
+        clientMin = std::min(clientMin, allocations);
+    }
+
+    client.Deregister();
+    server->Shutdown();
+
+    int64_t extra = (int64_t)clientMin - (int64_t)bareMin;
+    bool pass = errors == 0 && updateMin == 0 && extra <= 0;
+
+    fprintf(stderr, "\nAllocations in %d calls, fewest of %d rounds:\n", calls, rounds);
+    fprintf(stderr, "  update       %8" PRIu64 "\n", updateMin);
+    fprintf(stderr, "  bare stub    %8" PRIu64 "  (%.2f per call, made by gRPC)\n", bareMin, (double)bareMin/calls);
+    fprintf(stderr, "  SendState    %8" PRIu64 "  (%.2f per call)\n", clientMin, (double)clientMin/calls);
+    fprintf(stderr, "  beyond gRPC  %8" PRId64 "\n", std::max(extra, (int64_t)0));
+    if (errors > 0) fprintf(stderr, "  %d calls failed\n", errors);
+    fprintf(stderr, "%s\n\n", pass ? "PASS" : "FAIL");
+
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,356 @@
+//
+// Copyright 2023, Jefferson Science Associates, LLC.
+// Subject to the terms in the LICENSE file found in the top-level directory.
+//
+// EPSCI Group
+// Thomas Jefferson National Accelerator Facility
+// 12000, Jefferson Ave, Newport News, VA 23606
+// (757)-269-7100
+
+/**
+ * @file
+ * Check that a backend switches to its standby control plane when the one in use hangs
+ * without closing its connections. Two simulated control planes are run in this same process.
+ * The primary is reached through a TCP relay which, once frozen, keeps every connection open
+ * but passes nothing more either way, and accepts new connections which it never passes on.
+ * One client reports its state on a stream, another by SendStateAsync with a deadline much
+ * longer than the failover timeout. After the relay is frozen, both keep reporting until they
+ * have switched to the standby. The stream has no deadline, so it relies on keepalive pings
+ * to notice the hung control plane.
+ * It exits with 0 if both switch in time and 1 if not.
+ */
+
+#include <memory>
+#include <string>
+
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <getopt.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lb_cplane.h"
+
+
+using namespace std::chrono;
+
+
+/**
+ * TCP relay on localhost which can be frozen to look like a peer that has hung.
+ */
+class HangingRelay {
+
+    public:
+
+        /**
+         * Start relaying.
+         * @param listenPort  port to accept connections on.
+         * @param toPort      port to relay them to.
+         * @return 0 if successful, 1 if port cannot be listened on.
+         */
+        int start(uint16_t listenPort, uint16_t toPort) {
+            this->toPort = toPort;
+
+            listenFd = socket(AF_INET, SOCK_STREAM, 0);
+            int on = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(listenPort);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listenFd, 16) < 0) {
+                close(listenFd);
+                return 1;
+            }
+
+            acceptThread = std::thread(&HangingRelay::acceptConnections, this);
+            return 0;
+        }
+
+        /** Stop passing on anything, while keeping all connections open. */
+        void freeze() {frozen = true;}
+
+        /** Stop relaying and close all connections. */
+        void stop() {
+            quit = true;
+            acceptThread.join();
+            for (std::thread & t : threads) t.join();
+            threads.clear();
+            close(listenFd);
+        }
+
+    private:
+
+        uint16_t toPort = 0;
+        int listenFd = -1;
+        std::atomic<bool> frozen {false};
+        std::atomic<bool> quit {false};
+        std::thread acceptThread;
+        /** Threads relaying or holding each connection, only added to by acceptThread. */
+        std::vector<std::thread> threads;
+
+        /** Run by a thread to accept connections and start a thread relaying each. */
+        void acceptConnections() {
+            struct pollfd pfd = {listenFd, POLLIN, 0};
+
+            while (!quit) {
+                if (poll(&pfd, 1, 50) <= 0) continue;
+
+                int fd = accept(listenFd, nullptr, nullptr);
+                if (fd < 0) continue;
+
+                if (frozen) {
+                    // Hold the new connection open but never pass it on
+                    threads.emplace_back([this, fd] {
+                        while (!quit) std::this_thread::sleep_for(milliseconds(50));
+                        close(fd);
+                    });
+                    continue;
+                }
+
+                int upFd = socket(AF_INET, SOCK_STREAM, 0);
+                struct sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons(toPort);
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                if (connect(upFd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+                    close(upFd);
+                    close(fd);
+                    continue;
+                }
+
+                threads.emplace_back(&HangingRelay::relay, this, fd, upFd);
+            }
+        }
+
+        /** Run by a thread to pass bytes both ways between two sockets until either closes. */
+        void relay(int fd1, int fd2) {
+            struct pollfd pfds[2] = {{fd1, POLLIN, 0}, {fd2, POLLIN, 0}};
+            char buf[16384];
+
+            while (!quit) {
+                if (frozen) {
+                    std::this_thread::sleep_for(milliseconds(50));
+                    continue;
+                }
+                if (poll(pfds, 2, 50) <= 0) continue;
+
+                bool closed = false;
+                for (int i=0; i < 2; i++) {
+                    if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                    ssize_t n = read(pfds[i].fd, buf, sizeof(buf));
+                    if (n <= 0 || write(pfds[1-i].fd, buf, n) != n) closed = true;
+                }
+                if (closed) break;
+            }
+
+            close(fd1);
+            close(fd2);
+        }
+};
+
+
+/**
+ * Print out help.
+ * @param programName name to use for this program.
+ */
+static void printHelp(char *programName) {
+    fprintf(stderr,
+            "\nusage: %s\n%s\n%s\n%s\n\n",
+            programName,
+            "        [-h]",
+            "        [-p <first of 3 ports used, primary, standby and relay (default 19560)>]",
+            "        [-limit <millisec allowed to switch to standby (default 5000)>]");
+
+    fprintf(stderr, "        This checks that a backend switches to a standby control plane\n");
+    fprintf(stderr, "        when the one in use hangs without closing its connections.\n");
+}
+
+
+/**
+ * Parse all command line options.
+ *
+ * @param argc        arg count from main().
+ * @param argv        arg list from main().
+ * @param port        filled with first of the ports used.
+ * @param limit       filled with millisec allowed to switch to standby.
+ */
+static void parseArgs(int argc, char **argv, uint16_t *port, int *limit) {
+
+    int c, i_tmp;
+    bool help = false;
+
+    /* 1 multiple character command-line option */
+    static struct option long_options[] =
+            { {"limit", 1, nullptr, 1},
+              {0,       0, 0,       0}
+            };
+
+
+    while ((c = getopt_long_only(argc, argv, "hp:", long_options, 0)) != EOF) {
+
+        if (c == -1)
+            break;
+
+        switch (c) {
+
+            case 'p':
+                // PORT
+                i_tmp = (int) strtol(optarg, nullptr, 0);
+                if (i_tmp > 1023 && i_tmp < 65533) {
+                    *port = i_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -p, 1023 < port < 65533\n\n");
+                    printHelp(argv[0]);
+                    exit(-1);
+                }
+                break;
+
+            case 1:
+                // Time limit
+                i_tmp = (int) strtol(optarg, nullptr, 0);
+                if (i_tmp > 0 && i_tmp <= 60000) {
+                    *limit = i_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -limit, 0 < limit <= 60000\n");
+                    exit(-1);
+                }
+                break;
+
+            case 'h':
+                help = true;
+                break;
+
+            default:
+                printHelp(argv[0]);
+                exit(2);
+        }
+    }
+
+    if (help) {
+        printHelp(argv[0]);
+        exit(2);
+    }
+}
+
+
+int main(int argc, char **argv) {
+
+    uint16_t port = 19560;
+    int limit = 5000;
+    const uint32_t failoverTimeout = 250, keepalive = 200;
+
+    parseArgs(argc, argv, &port, &limit);
+
+    uint16_t standbyPort = port + 1, relayPort = port + 2;
+
+    LoadBalancerServiceImpl primaryService, standbyService;
+    std::unique_ptr<Server> primary = primaryService.buildServer(port);
+    std::unique_ptr<Server> standby = standbyService.buildServer(standbyPort);
+    if (primary == nullptr || standby == nullptr) {
+        fprintf(stderr, "Cannot start control planes on ports %hu and %hu\n", port, standbyPort);
+        return 1;
+    }
+
+    HangingRelay relay;
+    if (relay.start(relayPort, port) != 0) {
+        fprintf(stderr, "Cannot start relay on port %hu\n", relayPort);
+        return 1;
+    }
+
+    std::string standbyTarget = LbChannelPool::target("127.0.0.1", standbyPort);
+
+    LbRpcPolicy policy;
+    policy.deadline = 10000;
+
+    // One client reports on a stream, the other by asynchronous calls
+    LbControlPlaneClient streamClient("127.0.0.1", relayPort, "127.0.0.1", 17760, PortRange(0),
+                                      "failoverStream", "token", "lb", 1.F);
+    LbControlPlaneClient asyncClient("127.0.0.1", relayPort, "127.0.0.1", 17761, PortRange(0),
+                                     "failoverAsync", "token", "lb", 1.F);
+
+    for (LbControlPlaneClient *client : {&streamClient, &asyncClient}) {
+        client->setRpcPolicy(policy);
+        client->setFailoverTimeout(failoverTimeout);
+        client->setKeepaliveTime(keepalive);
+        client->addStandbyCp("127.0.0.1", standbyPort);
+        if (client->Register() != 0) {
+            fprintf(stderr, "Cannot register with primary control plane\n");
+            return 1;
+        }
+    }
+
+    if (streamClient.OpenStateStream() != 0) {
+        fprintf(stderr, "Cannot open state stream\n");
+        return 1;
+    }
+
+    // Make sure both report fine before the primary hangs
+    int errors = 0;
+    for (int i=0; i < 10; i++) {
+        streamClient.update(0.5F, 0.1F, true);
+        asyncClient.update(0.5F, 0.1F, true);
+        errors += streamClient.SendStateStream();
+        errors += asyncClient.SendStateAsync();
+        std::this_thread::sleep_for(milliseconds(20));
+    }
+
+    relay.freeze();
+    auto t0 = steady_clock::now();
+    int64_t streamMs = -1, asyncMs = -1;
+
+    while ((streamMs < 0 || asyncMs < 0) && steady_clock::now() - t0 < milliseconds(limit)) {
+        streamClient.SendStateStream();
+        asyncClient.SendStateAsync();
+
+        int64_t ms = duration_cast<milliseconds>(steady_clock::now() - t0).count();
+        if (streamMs < 0 && streamClient.getActiveCp() == standbyTarget) streamMs = ms;
+        if (asyncMs  < 0 && asyncClient.getActiveCp()  == standbyTarget) asyncMs  = ms;
+
+        std::this_thread::sleep_for(milliseconds(50));
+    }
+
+    // Reports must reach the standby once switched
+    int standbyErrors = 0;
+    if (streamMs >= 0) standbyErrors += streamClient.SendStateStream();
+    if (asyncMs >= 0) {
+        asyncClient.SendStateAsync();
+        std::this_thread::sleep_for(milliseconds(100));
+        standbyErrors += asyncClient.SendStateAsync();
+    }
+
+    streamClient.CloseStateStream();
+    streamClient.Deregister();
+    asyncClient.Deregister();
+
+    // Calls held by the hung relay are cancelled
+    primary->Shutdown(system_clock::now() + milliseconds(100));
+    standby->Shutdown(system_clock::now() + milliseconds(100));
+    relay.stop();
+
+    bool pass = errors == 0 && standbyErrors == 0 && streamMs >= 0 && asyncMs >= 0;
+
+    fprintf(stderr, "\nSwitch to standby after primary hung (failover timeout %u ms, keepalive %u ms):\n",
+            failoverTimeout, keepalive);
+    fprintf(stderr, "  stream       %s\n", streamMs >= 0 ? (std::to_string(streamMs) + " ms").c_str() : "never");
+    fprintf(stderr, "  async        %s\n", asyncMs  >= 0 ? (std::to_string(asyncMs)  + " ms").c_str() : "never");
+    if (errors > 0) fprintf(stderr, "  %d reports failed before primary hung\n", errors);
+    if (standbyErrors > 0) fprintf(stderr, "  %d reports failed after switching\n", standbyErrors);
+    fprintf(stderr, "%s\n\n", pass ? "PASS" : "FAIL");
+
+    return pass ? 0 : 1;
+}
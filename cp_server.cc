@@ -31,6 +31,7 @@
 #include <getopt.h>
 #include <random>
 #include <map>
+#include <vector>
 #include <unordered_map>
 
 #ifdef __linux__
@@ -52,6 +53,7 @@
 #endif
 
 #include "lb_cplane.h"
+#include "lb_cplane_async.h"
 #include "ersap_grpc_assemble.hpp"
 
 
@@ -72,15 +74,20 @@ using namespace std;
  */
 static void printHelp(char *programName) {
     fprintf(stderr,
-            "\nusage: %s\n%s\n%s\n%s\n%s\n\n",
+            "\nusage: %s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n\n",
             programName,
             "        [-h] [-v] [-ipv6]",
             "        [-p <grpc server port (default 19523)>]",
+            "        [-unix <path of unix domain socket for grpc server to also listen on>]",
             "        [-sport <sync msg port (default 18347)>]",
+            "        [-async] [-threads <# of async server threads (default 1 per core)>]",
+            "        [-epochs <most LB calendar epochs in use at once (default 4)>]",
             "        [-cores <comma-separated list of cores to run on>]");
 
     fprintf(stderr, "        This is a gRPC server getting requests/data from an ERSAP reasembly backend's gRPC client.\n");
     fprintf(stderr, "        It also receives sync msgs from data senders as to the latest event # sent.\n");
+    fprintf(stderr, "        With -async, calls are handled asynchronously with a completion queue per thread.\n");
+    fprintf(stderr, "        Each new calendar starts an epoch at an event # predicted from the sync msgs.\n");
 }
 
 
@@ -93,19 +100,29 @@ static void printHelp(char *programName) {
  * @param port          filled with port of gRPC server).
  * @param sport         filled with port of control plane's input for sync msgs).
  * @param debug         filled with debug flag.
+ * @param useIPv6       filled with use IP version 6 flag.
+ * @param unixPath      filled with path of unix domain socket for gRPC server.
+ * @param async         filled with true if gRPC server is to be asynchronous.
+ * @param threads       filled with number of asynchronous server threads.
+ * @param epochs        filled with most calendar epochs in use at once.
  */
 static void parseArgs(int argc, char **argv,
                       int *cores, uint16_t* port, uint16_t* sport,
-                      bool *debug, bool *useIPv6) {
+                      bool *debug, bool *useIPv6, char *unixPath,
+                      bool *async, int *threads, int *epochs) {
 
     int c, i_tmp;
     bool help = false;
 
-    /* 4 multiple character command-line options */
+    /* 7 multiple character command-line options */
     static struct option long_options[] =
             { {"cores",  1, nullptr, 1},
               {"sport",  1, nullptr, 2},
               {"ipv6",   0, nullptr, 3},
+              {"unix",   1, nullptr, 4},
+              {"async",  0, nullptr, 5},
+              {"threads",1, nullptr, 6},
+              {"epochs", 1, nullptr, 7},
                {0,       0, 0,    0}
             };
 
@@ -142,6 +159,47 @@ static void parseArgs(int argc, char **argv,
                 }
                 break;
 
+            case 4:
+                // unix domain socket path
+                if (strlen(optarg) >= 108 || strlen(optarg) < 1) {
+                    fprintf(stderr, "Invalid argument to -unix, path too long/short\n\n");
+                    printHelp(argv[0]);
+                    exit(-1);
+                }
+                strcpy(unixPath, optarg);
+                break;
+
+            case 5:
+                // asynchronous gRPC server
+                *async = true;
+                break;
+
+            case 6:
+                // asynchronous gRPC server threads
+                i_tmp = (int) strtol(optarg, nullptr, 0);
+                if (i_tmp > 0 && i_tmp <= 1024) {
+                    *threads = i_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -threads, 0 < threads <= 1024\n\n");
+                    printHelp(argv[0]);
+                    exit(-1);
+                }
+                break;
+
+            case 7:
+                // most calendar epochs in use at once
+                i_tmp = (int) strtol(optarg, nullptr, 0);
+                if (i_tmp > 1 && i_tmp <= 1024) {
+                    *epochs = i_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -epochs, 1 < epochs <= 1024\n\n");
+                    printHelp(argv[0]);
+                    exit(-1);
+                }
+                break;
+
             case 3:
                 // use IP version 6
                 fprintf(stderr, "SETTING TO IP version 6\n");
@@ -232,12 +290,14 @@ static void parseArgs(int argc, char **argv,
 typedef struct threadArg_t {
     int  socket;
     bool debug;
+    LbEpochs *epochs;
 } threadArg;
 
 
 
 /**
- * This thread receives sync messages indicating the latest event sent for a particular data source.
+ * This thread receives sync messages indicating the latest event sent for a particular data source,
+ * from which the control plane predicts event numbers to start its calendar epochs at.
  * @param arg struct to be passed to thread.
  */
 static void *syncThread(void *arg) {
@@ -246,6 +306,7 @@ static void *syncThread(void *arg) {
 
     int  socket  = tArg->socket;
     bool debug   = tArg->debug;
+    LbEpochs *epochs = tArg->epochs;
 
     uint32_t version, srcId, evtRate;
     uint64_t evtNum, nanos;
@@ -263,6 +324,7 @@ static void *syncThread(void *arg) {
 
         // Parse sync msg
         ejfat::parseSyncData(pkt, &version, &srcId, &evtNum, &evtRate, &nanos);
+        epochs->sync(srcId, evtNum, evtRate);
 
         if (debug) {
             fprintf(stderr, "cp_server: sync pkt from %u, version %u, event #%" PRIu64 ", rate %u Hz, nanos %" PRIu64 "\n",
@@ -295,19 +357,21 @@ static void *controlThread(void *arg) {
     int64_t totalT = 0, time;
     struct timespec t1, t2, firstT;
 
-    // random device class instance, source of 'true' randomness for initializing random seed
-    std::random_device rd;
-    // Mersenne twister PRNG, initialized with seed from previous random device instance
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dist(0.0, 1.0);
-
-    // control (PID error) values from node
-    std::map<uint16_t, float> control;
-    for(size_t n=0; n < 1024; n++) {control[n] = 0;}
-    // schedule density for node
-    std::map<uint16_t, float> sched;
-    for(size_t n=0; n < 1024; n++) {sched[n] = 0;}
-    uint64_t epoch = 0; //for now
+    // control (PID error) values and schedule density of each node, kept between steps
+    LbSchedule schedule;
+    // epochs at which new calendars take effect
+    LbEpochs &epochs = service->getEpochs();
+    LbEpoch epoch;
+    // state of each node
+    std::vector<LbBackEndState> backends;
+    // LB calendar of 512 slots of the last epoch begun, and the next one being tried
+    LbCalendar calendar(512), next(512);
+    // handle of each node, the member its calendar slots are assigned to
+    std::vector<LbSessionHandle> members;
+    // calendar table of each epoch in use, the member each slot is assigned to, key is epoch
+    std::map<uint64_t, std::vector<LbSessionHandle>> tables;
+    // number of slots of each member in the calendar of the last epoch begun
+    std::unordered_map<LbSessionHandle, uint32_t> memberSlots;
 
     // Get the current time
     clock_gettime(CLOCK_MONOTONIC, &t1);
@@ -318,27 +382,16 @@ static void *controlThread(void *arg) {
         // Delay 2 seconds between data points
         std::this_thread::sleep_for(std::chrono::seconds(2));
 
-        // This needs to be called each loop since it gets a COPY of the current data (for thread safety)
-        std::shared_ptr<std::unordered_map<std::string, BackEnd>> pDataMap = service->getBackEnds();
+        // This needs to be called each loop since it gets the latest state of backends
+        service->getBackEnds(backends);
         //number of backends giving feed back this reporting interval
-        size_t num_bes = pDataMap->size();
-
-        // Loop over all backends
-        for (const std::pair<std::string, BackEnd> &entry: *(pDataMap.get())) {
-            const BackEnd &backend = entry.second;
-
-            // read node feedback: an array of health metrics
-            uint16_t n = 0;
-            control[n] = backend.getPidError();
-            sched[n] = sched[n] == 0 ? 1e-6 : sched[n]; //activate node if not active
+        size_t num_bes = backends.size();
+        if (num_bes == 0) continue;
 
-            if (debug) cout << "Received pid err " << n << ", " << control[n] << " from backend\n";
-            if (debug) cout << "sched[" << n << "] = " << sched[n] << " ...\n";
-
-            // update weighting for node from control signal
-            sched[n] *= (1.0f + control[n]);
-            if (debug) cout << "adjusting sched[" << n << "] = " << sched[n] << " ...\n";
-        }
+        // read node feedback, update weighting for each node from its control signal, and normalize
+        schedule.update(backends);
+        const std::vector<float> &control = schedule.getControl();
+        const std::vector<float> &sched = schedule.getDensity();
 
         if (debug) { cout << "read " << num_bes << " controls\n"; }
         if (debug) {
@@ -346,21 +399,6 @@ static void *controlThread(void *arg) {
             for (size_t n = 0; n < num_bes; n++) { cout << control[n] << '\t'; }
             cout << '\n';
         }
-        if (debug) { cout << "normalizing ...\n"; }
-
-        // normalize schedule density
-        float nrm_sum;
-        nrm_sum = 0;
-        for (size_t n = 0; n < num_bes; n++) {
-            nrm_sum += sched[n];
-        }
-        nrm_sum = nrm_sum == 0 ? 1 : nrm_sum;
-        if (debug) { cout << "nrm_sum = " << nrm_sum << '\n'; }
-        // ///////////
-
-        for (size_t n = 0; n < num_bes; n++) {
-            sched[n] /= nrm_sum;
-        }
 
         if (debug) {
             cout << "density: ";
@@ -368,34 +406,67 @@ static void *controlThread(void *arg) {
             cout << '\n';
         }
 
-        if (debug) { cout << "write revised tick schedule ...\n"; }
-        // write revised tick schedule
-        std::map<uint16_t, uint32_t> lb_calendar_table;
-
-        for (uint16_t t = 0; t < 512; t++) {
-            // random # between 0 & 1
-            float r = dist(gen);
-            if (debug) { cout << "sample = " << r << '\n'; }
-
-            // cumulative distribution from iterating over sched weights
-            float cd = 0.f;
-            uint16_t n;
-            n = 0;
-            for (size_t ni = 0; ni < num_bes; ni++) {
-                cd += sched[ni];
-                if (debug) cout << "testing = " << r << " against " << cd << " n = " << n << '\n';
-                if (r <= cd) break;
-                n++;
+        // a revised calendar takes effect at the start of a new epoch, so wait while too many are in use.
+        // The calendars of epochs in use, even those yet to start, are never changed.
+        if (epochs.isFull()) {
+            if (debug) { cout << "too many epochs in use, keep calendar of epoch " << epochs.getCurrentEpoch() << '\n'; }
+        }
+        else {
+            // only move the slots needed to reach the new shares, which begin a new epoch if any moved
+            members.resize(num_bes);
+            for (size_t n = 0; n < num_bes; n++) {
+                members[n] = backends[n].handle;
             }
+            next = calendar;
+            uint32_t changed = next.update(sched, members);
 
-            lb_calendar_table[t] = n;
+            // only this thread begins epochs, so there is room for one,
+            // but not while no data source is heard from to say where it would start
+            if (changed > 0 && !epochs.newEpoch(&epoch)) {
+                if (debug) { cout << "no sync from data sources, keep calendar of epoch " << epochs.getCurrentEpoch() << '\n'; }
+            }
+            else if (changed > 0) {
+                std::swap(calendar, next);
+                const std::vector<uint32_t> &lb_calendar_table = calendar.getSlots();
+                const std::vector<uint32_t> &slots = calendar.getSlotCounts();
+
+                // the new epoch gets its own table, and those of epochs retired go
+                std::vector<LbSessionHandle> &table = tables[epoch.epoch];
+                table.resize(calendar.getSize());
+                for (uint32_t t = 0; t < calendar.getSize(); t++) {
+                    table[t] = members[lb_calendar_table[t]];
+                }
+                std::vector<LbEpoch> inUse = epochs.getEpochs();
+                while (!inUse.empty() && tables.begin()->first < inUse.front().epoch) {
+                    tables.erase(tables.begin());
+                }
+
+                memberSlots.clear();
+                for (size_t n = 0; n < num_bes; n++) {
+                    memberSlots[members[n]] = slots[n];
+                }
 
-            if (debug) {
-                cout << "sampled index = " << n << '\n';
-                cout << "table_add load_balance_calendar_table do_assign_member 0x" << std::hex << epoch << " 0x"
-                     << std::hex << t << " => 0x" << std::hex << n << '\n';
+                if (debug) {
+                    cout << "write revised tick schedule ...\n";
+                    cout << "calendar update: " << changed << " of " << calendar.getSize() << " slots changed"
+                         << ", epoch " << epoch.epoch << " starts at event " << epoch.startEvent
+                         << ", " << tables.size() << " epoch tables kept\n";
+                    // A new epoch has its own calendar table, which starts empty, so all its slots are written,
+                    // not only those in calendar.getChanges()
+                    for (uint32_t t = 0; t < calendar.getSize(); t++) {
+                        cout << "table_add load_balance_calendar_table do_assign_member 0x" << std::hex << epoch.epoch << " 0x"
+                             << std::hex << t << " => 0x" << std::hex << lb_calendar_table[t] << std::dec << '\n';
+                    }
+                }
             }
         }
+
+        // Let backends know their share of the calendar (sent back on their state streams),
+        // every step, with their slots in the calendar of the last epoch begun
+        for (size_t n = 0; n < num_bes; n++) {
+            auto it = memberSlots.find(backends[n].handle);
+            service->setSchedule(backends[n].handle, sched[n], it == memberSlots.end() ? 0 : it->second);
+        }
     }
 
     return (nullptr);
@@ -409,12 +480,18 @@ int main(int argc, char **argv) {
     int cores[10];
     bool debug = false;
     bool useIPv6 = false;
+    bool async = false;
+    int asyncThreads = 0;
+    int maxEpochs = 4;
 
     for (int i=0; i < 10; i++) {
         cores[i] = -1;
     }
 
-    parseArgs(argc, argv, cores, &port, &sport, &debug, &useIPv6);
+    char unixPath[108];
+    memset(unixPath, 0, 108);
+
+    parseArgs(argc, argv, cores, &port, &sport, &debug, &useIPv6, unixPath, &async, &asyncThreads, &maxEpochs);
 
 #ifdef __linux__
 
@@ -509,6 +586,10 @@ int main(int argc, char **argv) {
 
     std::cout << "Listening for syncs on port " << sport << std::endl;
 
+    LoadBalancerServiceImpl service;
+    LoadBalancerServiceImpl *pGrpcService = &service;
+    pGrpcService->getEpochs().setMaxEpochs(maxEpochs);
+
     /////////////////////////
     /// Start sync Thread ///
     /////////////////////////
@@ -521,6 +602,7 @@ int main(int argc, char **argv) {
 
     tArg->socket = udpSocket;
     tArg->debug  = debug;
+    tArg->epochs = &pGrpcService->getEpochs();
 
     pthread_t thd;
     int status = pthread_create(&thd, NULL, syncThread, (void *) tArg);
@@ -539,9 +621,6 @@ int main(int argc, char **argv) {
     uint16_t dataId;
     bool firstLoop = true;
 
-    LoadBalancerServiceImpl service;
-    LoadBalancerServiceImpl *pGrpcService = &service;
-
     // Start thread to do run pid loop
     threadStruct *targ = (threadStruct *)calloc(1, sizeof(threadStruct));
     if (targ == nullptr) {
@@ -559,9 +638,21 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    if (async) {
+        std::cout << "About to run async GRPC server on port " << port << std::endl;
+        LoadBalancerAsyncServer asyncServer(pGrpcService, asyncThreads);
+        if (asyncServer.start(port, unixPath) != 0) {
+            return -1;
+        }
+        asyncServer.wait();
+        return 0;
+    }
+
     while (true) {
         std::cout << "About to run GRPC server on port " << port << std::endl;
-        pGrpcService->runServer(port, pGrpcService);
+        if (pGrpcService->runServer(port, pGrpcService, unixPath) != 0) {
+            return -1;
+        }
         std::cout << "Should never print this message!!!" << std::endl;
     }
 
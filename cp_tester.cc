@@ -98,9 +98,9 @@ static uint64_t eventsProcessed = 0;
  */
 static void printHelp(char *programName) {
     fprintf(stderr,
-            "\nusage: %s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n\n",
+            "\nusage: %s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n\n",
             programName,
-            "        [-h] [-v] [-ipv6]",
+            "        [-h] [-v] [-ipv6] [-async] [-stream] [-adapt]",
             "        [-p <data receiving port (for registration, 17750 default)>]",
             "        [-a <data receiving address (for registration)>]",
             "        [-range <data receiving port range (for registration), default 0>]",
@@ -109,12 +109,15 @@ static void printHelp(char *programName) {
 
             "        [-cp_addr <control plane IP address (default ejfat-2)>]",
             "        [-cp_port <control plane grpc port (default 18347)>]",
+            "        [-cp_standby <standby control plane IP:port, switched to if first fails>]",
+            "        [-cp_unix <path of control plane's unix domain socket, used instead of cp_addr & cp_port>]",
             "        [-name <backend name>]\n",
             "        [-w <weight relative to other backends (default 1.)>]\n",
             "        [-lbid <id of LB to use (default LB_0)>]\n",
 
             "        [-count <# of fill values averaged, default = 1000>]",
             "        [-rtime <millisec for reporting fill to CP, default 1000>]",
+            "        [-rmin <with -adapt, min millisec between reports, default 100>]",
             "        [-stime <fifo sample time in millisec, default 1>]",
             "        [-factor <real # to multiply process time of event, default 1., > 0.]",
             "        [-thds <# of threads which consume events off Q, default 1, max 12>]\n",
@@ -133,6 +136,10 @@ static void printHelp(char *programName) {
 
     fprintf(stderr, "        This is a gRPC program that simulates an ERSAP backend by sending messages to a control plane.\n");
     fprintf(stderr, "        The -p, -a, and -range args are only to tell CP where to send our data, but are otherwise unused.\n");
+    fprintf(stderr, "        The -async option reports to the CP without waiting for its reply so a slow CP does not\n");
+    fprintf(stderr, "        stretch the fifo sampling. Only one report is in progress at a time and stale ones are dropped.\n");
+    fprintf(stderr, "        The -stream option reports to the CP over one stream, identifying this backend only once,\n");
+    fprintf(stderr, "        and prints the scheduling hints the CP sends back.\n");
     fprintf(stderr, "        In practice, the buffer into which data is received can expand as needed, so the -b arg gives a value\n");
     fprintf(stderr, "        passed on to the CP which gives the max size of fifo entries as a way for the CP to gauge memory uses.\n");
 }
@@ -161,7 +168,13 @@ static void printHelp(char *programName) {
  * @param lbid          filled with ID of the LB to be used.
  * @param debug         filled with debug flag.
  * @param useIPv6       filled with use IP version 6 flag.
+ * @param sendAsync     filled with flag to report state to CP asynchronously.
+ * @param sendStream    filled with flag to report state to CP on a stream.
+ * @param adaptReport   filled with flag to report state to CP from a thread at an adaptive rate.
+ * @param reportMin     filled with min millisec between reports to CP if adapting.
  * @param cpAddr        filled with grpc server (control plane) IP address to info to.
+ * @param cpStandby     filled with standby control plane's IP address and port (IP:port).
+ * @param cpUnix        filled with path of control plane's unix domain socket.
  * @param clientName    filled with name of this grpc client (backend) to send to control plane.
  * @param kp            filled with PID proportional constant.
  * @param ki            filled with PID integral constant.
@@ -179,8 +192,9 @@ static void parseArgs(int argc, char **argv,
                       uint32_t *bufSize, uint32_t *fifoSize,
                       uint32_t *fillCount, int32_t *reportTime,
                       int32_t *sampleTime, uint32_t *processThds,
-                      bool *debug, bool *useIPv6,
-                      char *cpAddr, char *clientName, char *lbid,
+                      bool *debug, bool *useIPv6, bool *sendAsync, bool *sendStream,
+                      bool *adaptReport, int32_t *reportMin,
+                      char *cpAddr, char *cpStandby, char *cpUnix, char *clientName, char *lbid,
                       float *kp, float *ki, float *kd,
                       float *fill, float *ffactor, float *maxEPR, float *weight) {
 
@@ -211,6 +225,12 @@ static void parseArgs(int argc, char **argv,
                           {"stime",    1, nullptr, 20},
                           {"pid",      1, nullptr, 21},
                           {"lbid",     1, nullptr, 22},
+                          {"async",    0, nullptr, 23},
+                          {"stream",   0, nullptr, 24},
+                          {"adapt",    0, nullptr, 25},
+                          {"rmin",     1, nullptr, 26},
+                          {"cp_standby", 1, nullptr, 27},
+                          {"cp_unix",  1, nullptr, 28},
                           {0,         0, 0,    0}
             };
 
@@ -288,6 +308,34 @@ static void parseArgs(int argc, char **argv,
                 *useIPv6 = true;
                 break;
 
+            case 23:
+                // report state to CP asynchronously
+                *sendAsync = true;
+                break;
+
+            case 24:
+                // report state to CP on a stream
+                *sendStream = true;
+                break;
+
+            case 25:
+                // report state to CP from a thread, more often while fill is changing
+                *adaptReport = true;
+                break;
+
+            case 26:
+                // min reporting interval in millisec when adapting
+                i_tmp = (int) strtol(optarg, nullptr, 0);
+                if (i_tmp > 0) {
+                    *reportMin = i_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -rmin, must be >= 1 ms\n\n");
+                    printHelp(argv[0]);
+                    exit(-1);
+                }
+                break;
+
             case 3:
                 // max fifo size
                 i_tmp = (int) strtol(optarg, nullptr, 0);
@@ -413,6 +461,26 @@ static void parseArgs(int argc, char **argv,
                 strcpy(cpAddr, optarg);
                 break;
 
+            case 27:
+                // standby control plane IP:port
+                if (strlen(optarg) > 21 || strlen(optarg) < 9 || strchr(optarg, ':') == nullptr) {
+                    fprintf(stderr, "standby control plane must be IP:port\n\n");
+                    printHelp(argv[0]);
+                    exit(-1);
+                }
+                strcpy(cpStandby, optarg);
+                break;
+
+            case 28:
+                // control plane unix domain socket path
+                if (strlen(optarg) >= 108 || strlen(optarg) < 1) {
+                    fprintf(stderr, "control plane unix socket path too long/short\n\n");
+                    printHelp(argv[0]);
+                    exit(-1);
+                }
+                strcpy(cpUnix, optarg);
+                break;
+
             case 6:
                 // grpc client name
                 if (strlen(optarg) > 30 || strlen(optarg) < 1) {
@@ -985,6 +1053,9 @@ int main(int argc, char **argv) {
     uint16_t cpPort = 18347;
     bool debug = false;
     bool useIPv6 = false;
+    bool sendAsync = false;
+    bool sendStream = false;
+    bool adaptReport = false;
     bool writeToFile = false;
     bool writeToCsvFile = false;
     bool fixedFill = false;
@@ -1006,12 +1077,18 @@ int main(int argc, char **argv) {
     float    fcountFlt;
     // time period in millisec for reporting to CP
     int32_t reportTime = 1000;
+    // min time period in millisec between reports if adapting
+    int32_t reportMin = 100;
     // time period in microsec for sampling fifo
     int32_t sampleTime = 1000;
     // # thds to process reassembled events
     uint32_t processThds = 1;
 
     char cpAddr[16];
+    char cpStandby[22];
+    memset(cpStandby, 0, 22);
+    char cpUnix[108];
+    memset(cpUnix, 0, 108);
     memset(cpAddr, 0, 16);
     strcpy(cpAddr, "129.57.177.144"); // ejfat-2 by default
 
@@ -1044,7 +1121,8 @@ int main(int argc, char **argv) {
               listeningAddr, adminToken, fileName, csvFileName,
               &bufSize, &fifoCapacity, &fcount, &reportTime,
               &sampleTime, &processThds,
-              &debug, &useIPv6, cpAddr,  clientName, lbid,
+              &debug, &useIPv6, &sendAsync, &sendStream,
+              &adaptReport, &reportMin, cpAddr, cpStandby, cpUnix, clientName, lbid,
               &Kp, &Ki, &Kd, &setFill, &ffactor, &maxEPR, &weight);
 
     // give it a default name
@@ -1261,11 +1339,22 @@ int main(int argc, char **argv) {
 //    LoadBalancerServiceImpl *pGrpcService = &service;
 
     // Create grpc client of control plane
-    LbControlPlaneClient client(cpAddr, cpPort,
+    // A unix socket is used instead of the CP's address and port if given
+    std::string cpTarget = strlen(cpUnix) > 0 ? std::string("unix:") + cpUnix : std::string(cpAddr);
+
+    LbControlPlaneClient client(cpTarget, cpPort,
                                 listeningAddr, port, pRange,
                                 clientName, adminToken, lbid,
                                 weight);
 
+    if (strlen(cpStandby) > 0) {
+        char *colon = strchr(cpStandby, ':');
+        *colon = '\0';
+        client.addStandbyCp(cpStandby, (uint16_t) strtol(colon + 1, nullptr, 0));
+        fprintf(fp, "Standby control plane at %s:%s\n", cpStandby, colon + 1);
+        *colon = ':';
+    }
+
     // Register this client with the grpc server
     int32_t err = client.Register();
     if (err == -1) {
@@ -1277,6 +1366,23 @@ int main(int argc, char **argv) {
         return(1);
     }
 
+    if (sendStream) {
+        err = client.OpenStateStream();
+        if (err == 1) {
+            if (writeToFile) fprintf(fp, "GRPC client %s cannot open state stream to server, exit!\n", clientName);
+            perror("GRPC client cannot open state stream to server");
+            return(1);
+        }
+    }
+
+    // Let the client's thread decide when to report, on every sample update() feeds it the latest values
+    if (adaptReport) {
+        if (client.StartReporter(std::min(reportMin, reportTime), reportTime, 0.05F) != 0) {
+            fprintf(fp, "GRPC client %s cannot start reporter, exit!\n", clientName);
+            return(1);
+        }
+    }
+
     // Write header to data file
     if (writeToCsvFile) {
         fprintf(csvFp,
@@ -1439,8 +1545,9 @@ int main(int argc, char **argv) {
         }
 
 
-        // Every "loopMax" loops
-        if (--loopCount <= 0) {
+        // Every "loopMax" loops, or every loop if the reporter thread is sending
+        bool reportNow = (--loopCount <= 0);
+        if (adaptReport || reportNow) {
             // Update the changing variables
             if (fixedFill) {
                 // test CP by fixing fill level and setting pid error to 0
@@ -1452,12 +1559,21 @@ int main(int argc, char **argv) {
             else {
                 client.update(fillPercent, pidError);
             }
+        }
 
-            // Send to server
-            err = client.SendState();
-            if (err == 1) {
-                fprintf(fp, "GRPC client %s communication error with server during sending of data!\n", clientName);
-                break;
+        if (reportNow) {
+            // Send to server. Asynchronously, the error is from an earlier report.
+            if (!adaptReport) {
+                if (sendStream) {
+                    err = client.SendStateStream();
+                }
+                else {
+                    err = sendAsync ? client.SendStateAsync() : client.SendState();
+                }
+                if (err == 1) {
+                    fprintf(fp, "GRPC client %s communication error with server during sending of data!\n", clientName);
+                    break;
+                }
             }
 
             if (writeToCsvFile) {
@@ -1508,10 +1624,32 @@ int main(int argc, char **argv) {
                 fprintf(fp, "     Fifo level %d  Avg:  %.2f,  %.2f%%,  pid err %f\n\n",
                         ((int) curFill), fillAvg, (100.F * fillPercent), pidError);
             }
+            if (adaptReport) {
+                fprintf(fp, "     Reporter: period %u ms, sent %" PRIu64 ", errors %" PRIu64 "\n\n",
+                        client.getReportPeriod(), client.getReportCount(), client.getReportErrors());
+            }
+            if (strlen(cpStandby) > 0) {
+                fprintf(fp, "     Using CP %s, %" PRIu64 " failovers\n\n",
+                        client.getActiveCp().c_str(), client.getFailoverCount());
+            }
+            if (sendStream) {
+                fprintf(fp, "     CP hint: weight %.3f, slots %u (%" PRIu64 " hints)\n\n",
+                        client.getHintWeight(), client.getHintSlots(), client.getHintCount());
+            }
+            else if (sendAsync) {
+                fprintf(fp, "     Async reports: sent %" PRIu64 ", dropped %" PRIu64 ", failed %" PRIu64 "\n\n",
+                        client.getAsyncSent(), client.getAsyncDropped(), client.getAsyncFailed());
+            }
             fflush(fp);
         }
     }
 
+    client.StopReporter();
+
+    if (sendStream) {
+        client.CloseStateStream();
+    }
+
     // Unregister this client with the grpc server
     err = client.Deregister();
     if (err == 1) {
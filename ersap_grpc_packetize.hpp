@@ -40,12 +40,19 @@
 #include <chrono>
 #include <thread>
 #include <system_error>
+#include <random>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 
@@ -335,6 +342,36 @@ namespace ejfat {
     }
 
 
+    /**
+     * <p>
+     * Structure controlling how sendPacketizedBuf rides out a full socket buffer or qdisc.
+     * Without it, the first error from send() aborts the event.
+     * With it, ENOBUFS, EAGAIN, and EWOULDBLOCK are taken as transient:
+     * the failed fragment is retried, first right away (spins), then after waiting.
+     * For EAGAIN the wait is a poll() for POLLOUT. Since poll() does not tell when
+     * a qdisc has room again, the wait for ENOBUFS is a sleep, doubled with each retry.</p>
+     *
+     * <p>
+     * Retries also mean the data is being sent faster than the host can get it out.
+     * So each event needing retries lowers rateScale, the fraction of the set rate
+     * the caller should pace at, and each event sent cleanly slowly raises it again.</p>
+     */
+    typedef struct packetSendBackoff_t {
+        uint32_t spins       = 16;    /**< Immediate retries of a fragment before waiting. */
+        int      pollTimeout = 10;    /**< Millisec to wait for POLLOUT in one poll(). */
+        uint32_t minSleep    = 10;    /**< Microsec of first sleep after ENOBUFS. */
+        uint32_t maxSleep    = 1000;  /**< Microsec of longest sleep after ENOBUFS. */
+        uint32_t maxRetries  = 10000; /**< Give up on a fragment after this many retries. */
+
+        float    decrease    = 0.95F; /**< Multiply rateScale by this after an event with retries. */
+        float    increase    = 0.001F;/**< Add this to rateScale after an event with no retries. */
+        float    minScale    = 0.1F;  /**< Lowest rateScale. */
+        float    rateScale   = 1.F;   /**< Fraction of the set send rate to pace at. */
+
+        uint64_t retried     = 0;     /**< Total fragments which needed retrying. */
+    } packetSendBackoff;
+
+
     /**
      * <p>
      * This routine uses the latest, 20-byte RE header.
@@ -371,6 +408,9 @@ namespace ejfat {
      * @param delayCounter   value-result parameter tracking when delay was last run.
      * @param debug          turn debug printout on & off.
      * @param packetsSent    filled with number of packets sent over network (valid even if error returned).
+     * @param backoff        if not null, retry fragments that fail with ENOBUFS or EAGAIN
+     *                       as it specifies, and update its rateScale and retried count.
+     * @param fragsRetried   if not null, filled with number of fragments of this buffer that had to be retried.
      *
      * @return 0 if OK, -1 if error when sending packet. Use errno for more details.
      */
@@ -378,7 +418,8 @@ namespace ejfat {
                                  int clientSocket, uint64_t tick, int protocol, int entropy,
                                  int version, uint16_t dataId,
                                  uint32_t delay, uint32_t delayPrescale, uint32_t *delayCounter,
-                                 bool debug, int64_t *packetsSent) {
+                                 bool debug, int64_t *packetsSent,
+                                 packetSendBackoff *backoff = nullptr, uint32_t *fragsRetried = nullptr) {
 
         uint32_t bytesToWrite = dataLen;
         uint32_t remainingBytes = dataLen;
@@ -406,6 +447,9 @@ namespace ejfat {
         data[0] = htonl(backendTime);
         data[1] = htonl(totalPackets);
 
+        uint32_t retried = 0;
+        if (fragsRetried != nullptr) *fragsRetried = 0;
+
 
         while (remainingPackets-- > 0) {
             // The number of regular data bytes comprising this packet
@@ -420,11 +464,46 @@ namespace ejfat {
             // Send packet to receiver
             if (debug) fprintf(stderr, "Send %u bytes\n", bytesToWrite);
 
-            int err = send(clientSocket, buffer, bytesToWrite + HEADER_BYTES, 0);
-            if (err == -1) {
-                *packetsSent = totalPackets - remainingPackets - 1;
-                perror(nullptr);
-                return (-1);
+            int err;
+            uint32_t tries = 0, sleepTime = 0;
+
+            while ((err = send(clientSocket, buffer, bytesToWrite + HEADER_BYTES, 0)) == -1) {
+                int sendErrno = errno;
+
+                if (backoff == nullptr ||
+                    (sendErrno != ENOBUFS && sendErrno != EAGAIN && sendErrno != EWOULDBLOCK) ||
+                    tries >= backoff->maxRetries) {
+
+                    *packetsSent = totalPackets - remainingPackets - 1;
+                    if (fragsRetried != nullptr) *fragsRetried = retried;
+                    perror(nullptr);
+                    errno = sendErrno;
+                    return (-1);
+                }
+
+                if (tries++ == 0) {
+                    retried++;
+                    backoff->retried++;
+                    if (debug) fprintf(stderr, "Retry pkt %u, %s\n", packetCounter, strerror(sendErrno));
+                }
+
+                if (tries <= backoff->spins) {
+                    continue;
+                }
+
+                if (sendErrno == ENOBUFS) {
+                    // Queue below the socket is full, give it time to drain
+                    sleepTime = sleepTime == 0 ? backoff->minSleep : std::min(2*sleepTime, backoff->maxSleep);
+                    std::this_thread::sleep_for(std::chrono::microseconds(sleepTime));
+                }
+                else {
+                    // Socket buffer is full, wait for room
+                    struct pollfd pfd;
+                    pfd.fd = clientSocket;
+                    pfd.events = POLLOUT;
+                    pfd.revents = 0;
+                    poll(&pfd, 1, backoff->pollTimeout);
+                }
             }
 
             if (err != (bytesToWrite + HEADER_BYTES)) {
@@ -450,9 +529,335 @@ namespace ejfat {
 
         *packetsSent = totalPackets;
 
+        if (backoff != nullptr) {
+            if (retried > 0) {
+                backoff->rateScale = std::max(backoff->minScale, backoff->rateScale * backoff->decrease);
+            }
+            else if (backoff->rateScale < 1.F) {
+                backoff->rateScale = std::min(1.F, backoff->rateScale + backoff->increase);
+            }
+        }
+
+        if (fragsRetried != nullptr) *fragsRetried = retried;
+
         return 0;
     }
 
+
+    /**
+     * <p>
+     * Class which hands out random variates of a given distribution from tables
+     * that are pre-generated by a background thread.
+     * Sampling a std::normal_distribution or std::exponential_distribution
+     * with a Mersenne twister for each event is expensive enough to show up in
+     * the send loop at high event rates and adds jitter to it.
+     * With this class, getting the next value is just an array read.</p>
+     *
+     * <p>
+     * Two blocks of samples are kept. The caller reads from one while the other
+     * is regenerated by the filling thread. When the block being read is used up,
+     * it is handed back to the filling thread and reading continues in the other.
+     * Only one thread may call next().</p>
+     *
+     * @tparam Dist a standard library random number distribution.
+     */
+    template<typename Dist>
+    class variateCache {
+
+    public:
+
+        typedef typename Dist::result_type result_type;
+
+    private:
+
+        /** Distribution to sample. */
+        Dist dist;
+
+        /** Generator used by the filling thread. */
+        std::mt19937 gen;
+
+        /** Number of samples in each block. */
+        size_t blockSize;
+
+        /** Two blocks of samples, one being read while the other is filled. */
+        std::vector<result_type> blocks[2];
+
+        /** True if corresponding block is full of fresh samples. */
+        std::atomic<bool> filled[2];
+
+        /** Index of block currently being read. */
+        int readBlock = 0;
+
+        /** Index of next sample to read in current block. */
+        size_t index = 0;
+
+        /** Pointer to data of current block. */
+        result_type *current;
+
+        std::mutex mutex;
+        std::condition_variable needFill;
+        std::atomic<bool> quit {false};
+        std::thread filler;
+
+        variateCache(const variateCache &) = delete;
+        variateCache &operator = (const variateCache &) = delete;
+
+
+        /** Fill the given block with fresh samples. */
+        void generate(int block) {
+            result_type *data = blocks[block].data();
+            for (size_t i = 0; i < blockSize; i++) {
+                data[i] = dist(gen);
+            }
+        }
+
+
+        /** Filling thread waits for a block to be handed back, then regenerates it. */
+        void fillLoop() {
+            while (true) {
+                int block;
+                {
+                    std::unique_lock<std::mutex> lk(mutex);
+                    needFill.wait(lk, [this]() { return quit || !filled[0] || !filled[1]; });
+                    if (quit) return;
+                    block = filled[0] ? 1 : 0;
+                }
+                generate(block);
+                filled[block].store(true, std::memory_order_release);
+            }
+        }
+
+
+        /** Hand back the used up block and switch to the other one. */
+        void nextBlock() {
+            {
+                std::lock_guard<std::mutex> lk(mutex);
+                filled[readBlock].store(false, std::memory_order_relaxed);
+            }
+            needFill.notify_one();
+
+            readBlock ^= 1;
+
+            // Only waits if samples are used faster than they can be generated
+            while (!filled[readBlock].load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+
+            current = blocks[readBlock].data();
+            index = 0;
+        }
+
+
+    public:
+
+        /**
+         * Constructor. Both blocks are filled before returning.
+         * @param dist       distribution to sample.
+         * @param seed       seed for the generator.
+         * @param blockSize  number of samples in each of the 2 blocks.
+         */
+        variateCache(const Dist &dist, uint32_t seed, size_t blockSize = 65536) :
+                dist(dist), gen(seed), blockSize(blockSize) {
+
+            if (this->blockSize < 1) this->blockSize = 1;
+
+            for (int i=0; i < 2; i++) {
+                blocks[i].resize(this->blockSize);
+                generate(i);
+                filled[i] = true;
+            }
+            current = blocks[0].data();
+
+            filler = std::thread(&variateCache::fillLoop, this);
+        }
+
+
+        ~variateCache() {
+            {
+                std::lock_guard<std::mutex> lk(mutex);
+                quit = true;
+            }
+            needFill.notify_one();
+            filler.join();
+        }
+
+
+        /**
+         * Get the next sample.
+         * @return next sample.
+         */
+        inline result_type next() {
+            if (index == blockSize) {
+                nextBlock();
+            }
+            return current[index++];
+        }
+    };
+
+
+
+    /**
+     * Structure holding the running totals of what one sending thread has sent.
+     * Only the sending thread writes to it, so no atomic read-modify-write is needed,
+     * but any other thread may read it at any time. Totals are never reset;
+     * rates are found from the differences between readings.
+     * Aligned so that the stats of different sending threads do not share a cache line.
+     */
+    struct alignas(64) packetSendStats {
+        std::atomic<uint64_t> bytes   {0};  /**< Data bytes sent, NOT including headers. */
+        std::atomic<uint64_t> packets {0};  /**< Packets sent. */
+        std::atomic<uint64_t> events  {0};  /**< Events (buffers) sent. */
+        std::atomic<uint64_t> tick    {0};  /**< Tick of the next event to be sent. */
+        std::atomic<uint64_t> retries {0};  /**< Packets which had to be retried (see packetSendBackoff). */
+
+        /**
+         * Add one sent event to the totals. Only call from the sending thread.
+         * @param eventBytes    data bytes in event.
+         * @param eventPackets  packets the event was sent in.
+         * @param nextTick      tick of the next event to be sent.
+         * @param eventRetries  packets of the event which had to be retried.
+         */
+        inline void add(uint64_t eventBytes, uint64_t eventPackets, uint64_t nextTick, uint64_t eventRetries = 0) {
+            bytes.store(bytes.load(std::memory_order_relaxed) + eventBytes, std::memory_order_relaxed);
+            packets.store(packets.load(std::memory_order_relaxed) + eventPackets, std::memory_order_relaxed);
+            events.store(events.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (eventRetries > 0) {
+                retries.store(retries.load(std::memory_order_relaxed) + eventRetries, std::memory_order_relaxed);
+            }
+            tick.store(nextTick, std::memory_order_release);
+        }
+    };
+
+
+    /**
+     * Class keeping a ring of once-a-second readings of sending totals
+     * (see packetSendStats) from which the rate over the last second,
+     * an exponentially weighted moving average, and the min and max over the
+     * retained history can be found. Used by one thread only.
+     */
+    class sendRateHistory {
+
+    public:
+
+        /** Reading of the totals and the rates since the previous reading. */
+        typedef struct sample_t {
+            int64_t  time;      /**< Monotonic time of reading in microsec. */
+            uint64_t bytes;     /**< Total data bytes. */
+            uint64_t packets;   /**< Total packets. */
+            uint64_t events;    /**< Total events. */
+            double   byteRate;  /**< Bytes/sec since previous reading. */
+            double   pktRate;   /**< Packets/sec since previous reading. */
+            double   evtRate;   /**< Events/sec since previous reading. */
+        } sample;
+
+        /** Summary of one rate. */
+        typedef struct rateSummary_t {
+            double current;  /**< Rate over the last interval. */
+            double ewma;     /**< Exponentially weighted moving average. */
+            double min;      /**< Minimum over retained history. */
+            double max;      /**< Maximum over retained history. */
+        } rateSummary;
+
+    private:
+
+        std::vector<sample> ring;
+        /** Index of most recent entry. */
+        size_t latest = 0;
+        /** Number of valid entries. */
+        size_t count = 0;
+        /** Weight of newest rate in moving average. */
+        double alpha;
+
+        double byteEwma = 0., pktEwma = 0., evtEwma = 0.;
+
+        /** Reading before the first one kept in ring, only used to find the first rates. */
+        sample first {};
+        bool haveFirst = false;
+
+
+        rateSummary summarize(double sample::*rate, double ewma) const {
+            rateSummary sum {};
+            if (count == 0) return sum;
+
+            sum.current = ring[latest].*rate;
+            sum.ewma = ewma;
+            sum.min = sum.max = sum.current;
+            for (size_t i = 0; i < count; i++) {
+                double r = ring[i].*rate;
+                sum.min = std::min(sum.min, r);
+                sum.max = std::max(sum.max, r);
+            }
+            return sum;
+        }
+
+
+    public:
+
+        /**
+         * Constructor.
+         * @param entries  number of readings to keep.
+         * @param alpha    weight (0 < alpha <= 1) of the newest rate in the moving average.
+         */
+        explicit sendRateHistory(size_t entries = 60, double alpha = 0.2) :
+                ring(entries < 1 ? 1 : entries), alpha(alpha) {}
+
+
+        /**
+         * Add a reading of the totals.
+         * @param time     monotonic time of reading in microsec.
+         * @param bytes    total data bytes sent.
+         * @param packets  total packets sent.
+         * @param events   total events sent.
+         */
+        void add(int64_t time, uint64_t bytes, uint64_t packets, uint64_t events) {
+            if (!haveFirst) {
+                first = {time, bytes, packets, events, 0., 0., 0.};
+                haveFirst = true;
+                return;
+            }
+
+            const sample &prev = count > 0 ? ring[latest] : first;
+            double secs = (time - prev.time) / 1000000.;
+            if (secs <= 0.) return;
+
+            sample s {time, bytes, packets, events,
+                      (bytes - prev.bytes) / secs,
+                      (packets - prev.packets) / secs,
+                      (events - prev.events) / secs};
+
+            if (count == 0) {
+                byteEwma = s.byteRate;
+                pktEwma  = s.pktRate;
+                evtEwma  = s.evtRate;
+            }
+            else {
+                byteEwma += alpha * (s.byteRate - byteEwma);
+                pktEwma  += alpha * (s.pktRate  - pktEwma);
+                evtEwma  += alpha * (s.evtRate  - evtEwma);
+            }
+
+            latest = (count == 0) ? 0 : (latest + 1) % ring.size();
+            ring[latest] = s;
+            if (count < ring.size()) count++;
+        }
+
+
+        /** @return number of rates in history. */
+        size_t size() const {return count;}
+
+        /** @return most recent entry (only valid if size() > 0). */
+        const sample & last() const {return ring[latest];}
+
+        /** @return summary of byte rate. */
+        rateSummary byteRate()   const {return summarize(&sample::byteRate, byteEwma);}
+
+        /** @return summary of packet rate. */
+        rateSummary packetRate() const {return summarize(&sample::pktRate, pktEwma);}
+
+        /** @return summary of event rate. */
+        rateSummary eventRate()  const {return summarize(&sample::evtRate, evtEwma);}
+    };
+
 }
 
 
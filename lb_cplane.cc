@@ -12,6 +12,8 @@
 
 #include "lb_cplane.h"
 
+#include <grpcpp/alarm.h>
+
 using namespace std::chrono;
 
 
@@ -37,27 +39,23 @@ using namespace std::chrono;
 
 
         /**
-         * Update values.
-         * @state current state used to update this object. 
+         * Constructor used by control plane when registering backend.
+         * @param req           registration request from backend.
+         * @param sessionId     session id given to backend.
+         * @param sessionToken  session token given to backend.
          */
-        void BackEnd::update(const SendStateRequest* state) {
-
-            if (state->has_timestamp()) {
-                time = google::protobuf::util::TimeUtil::TimestampToMilliseconds(state->timestamp());
-                timestamp = state->timestamp();
-            }
-
-            // Now record local time
-            localTime = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-
-            sessionId = state->sessionid();
+        BackEnd::BackEnd(const RegisterRequest* req, const std::string & sessionId,
+                         const std::string & sessionToken) : BackEnd(req) {
+            this->sessionId    = sessionId;
+            this->sessionToken = sessionToken;
         }
 
 
-        /** Print out backend status. */
+        /** Print out backend's registration. */
         void BackEnd::printBackendState() const {
-        	std::cout << "State of "        << name
-                      << " @ t = "          << time
+        	std::cout << "Backend "         << name
+                      << ", session "       << sessionId
+                      << " @ "              << ipAddress << ":" << udpPort
                       << std::endl;
        }
 
@@ -74,6 +72,10 @@ using namespace std::chrono;
          *  @return backend's session ID. */
         const std::string & BackEnd::getSessionId() const {return sessionId;}
 
+        /** Get the backend's session token.
+         *  @return backend's session token. */
+        const std::string & BackEnd::getSessionToken() const {return sessionToken;}
+
         /** Get the backend's name.
          *  @return backend's name. */
         const std::string & BackEnd::getName() const {return name;}
@@ -83,19 +85,6 @@ using namespace std::chrono;
         const std::string & BackEnd::getLbId() const {return lbId;}
 
 
-        /** Get the timestamp of the latest backend's sent data.
-         *  @return timestamp of the latest backend's sent data. */
-        google::protobuf::Timestamp BackEnd::getTimestamp() const {return timestamp;}
-
-        /** Get the timestamp of the latest backend's sent data.
-         *  @return timestamp of the latest backend's sent data. */
-        int64_t BackEnd::getTime() const {return time;}
-
-        /** Get the locally set timestamp of the arrival of the latest backend's sent data.
-         *  @return locally set timestamp of the arrival of the latest backend's sent data. */
-        int64_t BackEnd::getLocalTime() const {return localTime;}
-
-
         /** Get the weight of the backend compared to other backends in schedule density.
          *  @return weight of the backend. */
         float BackEnd::getWeight() const {return weight;}
@@ -114,232 +103,2989 @@ using namespace std::chrono;
         uint32_t BackEnd::getPortRange() const {return portRange;}
 
 
-        /** Get if backend's ready to receive more data.
-        *  @return true if backend's ready to receive more data. */
-        bool BackEnd::getIsReady() const {return isReady;}
 
-        /** True if backend is actively sending data updates.
-        *  @return true if backend is actively sending data updates. */
-        bool BackEnd::getIsActive() const {return isActive;}
 
 
-        /** True if backend is actively sending data updates.
-         *  @param active true if backend is actively sending data updates, else false. */
-        void BackEnd::setIsActive(bool active) {isActive = active;}
+        ///////////////////////////////////
+        // LbBackEndView class
+        ///////////////////////////////////
 
 
+        /** @return number of backends in view. */
+        size_t LbBackEndView::size() const {return handles.size();}
 
-        
- 		/////////////////////////////////
-		// LbControlPlaneClient class
-		/////////////////////////////////
+
+        /**
+         * Load the latest state of a backend without locking.
+         * If a writer is changing it meanwhile, it is read again.
+         * @param i      index of backend in view.
+         * @param state  filled with backend's state, all but info, which is in infos.
+         * @return true if loaded, false if the backend has since deregistered.
+         */
+        bool LbBackEndView::load(size_t i, LbBackEndState *state) const {
+            const LbBackEndBlock & block = *blocks[places[i] / LbBackEndBlock::size];
+            const uint32_t p = places[i] % LbBackEndBlock::size;
+            uint32_t seq, generation;
+
+            do {
+                seq = block.sequence[p].readBegin();
+                generation           = block.generation[p].load(std::memory_order_acquire);
+                state->time          = block.time[p].load(std::memory_order_acquire);
+                state->localTime     = block.localTime[p].load(std::memory_order_acquire);
+                state->fillPercent   = block.fillPercent[p].load(std::memory_order_acquire);
+                state->pidError      = block.pidError[p].load(std::memory_order_acquire);
+                state->isReady       = block.isReady[p].load(std::memory_order_acquire);
+                state->schedWeight   = block.schedWeight[p].load(std::memory_order_acquire);
+                state->slotsAssigned = block.slotsAssigned[p].load(std::memory_order_acquire);
+                state->schedVersion  = block.schedVersion[p].load(std::memory_order_acquire);
+            } while (block.sequence[p].readRetry(seq));
+
+            state->handle = handles[i];
+            return generation == (uint32_t)(handles[i] >> 32);
+        }
+
+
+        /**
+         * Find out if a backend may have changed since its shard had the given version.
+         * @param i        index of backend in view.
+         * @param version  version of the shard, as given by LbBackEndRegistry::snapshot().
+         * @return true if the backend changed after that version, or might have.
+         */
+        bool LbBackEndView::changedAfter(size_t i, uint64_t version) const {
+            const LbBackEndBlock & block = *blocks[places[i] / LbBackEndBlock::size];
+            return block.changed[places[i] % LbBackEndBlock::size].load(std::memory_order_relaxed) > version;
+        }
+
+
+        /**
+         * Find out if a backend is still registered, without loading its state.
+         * @param i  index of backend in view.
+         * @return true if registered, false if it has since deregistered.
+         */
+        bool LbBackEndView::isRegistered(size_t i) const {
+            const LbBackEndBlock & block = *blocks[places[i] / LbBackEndBlock::size];
+            return block.generation[places[i] % LbBackEndBlock::size].load(std::memory_order_acquire) ==
+                   (uint32_t)(handles[i] >> 32);
+        }
+
+
+
+
+        ///////////////////////////////////
+        // LbBackEndRegistry class
+        ///////////////////////////////////
+
+
+        /**
+         * Count a change to a place in the version of its shard and mark the place with it,
+         * so readers looking for changes need load only the places marked since they last looked.
+         * Call with shard locked.
+         * @param version  version of shard.
+         * @param block    block of place.
+         * @param p        place in block.
+         */
+        static void countChange(std::atomic<uint64_t> & version, LbBackEndBlock & block, uint32_t p) {
+            uint64_t v = version.load(std::memory_order_relaxed) + 1;
+            block.changed[p].store(v, std::memory_order_relaxed);
+            // A reader that sees the new version sees the mark too
+            version.store(v, std::memory_order_release);
+        }
 
 
         /**
          * Constructor.
-         * @param URL   URL obtained from running lbReserve. This string
-         *              contains all info needed to register with reasonable
-         *              defaults for unspecified quantities.
-         *              Anything not specified by the URL can be set using
-         *              provided methods.
-         *
+         * @param shards  number of shards to split backends among, at least 1.
          */
-        LbControlPlaneClient::LbControlPlaneClient(const std::string& URL) {
+        LbBackEndRegistry::LbBackEndRegistry(uint32_t shards) {
+            std::random_device rd;
+            if (shards < 1) shards = 1;
+            for (uint32_t i = 0; i < shards; i++) {
+                this->shards.emplace_back(new Shard);
+                this->shards.back()->random.seed(((uint64_t)rd() << 32) | rd());
+            }
+        }
+
+
+        /**
+         * Add a backend.
+         * @param req        backend's registration request.
+         * @param sessionId  filled with session id to give backend, its handle in decimal.
+         * @param token      filled with session token to give backend.
+         * @return backend's handle.
+         */
+        LbSessionHandle LbBackEndRegistry::add(const RegisterRequest *req, std::string & sessionId, std::string & token) {
+            uint32_t shardIndex = nextShard.fetch_add(1, std::memory_order_relaxed) % shards.size();
+            Shard & shard = *shards[shardIndex];
+
+            const std::lock_guard<std::mutex> lock(shard.mutex);
+
+            uint32_t place;
+            if (!shard.freed.empty()) {
+                place = shard.freed.back();
+                shard.freed.pop_back();
+            }
+            else {
+                place = shard.generation.size();
+                shard.generation.push_back(0);
+                shard.token.push_back(0);
+                shard.info.emplace_back();
+                if (place % LbBackEndBlock::size == 0) {
+                    shard.blocks.push_back(std::make_shared<LbBackEndBlock>());
+                }
+            }
+
+            uint32_t index = place * shards.size() + shardIndex;
+            LbSessionHandle handle = ((LbSessionHandle)(++shard.generation[place]) << 32) | index;
+
+            // Never 0 so it can't be mistaken for a token that didn't parse
+            uint64_t tok;
+            while ((tok = shard.random()) == 0);
+            char hex[17];
+            snprintf(hex, sizeof(hex), "%016" PRIx64, tok);
+
+            sessionId = std::to_string(handle);
+            token = hex;
+
+            shard.token[place] = tok;
+            shard.info[place]  = std::make_shared<const BackEnd>(req, sessionId, token);
+
+            LbBackEndBlock & block = *shard.blocks[place / LbBackEndBlock::size];
+            const uint32_t p = place % LbBackEndBlock::size;
+            block.sequence[p].writeBegin();
+            block.generation[p].store(shard.generation[place], std::memory_order_release);
+            block.time[p].store(0, std::memory_order_release);
+            block.localTime[p].store(0, std::memory_order_release);
+            block.fillPercent[p].store(0.F, std::memory_order_release);
+            block.pidError[p].store(0.F, std::memory_order_release);
+            block.isReady[p].store(true, std::memory_order_release);
+            block.schedWeight[p].store(0.F, std::memory_order_release);
+            block.slotsAssigned[p].store(0, std::memory_order_release);
+            block.schedVersion[p].store(0, std::memory_order_release);
+            block.sequence[p].writeEnd();
+
+            // Publish a copy of the shard's view with the backend added
+            auto view = std::make_shared<LbBackEndView>(*shard.published);
+            view->handles.push_back(handle);
+            view->infos.push_back(shard.info[place]);
+            view->places.push_back(place);
+            view->blocks = shard.blocks;
+            std::atomic_store(&shard.published, std::shared_ptr<const LbBackEndView>(std::move(view)));
+
+            shard.count++;
+            countChange(shard.version, block, p);
+            return handle;
+        }
+
+
+        /**
+         * Remove a backend.
+         * @param handle  backend's handle.
+         * @return true if removed, false if not registered.
+         */
+        bool LbBackEndRegistry::remove(LbSessionHandle handle) {
+            uint32_t place;
+            Shard & shard = shardOf(handle, &place);
+            const std::lock_guard<std::mutex> lock(shard.mutex);
+            if (place >= shard.generation.size() || shard.generation[place] != (handle >> 32)) return false;
+
+            shard.generation[place]++;
+            shard.info[place].reset();
+            shard.freed.push_back(place);
+
+            LbBackEndBlock & block = *shard.blocks[place / LbBackEndBlock::size];
+            const uint32_t p = place % LbBackEndBlock::size;
+            block.sequence[p].writeBegin();
+            block.generation[p].store(shard.generation[place], std::memory_order_release);
+            block.sequence[p].writeEnd();
+
+            // Publish a copy of the shard's view with the backend taken out
+            auto view = std::make_shared<LbBackEndView>(*shard.published);
+            for (size_t i = 0; i < view->size(); i++) {
+                if (view->places[i] != place) continue;
+                view->handles[i] = view->handles.back();
+                view->infos[i]   = view->infos.back();
+                view->places[i]  = view->places.back();
+                view->handles.pop_back();
+                view->infos.pop_back();
+                view->places.pop_back();
+                break;
+            }
+            std::atomic_store(&shard.published, std::shared_ptr<const LbBackEndView>(std::move(view)));
+
+            shard.count--;
+            countChange(shard.version, block, p);
+            return true;
+        }
+
+
+        /**
+         * Check a backend's session token.
+         * @param handle  backend's handle.
+         * @param token   token backend sent.
+         * @return true if backend is registered with this token, else false.
+         */
+        bool LbBackEndRegistry::checkToken(LbSessionHandle handle, const std::string & token) const {
+            uint64_t tok = parseToken(token);
+            if (tok == 0) return false;
+
+            uint32_t place;
+            Shard & shard = shardOf(handle, &place);
+            const std::lock_guard<std::mutex> lock(shard.mutex);
+            return place < shard.generation.size() && shard.generation[place] == (handle >> 32) &&
+                   shard.token[place] == tok;
+        }
+
+
+        /**
+         * Update the state of a backend, if the message carries its session token.
+         * @param handle  backend's handle.
+         * @param state   backend's state.
+         * @return true if updated, false if not registered or token does not match.
+         */
+        bool LbBackEndRegistry::update(LbSessionHandle handle, const SendStateRequest & state) {
+            return updateState(handle, state, &state.token(), nullptr);
+        }
+
+
+        /**
+         * Update the state of a backend from a message on a state stream.
+         * The stream's session was authenticated by its first message, so no token is checked.
+         * @param handle   backend's handle.
+         * @param state    backend's state.
+         * @param current  if not null, filled with backend's state after the update.
+         * @return true if updated, false if not registered.
+         */
+        bool LbBackEndRegistry::update(LbSessionHandle handle, const StreamStateRequest & state,
+                                       LbBackEndState *current) {
+            return updateState(handle, state, nullptr, current);
+        }
+
+
+        /**
+         * Update the state of a backend from one entry of a batch, if it carries the session token.
+         * @param handle  backend's handle.
+         * @param state   backend's state.
+         * @return true if updated, false if not registered or token does not match.
+         */
+        bool LbBackEndRegistry::update(LbSessionHandle handle, const SessionState & state) {
+            return updateState(handle, state, &state.token(), nullptr);
+        }
+
+
+        /**
+         * Update the state of a backend from any of the messages carrying it.
+         * The token is checked under the same lock as the update.
+         * @param handle   backend's handle.
+         * @param state    backend's state.
+         * @param token    session token sent, null if the session is already authenticated.
+         * @param current  if not null, filled with backend's state after the update.
+         * @return true if updated, false if not registered or token does not match.
+         */
+        template <class STATE>
+        bool LbBackEndRegistry::updateState(LbSessionHandle handle, const STATE & state,
+                                            const std::string *token, LbBackEndState *current) {
+            uint64_t tok = token == nullptr ? 0 : parseToken(*token);
+            if (token != nullptr && tok == 0) return false;
+
+            int64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+            int64_t time = state.has_timestamp() ?
+                           google::protobuf::util::TimeUtil::TimestampToMilliseconds(state.timestamp()) : -1;
+
+            uint32_t place;
+            Shard & shard = shardOf(handle, &place);
+            const std::lock_guard<std::mutex> lock(shard.mutex);
+            if (place >= shard.generation.size() || shard.generation[place] != (handle >> 32)) return false;
+            if (token != nullptr && shard.token[place] != tok) return false;
+
+            LbBackEndBlock & block = *shard.blocks[place / LbBackEndBlock::size];
+            const uint32_t p = place % LbBackEndBlock::size;
+            block.sequence[p].writeBegin();
+            if (time >= 0) block.time[p].store(time, std::memory_order_release);
+            block.localTime[p].store(now, std::memory_order_release);
+            block.fillPercent[p].store(state.fillpercent(), std::memory_order_release);
+            block.pidError[p].store(state.controlsignal(), std::memory_order_release);
+            block.isReady[p].store(state.isready(), std::memory_order_release);
+            block.sequence[p].writeEnd();
+            countChange(shard.version, block, p);
+
+            if (current != nullptr) copyState(shard, place, handle, current);
+            return true;
+        }
+
+
+        /**
+         * Set a backend's share of the LB calendar.
+         * @param handle  backend's handle.
+         * @param weight  fraction of the LB calendar assigned to the backend.
+         * @param slots   number of LB calendar slots assigned to the backend.
+         * @return true if set, false if not registered.
+         */
+        bool LbBackEndRegistry::setSchedule(LbSessionHandle handle, float weight, uint32_t slots) {
+            uint32_t place;
+            Shard & shard = shardOf(handle, &place);
+            const std::lock_guard<std::mutex> lock(shard.mutex);
+            if (place >= shard.generation.size() || shard.generation[place] != (handle >> 32)) return false;
+
+            LbBackEndBlock & block = *shard.blocks[place / LbBackEndBlock::size];
+            const uint32_t p = place % LbBackEndBlock::size;
+            if (weight == block.schedWeight[p].load(std::memory_order_relaxed) &&
+                slots  == block.slotsAssigned[p].load(std::memory_order_relaxed)) return true;
+
+            block.sequence[p].writeBegin();
+            block.schedWeight[p].store(weight, std::memory_order_release);
+            block.slotsAssigned[p].store(slots, std::memory_order_release);
+            block.schedVersion[p].store(block.schedVersion[p].load(std::memory_order_relaxed) + 1,
+                                        std::memory_order_release);
+            block.sequence[p].writeEnd();
+            countChange(shard.version, block, p);
+            return true;
+        }
+
+
+        /**
+         * Get the state of a backend.
+         * @param handle  backend's handle.
+         * @param state   filled with backend's state.
+         * @return true if found, false if not registered.
+         */
+        bool LbBackEndRegistry::get(LbSessionHandle handle, LbBackEndState *state) const {
+            uint32_t place;
+            Shard & shard = shardOf(handle, &place);
+            const std::lock_guard<std::mutex> lock(shard.mutex);
+            if (place >= shard.generation.size() || shard.generation[place] != (handle >> 32)) return false;
+            copyState(shard, place, handle, state);
+            return true;
+        }
+
+
+        /**
+         * Get the state of all backends, loaded through the views each shard published, without locking.
+         * @param states  filled with state of each backend, cleared first.
+         */
+        void LbBackEndRegistry::getAll(std::vector<LbBackEndState> & states) const {
+            states.clear();
+            for (const auto & shard : shards) {
+                std::shared_ptr<const LbBackEndView> view = std::atomic_load(&shard->published);
+                for (size_t i = 0; i < view->size(); i++) {
+                    states.emplace_back();
+                    if (view->load(i, &states.back())) {
+                        states.back().info = view->infos[i];
+                    }
+                    else {
+                        states.pop_back();
+                    }
+                }
+            }
+        }
+
+
+        /**
+         * Get the views of all shards, through which the state of all backends is loaded, without locking.
+         * @param views     filled with the latest view of each shard, cleared first.
+         * @param versions  if not null, filled with the version of each shard, taken before its view,
+         *                  so that any backend changed after it is found by LbBackEndView::changedAfter().
+         */
+        void LbBackEndRegistry::snapshot(LbBackEndSnapshot & views, std::vector<uint64_t> *versions) const {
+            views.clear();
+            if (versions != nullptr) versions->clear();
+            for (const auto & shard : shards) {
+                if (versions != nullptr) versions->push_back(shard->version.load(std::memory_order_acquire));
+                views.push_back(std::atomic_load(&shard->published));
+            }
+        }
+
+
+        /** @return number of registered backends. */
+        size_t LbBackEndRegistry::size() const {
+            size_t count = 0;
+            for (const auto & shard : shards) {
+                count += std::atomic_load(&shard->published)->size();
+            }
+            return count;
+        }
+
+
+        /** @return version of the backends' data, which goes up with each change. */
+        uint64_t LbBackEndRegistry::getVersion() const {
+            uint64_t version = 0;
+            for (const auto & shard : shards) {
+                version += shard->version;
+            }
+            return version;
+        }
+
+
+        /**
+         * Get the handle in a session id.
+         * @param sessionId  session id given to backend.
+         * @return handle, or 0 if sessionId is not one.
+         */
+        LbSessionHandle LbBackEndRegistry::parseHandle(const std::string & sessionId) {
+            if (sessionId.empty() || !isdigit((unsigned char)sessionId[0])) return 0;
+            char *end;
+            errno = 0;
+            LbSessionHandle handle = strtoull(sessionId.c_str(), &end, 10);
+            if (*end != '\0' || errno != 0) return 0;
+            return handle;
+        }
+
+
+        /**
+         * Get the number in a session token.
+         * @param token  session token given to backend.
+         * @return number, or 0 if token is not one.
+         */
+        uint64_t LbBackEndRegistry::parseToken(const std::string & token) {
+            if (token.empty()) return 0;
+            char *end;
+            errno = 0;
+            uint64_t tok = strtoull(token.c_str(), &end, 16);
+            if (*end != '\0' || errno != 0) return 0;
+            return tok;
+        }
 
 
+        /**
+         * Find the shard of a backend.
+         * @param handle  backend's handle.
+         * @param place   filled with backend's place in shard's arrays.
+         * @return shard.
+         */
+        LbBackEndRegistry::Shard & LbBackEndRegistry::shardOf(LbSessionHandle handle, uint32_t *place) const {
+            uint32_t index = (uint32_t)handle;
+            *place = index / shards.size();
+            return *shards[index % shards.size()];
+        }
+
 
-            //std::string cpTarget = cpIP + ":" + std::to_string(cpPort);
-            //stub_ = LoadBalancer::NewStub(grpc::CreateChannel(cpTarget, grpc::InsecureChannelCredentials()));
+        /**
+         * Copy the state of a backend. Call with shard locked.
+         * @param shard   backend's shard.
+         * @param place   backend's place in shard.
+         * @param handle  backend's handle.
+         * @param state   filled with backend's state.
+         */
+        void LbBackEndRegistry::copyState(const Shard & shard, uint32_t place,
+                                          LbSessionHandle handle, LbBackEndState *state) {
+            const LbBackEndBlock & block = *shard.blocks[place / LbBackEndBlock::size];
+            const uint32_t p = place % LbBackEndBlock::size;
+            state->handle        = handle;
+            state->info          = shard.info[place];
+            state->time          = block.time[p].load(std::memory_order_relaxed);
+            state->localTime     = block.localTime[p].load(std::memory_order_relaxed);
+            state->fillPercent   = block.fillPercent[p].load(std::memory_order_relaxed);
+            state->pidError      = block.pidError[p].load(std::memory_order_relaxed);
+            state->isReady       = block.isReady[p].load(std::memory_order_relaxed);
+            state->schedWeight   = block.schedWeight[p].load(std::memory_order_relaxed);
+            state->slotsAssigned = block.slotsAssigned[p].load(std::memory_order_relaxed);
+            state->schedVersion  = block.schedVersion[p].load(std::memory_order_relaxed);
         }
 
+
+
+
+        /////////////////////////////////
+        // LbEpochs class
+        /////////////////////////////////
+
+
+        /** Sources not heard from in this long are no longer used to predict event numbers. */
+        static const seconds syncTimeout(10);
+
+
         /**
          * Constructor.
-         * @param cpIp         grpc IP address of control plane (dotted decimal format).
-         * @param cpPort       grpc port of control plane.
-         * @param beIp         data-receiving IP address of this backend client.
-         * @param bePort       data-receiving port of this backend client.
-         * @param beRange      range of data-receiving ports for this backend client.
-         * @param cliName      name of this backend.
-         * @param token        administration or instance token.
-         * @param lbId         LB's id.
-         * @param weight       weight of this client compared to others in schedule density.
-         *
+         * @param maxEpochs  most epochs in use at once, at least 2.
+         * @param boundary   epochs start at a multiple of this many events, usually the calendar size.
+         * @param lead       how far ahead of now an epoch starts, and how long after the next
+         *                   one starts that an epoch is kept.
          */
-        LbControlPlaneClient::LbControlPlaneClient(
-                const std::string& cpIP, uint16_t cpPort,
-                const std::string& beIP, uint16_t bePort,
-                PortRange beRange,
-                const std::string& cliName, const std::string& token,
-                const std::string& lbId, float weight) :
+        LbEpochs::LbEpochs(uint32_t maxEpochs, uint32_t boundary, milliseconds lead) :
+                maxEpochs(std::max(maxEpochs, 2U)), boundary(std::max(boundary, 1U)), lead(lead) {}
+
+
+        /**
+         * Record a sync message from a data source.
+         * @param srcId        id of data source.
+         * @param eventNumber  last event number the source sent.
+         * @param eventRate    rate in Hz the source is sending events, 0 if unknown.
+         */
+        void LbEpochs::sync(uint32_t srcId, uint64_t eventNumber, uint32_t eventRate) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            Source & source = sources[srcId];
+            source.eventNumber = eventNumber;
+            source.eventRate   = eventRate;
+            source.arrival     = steady_clock::now();
+        }
+
+
+        /**
+         * Predict the event number being sent now, or at some other time.
+         * @param ahead  how far from now to predict, negative for the past.
+         * @return largest event number predicted from the sources' syncs, 0 if none.
+         */
+        uint64_t LbEpochs::predictEventNumber(milliseconds ahead) const {
+            const std::lock_guard<std::mutex> lock(mutex);
+            return predict(steady_clock::now() + ahead);
+        }
+
+
+        /**
+         * Begin a new epoch, unless the most allowed are in use or its start cannot be predicted.
+         * The first epoch starts at event 0 if no source has been heard from. After that, no epoch
+         * is begun while no source has been heard from lately, since the events sent are then unknown.
+         * @param epoch  filled with new epoch.
+         * @return true if begun, false if too many epochs are in use or no source has been heard from.
+         */
+        bool LbEpochs::newEpoch(LbEpoch *epoch) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            auto now = steady_clock::now();
+            retire(now);
+            if (epochs.size() >= maxEpochs) return false;
+
+            bool heard;
+            uint64_t start = predict(now + lead, &heard);
+            if (!heard && lastEpoch > 0) return false;
+
+            // If a source restarted, this may be below the last epoch's start.
+            // It is used as is, since the events sent from now on are numbered from it.
+            start = (start + boundary - 1) / boundary * boundary;
+
+            LbEpoch next;
+            next.epoch = ++lastEpoch;
+            next.startEvent = start;
+            next.startTime = now + lead;
+            epochs.push_back(next);
+            *epoch = next;
+            return true;
+        }
 
-                cpAddr(cpIP), cpPort(cpPort), beAddr(beIP), bePort(bePort),
-                beRange(beRange), name(cliName), token(token),
-                lbId(lbId), weight(weight) {
 
-            std::string cpTarget = cpIP + ":" + std::to_string(cpPort);
-            stub_ = LoadBalancer::NewStub(grpc::CreateChannel(cpTarget, grpc::InsecureChannelCredentials()));
+        /** @return true if the most epochs allowed are in use, so no new one can begin. */
+        bool LbEpochs::isFull() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            retire(steady_clock::now());
+            return epochs.size() >= maxEpochs;
         }
 
 
+        /** @return number of the epoch whose calendar is in use now, 0 if none has begun. */
+        uint64_t LbEpochs::getCurrentEpoch() const {
+            const std::lock_guard<std::mutex> lock(mutex);
+            if (epochs.empty()) return 0;
 
+            auto now = steady_clock::now();
+            for (auto it = epochs.rbegin(); it != epochs.rend(); ++it) {
+                if (it->startTime <= now) return it->epoch;
+            }
+            // Only the first epoch ever, which has yet to start, is there
+            return epochs.front().epoch;
+        }
+
+
+        /** @return epochs kept, oldest first. Those no longer needed go when the next epoch is begun. */
+        std::vector<LbEpoch> LbEpochs::getEpochs() const {
+            const std::lock_guard<std::mutex> lock(mutex);
+            return std::vector<LbEpoch>(epochs.begin(), epochs.end());
+        }
+
+
+        /** @param count  most epochs in use at once, at least 2. */
+        void LbEpochs::setMaxEpochs(uint32_t count) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            maxEpochs = std::max(count, 2U);
+        }
 
 
         /**
-         * Update internal state of this object (eventually sent to control plane).
-         * @param fill      % of fifo filled
-         * @param pidErr    pid error (units of % fifo filled)
+         * Predict the event number at a given time. Call with mutex locked.
+         * @param when   time of prediction.
+         * @param heard  if not null, filled with true if any source was heard from lately, else false.
+         * @return largest event number predicted from the sources' syncs, 0 if none.
          */
-        void LbControlPlaneClient::update(float fill, float pidErr) {
-        	fillPercent = fill;
-        	pidError = pidErr;
-        	isReady = true;
+        uint64_t LbEpochs::predict(steady_clock::time_point when, bool *heard) const {
+            uint64_t predicted = 0;
+            auto now = steady_clock::now();
+            if (heard != nullptr) *heard = false;
+            for (const auto & entry : sources) {
+                const Source & source = entry.second;
+                if (now - source.arrival > syncTimeout) continue;
+                if (heard != nullptr) *heard = true;
+
+                double events = (double)source.eventNumber +
+                                source.eventRate * duration<double>(when - source.arrival).count();
+                if (events > 0.) predicted = std::max(predicted, (uint64_t)events);
+            }
+            return predicted;
+        }
 
-        	// This is NOT working
-        	//if (fill >= 0.95) {
-        	//    isReady = false;
-        	//}
+
+        /**
+         * Drop the oldest epochs once the next has been in use for the lead time. Call with mutex locked.
+         * Time is used rather than event number, which may stall or go backwards.
+         * @param now  time now.
+         */
+        void LbEpochs::retire(steady_clock::time_point now) {
+            while (epochs.size() > 1 && epochs[1].startTime + lead <= now) {
+                epochs.pop_front();
+            }
         }
 
 
 
+
+        /////////////////////////////////
+        // LoadBalancerServiceImpl class
+        /////////////////////////////////
+
+
         /**
-		 * Register this backend with the control plane.
-		 * @return 0 if successful, 1 if error in grpc communication
-		 */
-    	int LbControlPlaneClient::Register() {
-		    // Registration message we are sending to server
-		    RegisterRequest request;
+         * Register a backend with the control plane.
+         * @param context  unused here
+         * @param request  registration request
+         * @param reply    reply to send to client with session id and token
+         */
+        Status LoadBalancerServiceImpl::Register(ServerContext* context,
+                                                 const RegisterRequest* request,
+                                                 RegisterReply* reply) {
 
-            request.set_token(token);
-            request.set_name(name);
-            request.set_lbid(lbId);
-            request.set_weight(weight);
+            std::string sessionId, sessionToken;
+            backends.add(request, sessionId, sessionToken);
+            changed();
 
-		    // Network info for this client
-            request.set_ipaddress(beAddr);
-            request.set_udpport(bePort);
-            request.set_portrange(beRange);
+            std::cout << "Registered client \"" << request->name() << "\" as session " << sessionId
+                      << " (no authentication done)" << std::endl;
+
+            reply->set_sessionid(sessionId);
+            reply->set_token(sessionToken);
+            return Status::OK;
+        }
+
+
+        /**
+         * Unregister a backend from the control plane.
+         * @param context  unused here
+         * @param request  deregistration request
+         * @param reply    unused here
+         */
+        Status LoadBalancerServiceImpl::Deregister(ServerContext* context,
+                                                   const DeregisterRequest* request,
+                                                   DeregisterReply* reply) {
+
+            if (backends.remove(LbBackEndRegistry::parseHandle(request->sessionid()))) {
+                changed();
+            }
+            std::cout << "De-registered session " << request->sessionid() << std::endl;
+            return Status::OK;
+        }
+
+
+        /**
+         * Receive the state of a backend.
+         * The state of a session which is not registered, or whose token does not match, is ignored.
+         * @param context  unused here
+         * @param state    backend's state
+         * @param reply    unused here
+         */
+        Status LoadBalancerServiceImpl::SendState(ServerContext* context,
+                                                  const SendStateRequest* state,
+                                                  SendStateReply* reply) {
+
+            // If not registered, or token does not match
+            if (!backends.update(LbBackEndRegistry::parseHandle(state->sessionid()), *state)) {
+                std::cout << "Received state of UNREGISTERED session " << state->sessionid() << ", ignore" << std::endl;
+                return Status::OK;
+            }
+
+            changed();
+            return Status::OK;
+        }
+
+
+        /**
+         * Receive the states of many backends at once.
+         * States of sessions which are not registered, or whose token does not match, are ignored.
+         *
+         * @param context  unused here
+         * @param batch    states of backends
+         * @param reply    number of states accepted
+         * @return OK
+         */
+        Status LoadBalancerServiceImpl::SendStateBatch(ServerContext* context,
+                                                       const SendStateBatchRequest* batch,
+                                                       SendStateBatchReply* reply) {
+            int accepted = 0;
+
+            for (const SessionState & state : batch->states()) {
+                if (backends.update(LbBackEndRegistry::parseHandle(state.sessionid()), state)) accepted++;
+            }
+            if (accepted > 0) changed();
+
+            if (accepted < batch->states_size()) {
+                std::cout << "Received " << (batch->states_size() - accepted)
+                          << " states of UNREGISTERED sessions in batch, ignore" << std::endl;
+            }
+
+            reply->set_accepted(accepted);
+            return Status::OK;
+        }
+
+
+        /**
+         * Receive a stream of states from a backend. The first message identifies the session,
+         * later ones carry only the state. Whenever the backend's share of the LB calendar
+         * has changed since the last hint, a new hint is sent back on the stream.
+         *
+         * @param context  unused here
+         * @param stream   stream of states in and hints out
+         * @return OK when the backend closes the stream, UNAUTHENTICATED if first message
+         *         does not identify a registered session, NOT_FOUND if session is deregistered.
+         */
+        Status LoadBalancerServiceImpl::StreamState(ServerContext* context,
+                                                    ServerReaderWriter<StreamStateReply, StreamStateRequest>* stream) {
+
+            StreamStateRequest state;
+            StreamStateReply hint;
+            uint64_t hintVersion = 0;
+            bool sendHint;
+
+            if (!stream->Read(&state)) {
+                return Status::OK;
+            }
+
+            // Authenticate once, later messages need not identify the session
+            LbSessionHandle handle;
+            Status status = checkStreamSession(state, &handle);
+            if (!status.ok()) {
+                return status;
+            }
+
+            do {
+                status = applyStreamState(handle, state, hintVersion, &hint, &sendHint);
+                if (!status.ok()) {
+                    return status;
+                }
+
+                if (sendHint && !stream->Write(hint)) break;
+
+            } while (stream->Read(&state));
+
+            return Status::OK;
+        }
+
+
+        /**
+         * Check that the first message of a state stream identifies a registered session.
+         * @param state   first message on stream.
+         * @param handle  filled with handle of session.
+         * @return OK if it does, else UNAUTHENTICATED.
+         */
+        Status LoadBalancerServiceImpl::checkStreamSession(const StreamStateRequest & state, LbSessionHandle *handle) {
+            *handle = LbBackEndRegistry::parseHandle(state.sessionid());
+            if (!backends.checkToken(*handle, state.token())) {
+                std::cout << "Refused state stream of session " << state.sessionid() << std::endl;
+                return Status(grpc::StatusCode::UNAUTHENTICATED, "session not registered");
+            }
+            return Status::OK;
+        }
+
+
+        /**
+         * Apply a state which arrived on a stream. If the backend's schedule changed since the
+         * last hint sent, make a new hint to send back.
+         *
+         * @param handle       session of stream, from its first message.
+         * @param state        state from backend.
+         * @param hintVersion  schedule version of last hint sent, updated if a new hint is made.
+         * @param hint         filled with new hint if there is one.
+         * @param sendHint     set true if hint should be sent, else false.
+         * @return OK, or NOT_FOUND if session is deregistered.
+         */
+        Status LoadBalancerServiceImpl::applyStreamState(LbSessionHandle handle,
+                                                         const StreamStateRequest & state, uint64_t & hintVersion,
+                                                         StreamStateReply *hint, bool *sendHint) {
+            *sendHint = false;
+
+            LbBackEndState be;
+            if (!backends.update(handle, state, &be)) {
+                return Status(grpc::StatusCode::NOT_FOUND, "session deregistered");
+            }
+            changed();
+
+            if (be.schedVersion == hintVersion) {
+                return Status::OK;
+            }
+
+            hintVersion = be.schedVersion;
+            hint->set_weight(be.schedWeight);
+            hint->set_slotsassigned(be.slotsAssigned);
+
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            hint->mutable_timestamp()->set_seconds(now.tv_sec);
+            hint->mutable_timestamp()->set_nanos(now.tv_nsec);
+            *sendHint = true;
+            return Status::OK;
+        }
+
+
+        /**
+         * Return the status of all registered backends, the current epoch and the predicted event number.
+         * @param context  unused here
+         * @param request  unused here since this simulates a single LB
+         * @param reply    status of backends
+         */
+        Status LoadBalancerServiceImpl::LoadBalancerStatus(ServerContext* context,
+                                                           const LoadBalancerStatusRequest* request,
+                                                           LoadBalancerStatusReply* reply) {
+
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            reply->mutable_timestamp()->set_seconds(now.tv_sec);
+            reply->mutable_timestamp()->set_nanos(now.tv_nsec);
+            reply->set_currentepoch(epochs.getCurrentEpoch());
+            reply->set_currentpredictedeventnumber(epochs.predictEventNumber());
+
+            LbBackEndSnapshot views;
+            backends.snapshot(views);
+
+            LbBackEndState be;
+            for (const auto & view : views) {
+                for (size_t i = 0; i < view->size(); i++) {
+                    if (!view->load(i, &be)) continue;
+                    WorkerStatus *worker = reply->add_workers();
+                    worker->set_name(view->infos[i]->getName());
+                    worker->set_fillpercent(be.fillPercent);
+                    worker->set_controlsignal(be.pidError);
+                    worker->set_slotsassigned(be.slotsAssigned);
+                    *(worker->mutable_lastupdated()) =
+                            google::protobuf::util::TimeUtil::MillisecondsToTimestamp(be.localTime);
+                }
+            }
+
+            return Status::OK;
+        }
+
+
+        /**
+         * Stream the status of all registered backends. The first message holds all of them.
+         * After that, each time backends change (but no more often than the request's minInterval),
+         * a message holds only those whose fill, control signal or slots changed, or whose
+         * last report is refreshPeriod newer than the last one sent, plus those that left.
+         * So the traffic follows the rate of change, not how often the client wants to know.
+         *
+         * @param context  used to find out if the client has gone away
+         * @param request  pacing of messages, LB id unused since this simulates a single LB
+         * @param writer   stream of status changes
+         * @return OK once the client cancels the watch.
+         */
+        Status LoadBalancerServiceImpl::WatchLoadBalancerStatus(ServerContext* context,
+                                                                const WatchLoadBalancerStatusRequest* request,
+                                                                ServerWriter<LoadBalancerStatusDelta>* writer) {
+
+            milliseconds minInterval(request->mininterval());
+
+            LbStatusWatch watch;
+            if (request->refreshperiod() > 0) watch.refreshPeriod = milliseconds(request->refreshperiod());
+
+            LoadBalancerStatusDelta delta;
+            auto lastSend = steady_clock::now() - minInterval;
+
+            while (!context->IsCancelled()) {
+                if (!watch.snapshot) {
+                    // Wake on a change, or periodically to check for cancellation
+                    {
+                        std::unique_lock<std::mutex> lock(watch_mutex);
+                        waiting++;
+                        changeCv.wait_for(lock, std::min(watch.refreshPeriod, milliseconds(100)),
+                                          [&] {return backends.getVersion() != watch.seenChanges;});
+                        waiting--;
+                    }
+
+                    // Pace the messages
+                    std::this_thread::sleep_until(lastSend + minInterval);
+                }
+
+                if (!statusDelta(watch, &delta)) {
+                    continue;
+                }
+
+                bool ok = writer->Write(delta);
+                lastSend = steady_clock::now();
+
+                if (!ok) break;
+            }
+
+            return Status::OK;
+        }
+
+
+        /**
+         * Make the next message for a client watching the LB's status, if there is anything new to tell.
+         * @param watch  what the client has been sent so far, updated.
+         * @param delta  filled with message to send.
+         * @return true if delta should be sent, false if nothing changed.
+         */
+        bool LoadBalancerServiceImpl::statusDelta(LbStatusWatch & watch, LoadBalancerStatusDelta *delta) {
+            if (!watch.snapshot && backends.getVersion() == watch.seenChanges) {
+                return false;
+            }
+            return fillStatusDelta(watch, delta);
+        }
+
+
+        /**
+         * Make the next message for a client watching the LB's status.
+         * The first message holds all workers. After that only those whose fill, control signal
+         * or slots changed, or whose last report is the watch's refreshPeriod newer than the
+         * last one sent, are included, along with the names of those which left.
+         * Only shards whose version changed since the watch last looked are gone through, and in
+         * those only backends marked as changed since then are loaded. Backends which left are
+         * looked for only in shards whose list of backends changed. So the work follows the number
+         * of changes, not of backends.
+         *
+         * @param watch  what the client has been sent so far, updated.
+         * @param delta  filled with message to send.
+         * @return true if delta should be sent, false if it is empty.
+         */
+        bool LoadBalancerServiceImpl::fillStatusDelta(LbStatusWatch & watch, LoadBalancerStatusDelta *delta) {
+            bool snapshot = watch.snapshot;
+            // Look at the version before the data so no later change goes unseen
+            watch.seenChanges = backends.getVersion();
+            LbBackEndSnapshot views;
+            std::vector<uint64_t> versions;
+            backends.snapshot(views, &versions);
+
+            if (watch.views.size() != views.size()) {
+                watch.views.assign(views.size(), nullptr);
+                watch.versions.assign(views.size(), 0);
+            }
+
+            delta->Clear();
+            delta->set_snapshot(snapshot);
+
+            LbBackEndState be;
+            for (size_t s = 0; s < views.size(); s++) {
+                if (!snapshot && versions[s] == watch.versions[s]) continue;
+                const LbBackEndView & view = *views[s];
+
+                // Backends which left this shard, a view being made anew each time one does
+                const std::shared_ptr<const LbBackEndView> & old = watch.views[s];
+                if (old && old != views[s]) {
+                    for (size_t i = 0; i < old->size(); i++) {
+                        if (!old->isRegistered(i) && watch.sent.erase(old->handles[i]) > 0) {
+                            delta->add_removed(old->infos[i]->getName());
+                        }
+                    }
+                }
+
+                for (size_t i = 0; i < view.size(); i++) {
+                    if (!snapshot && !view.changedAfter(i, watch.versions[s])) continue;
+                    if (!view.load(i, &be)) continue;
+
+                    auto last = watch.sent.find(be.handle);
+                    bool send = snapshot || last == watch.sent.end() ||
+                                last->second.fillPercent   != be.fillPercent ||
+                                last->second.pidError      != be.pidError ||
+                                last->second.slotsAssigned != be.slotsAssigned ||
+                                be.localTime - last->second.localTime >= watch.refreshPeriod.count();
+                    if (!send) continue;
+
+                    WorkerStatus *worker = delta->add_workers();
+                    worker->set_name(view.infos[i]->getName());
+                    worker->set_fillpercent(be.fillPercent);
+                    worker->set_controlsignal(be.pidError);
+                    worker->set_slotsassigned(be.slotsAssigned);
+                    *(worker->mutable_lastupdated()) =
+                            google::protobuf::util::TimeUtil::MillisecondsToTimestamp(be.localTime);
+                    watch.sent[be.handle] = {be.fillPercent, be.pidError, be.slotsAssigned, be.localTime};
+                }
+
+                watch.views[s]    = views[s];
+                watch.versions[s] = versions[s];
+            }
+
+            if (!snapshot && delta->workers_size() == 0 && delta->removed_size() == 0) {
+                return false;
+            }
+
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            delta->mutable_timestamp()->set_seconds(now.tv_sec);
+            delta->mutable_timestamp()->set_nanos(now.tv_nsec);
+            delta->set_currentepoch(epochs.getCurrentEpoch());
+            delta->set_currentpredictedeventnumber(epochs.predictEventNumber());
+            watch.snapshot = false;
+            return true;
+        }
+
+
+        /** Wake status watchers after a change to the backends, which only costs a lock if there are any. */
+        void LoadBalancerServiceImpl::changed() {
+            if (waiting == 0) return;
+            // Taking the lock means a watcher is either waiting or has yet to check the version
+            const std::lock_guard<std::mutex> lock(watch_mutex);
+            changeCv.notify_all();
+        }
+
+
+        /**
+         * Get the state of all registered backends, without locking.
+         * Call this each time updated data is needed.
+         * @param backends  filled with state of each backend.
+         */
+        void LoadBalancerServiceImpl::getBackEnds(std::vector<LbBackEndState> & backends) const {
+            this->backends.getAll(backends);
+        }
+
+
+        /** @return backends registered with this server. */
+        const LbBackEndRegistry & LoadBalancerServiceImpl::getRegistry() const {return backends;}
+
+
+        /** @return epochs of the simulated LB, fed by the data sources' sync messages. */
+        LbEpochs & LoadBalancerServiceImpl::getEpochs() {return epochs;}
+
+
+        /** @return version of the backends' data, which goes up with each change. */
+        uint64_t LoadBalancerServiceImpl::getVersion() const {return backends.getVersion();}
+
+
+        /**
+         * Set a backend's share of the LB calendar, which is sent to it as a hint
+         * the next time it reports its state on a stream.
+         * @param handle  backend's handle.
+         * @param weight  fraction of the LB calendar assigned to the backend.
+         * @param slots   number of LB calendar slots assigned to the backend.
+         */
+        void LoadBalancerServiceImpl::setSchedule(LbSessionHandle handle, float weight, uint32_t slots) {
+            if (backends.setSchedule(handle, weight, slots)) changed();
+        }
+
+
+        /**
+         * Set up a builder for a server of this service, synchronous or asynchronous:
+         * its listening ports, its channel arguments, health checks and reflection.
+         *
+         * @param builder   builder to set up.
+         * @param port      TCP port to listen on, 0 for none.
+         * @param unixPath  path of unix domain socket to listen on, empty for none.
+         */
+        void LoadBalancerServiceImpl::setupBuilder(ServerBuilder & builder, uint16_t port, const std::string & unixPath) {
+            grpc::EnableDefaultHealthCheckService(true);
+            grpc::reflection::InitProtoReflectionServerBuilderPlugin();
+
+            // Listen on the given addresses without any authentication mechanism.
+            if (port > 0) {
+                std::string server_address("0.0.0.0:" + std::to_string(port));
+                builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+                std::cout << "Server listening on " << server_address << std::endl;
+            }
+            if (!unixPath.empty()) {
+                std::string unix_address = unixPath.compare(0, 5, "unix:") == 0 ? unixPath : "unix:" + unixPath;
+                builder.AddListeningPort(unix_address, grpc::InsecureServerCredentials());
+                std::cout << "Server listening on " << unix_address << std::endl;
+            }
+
+            // Allow the keepalive pings of clients with standby control planes
+            builder.AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS, 100);
+            builder.AddChannelArgument(GRPC_ARG_HTTP2_MAX_PING_STRIKES, 0);
+        }
+
+
+        /**
+         * Build and start a server for this service.
+         * Backends in the same process can always reach it through
+         * {@link LbChannelPool#addInProcessServer}, without any socket.
+         *
+         * @param port      TCP port to listen on, 0 for none.
+         * @param unixPath  path of unix domain socket to listen on, empty for none.
+         * @return started server, null if it could not start (e.g. port in use).
+         */
+        std::unique_ptr<Server> LoadBalancerServiceImpl::buildServer(uint16_t port, const std::string & unixPath) {
+            ServerBuilder builder;
+            setupBuilder(builder, port, unixPath);
+
+            // Register this as the instance through which we'll communicate with
+            // clients. In this case it corresponds to an *synchronous* service.
+            builder.RegisterService(this);
+            // Finally assemble the server.
+            return builder.BuildAndStart();
+        }
+
+
+        /**
+         * Run a server for the given service until it is shut down.
+         * @param port      TCP port to listen on, 0 for none.
+         * @param service   service to run.
+         * @param unixPath  path of unix domain socket to also listen on, empty for none.
+         * @return 0 once the server has shut down, 1 if it could not start.
+         */
+        int LoadBalancerServiceImpl::runServer(uint16_t port, LoadBalancerServiceImpl *service,
+                                               const std::string & unixPath) {
+            std::unique_ptr<Server> server = service->buildServer(port, unixPath);
+            if (!server) {
+                std::cout << "Server could not start" << std::endl;
+                return 1;
+            }
+
+            // Wait for the server to shutdown. Note that some other thread must be
+            // responsible for shutting down the server for this call to ever return.
+            server->Wait();
+            return 0;
+        }
+
+
+
+
+        /////////////////////////////////
+        // LbCalendar class
+        /////////////////////////////////
+
+
+        /**
+         * Constructor.
+         * @param size  number of slots in calendar, at least 1.
+         */
+        LbCalendar::LbCalendar(uint32_t size) : slots(size < 1 ? 1 : size, 0), starts(slots.size() + 1) {}
+
+
+        /**
+         * Make the calendar for backends of the given weights, from scratch.
+         * Backends with no (or negative) weight get no slots.
+         * If no backend has any weight, all slots go to the first backend.
+         *
+         * @param weights  weight of each backend, in any units.
+         */
+        void LbCalendar::fill(const std::vector<float> & weights) {
+            const uint32_t size = slots.size();
+            const size_t n = weights.size();
+
+            // All slots change, and they have no members until update() gives them some
+            members.clear();
+            changes.resize(size);
+            for (uint32_t t = 0; t < size; t++) changes[t] = t;
+
+            if (!apportion(weights)) {
+                std::fill(slots.begin(), slots.end(), 0);
+                return;
+            }
+
+            // Spread each backend's slots evenly: its k'th slot wants position (k + 1/2) * size / count.
+            // Sort all slots by the position they want, counting sort since positions are < size.
+            std::fill(starts.begin(), starts.end(), 0);
+            for (size_t i = 0; i < n; i++) {
+                for (uint32_t k = 0; k < counts[i]; k++) {
+                    starts[(uint32_t)((2 * k + 1) * (uint64_t)size / (2 * counts[i])) + 1]++;
+                }
+            }
+            for (uint32_t p = 0; p < size; p++) {
+                starts[p + 1] += starts[p];
+            }
+            for (size_t i = 0; i < n; i++) {
+                for (uint32_t k = 0; k < counts[i]; k++) {
+                    slots[starts[(uint32_t)((2 * k + 1) * (uint64_t)size / (2 * counts[i]))]++] = i;
+                }
+            }
+        }
+
+
+        /**
+         * Change the calendar for backends of new weights, moving as few slots as possible.
+         * Each backend keeps as many of its slots as its new share allows, and only those it
+         * has to give up, or those of backends which are gone, go to backends short of their share.
+         * A backend giving up slots gives up those where its slots are closest together, not those
+         * at one end, and new slots go in the widest gaps, so a backend's slots stay spread out
+         * over the calendar however many updates are made.
+         * The first time, or after fill(), the calendar is made from scratch.
+         * The slots whose value changed are then in getChanges(), all that needs rewriting in a table
+         * which already holds the calendar before the update. Besides those moved, these are slots
+         * kept by a backend whose index in weights differs from the last update's.
+         * A new, empty, table needs every slot.
+         *
+         * @param weights  weight of each backend, in any units.
+         * @param ids      id of each backend which stays the same from one update to the next,
+         *                 such as its session handle.
+         * @return number of slots changed.
+         */
+        uint32_t LbCalendar::update(const std::vector<float> & weights, const std::vector<LbSessionHandle> & ids) {
+            const uint32_t size = slots.size();
+            const size_t n = weights.size();
+
+            if (n == 0 || members.size() != size) {
+                fill(weights);
+                if (n > 0) {
+                    members.resize(size);
+                    for (uint32_t t = 0; t < size; t++) members[t] = ids[slots[t]];
+                }
+                return size;
+            }
+
+            apportion(weights);
+
+            index.clear();
+            for (size_t i = 0; i < n; i++) index[ids[i]] = i;
+
+            // Find each slot's backend by its new index, and the number of slots each holds
+            const uint32_t gone = UINT32_MAX;
+            previous = slots;
+            held.assign(n, 0);
+            for (uint32_t t = 0; t < size; t++) {
+                auto it = index.find(members[t]);
+                slots[t] = it == index.end() ? gone : it->second;
+                if (slots[t] != gone) held[slots[t]]++;
+            }
+
+            // List the slots each backend holds, in order
+            first.resize(n + 1);
+            first[0] = 0;
+            for (size_t i = 0; i < n; i++) first[i + 1] = first[i] + held[i];
+            placed.resize(first[n]);
+            seen.assign(n, 0);
+            for (uint32_t t = 0; t < size; t++) {
+                if (slots[t] != gone) placed[first[slots[t]] + seen[slots[t]]++] = t;
+            }
+
+            // A backend holding more than its share gives up, one at a time, the slot whose
+            // neighbours are closest together, so that those it keeps stay spread out.
+            // Those it keeps are then listed first among its slots.
+            kept.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                const uint32_t h = held[i], c = counts[i];
+                kept[i] = std::min(h, c);
+                if (h <= c) continue;
+
+                uint32_t *p = &placed[first[i]];
+                if (c == 0) {
+                    for (uint32_t m = 0; m < h; m++) slots[p[m]] = gone;
+                    continue;
+                }
+
+                before.resize(h);
+                after.resize(h);
+                for (uint32_t m = 0; m < h; m++) {
+                    before[m] = m == 0 ? h - 1 : m - 1;
+                    after[m]  = m + 1 == h ? 0 : m + 1;
+                }
+                auto span = [&](uint32_t m) {return before[m] == after[m] ? size : (p[after[m]] + size - p[before[m]]) % size;};
+
+                drops.clear();
+                for (uint32_t m = 0; m < h; m++) drops.emplace_back(span(m), m);
+                std::make_heap(drops.begin(), drops.end(), std::greater<std::pair<uint32_t, uint32_t>>());
+
+                for (uint32_t left = h; left > c; ) {
+                    std::pop_heap(drops.begin(), drops.end(), std::greater<std::pair<uint32_t, uint32_t>>());
+                    uint32_t m = drops.back().second, s = drops.back().first;
+                    drops.pop_back();
+                    // Skip slots already given up, and spans since widened
+                    if (slots[p[m]] == gone || span(m) != s) continue;
+
+                    slots[p[m]] = gone;
+                    after[before[m]] = after[m];
+                    before[after[m]] = before[m];
+                    left--;
+                    for (uint32_t q : {before[m], after[m]}) {
+                        drops.emplace_back(span(q), q);
+                        std::push_heap(drops.begin(), drops.end(), std::greater<std::pair<uint32_t, uint32_t>>());
+                    }
+                }
+
+                uint32_t k = 0;
+                for (uint32_t m = 0; m < h; m++) {
+                    if (slots[p[m]] != gone) p[k++] = p[m];
+                }
+            }
+
+            moved.clear();
+            for (uint32_t t = 0; t < size; t++) {
+                if (slots[t] == gone) moved.push_back(t);
+            }
+
+            // A backend short of its share wants its new slots in the widest gaps between those it kept,
+            // splitting the widest part left each time, or spread evenly if it kept none
+            wants.clear();
+            for (size_t i = 0; i < n; i++) {
+                const uint32_t c = counts[i], k = kept[i];
+                if (k >= c) continue;
+
+                if (k == 0) {
+                    for (uint32_t j = 0; j < c; j++) {
+                        wants.emplace_back((uint32_t)((2 * j + 1) * (uint64_t)size / (2 * c)), i);
+                    }
+                    continue;
+                }
+
+                const uint32_t *p = &placed[first[i]];
+                auto gapAfter = [&](uint32_t m) {return (m + 1 < k ? p[m + 1] : p[0] + size) - p[m];};
+
+                splits.assign(k, 0);
+                gaps.clear();
+                for (uint32_t m = 0; m < k; m++) gaps.emplace_back((double)gapAfter(m), m);
+                std::make_heap(gaps.begin(), gaps.end());
+                for (uint32_t d = k; d < c; d++) {
+                    std::pop_heap(gaps.begin(), gaps.end());
+                    uint32_t m = gaps.back().second;
+                    gaps.back().first = (double)gapAfter(m) / (++splits[m] + 1);
+                    std::push_heap(gaps.begin(), gaps.end());
+                }
+
+                for (uint32_t m = 0; m < k; m++) {
+                    for (uint32_t r = 1; r <= splits[m]; r++) {
+                        wants.emplace_back((p[m] + (uint32_t)((uint64_t)gapAfter(m) * r / (splits[m] + 1))) % size, i);
+                    }
+                }
+            }
+
+            // Give the freed slots, in order, to the wants in order of position.
+            // There are exactly as many freed slots as wants.
+            std::sort(wants.begin(), wants.end());
+            for (size_t w = 0; w < moved.size(); w++) {
+                uint32_t t = moved[w], i = wants[w].second;
+                slots[t] = i;
+                members[t] = ids[i];
+            }
+
+            // A kept slot changes too if its backend's index did
+            changes.clear();
+            for (uint32_t t = 0; t < size; t++) {
+                if (slots[t] != previous[t]) changes.push_back(t);
+            }
+
+            return changes.size();
+        }
+
+
+        /**
+         * Find the number of slots each backend gets: the whole number nearest
+         * its share, with those left over going to the largest remainders.
+         * If no backend has any weight, all slots go to the first backend.
+         *
+         * @param weights  weight of each backend, in any units.
+         * @return false if there are no backends, else true.
+         */
+        bool LbCalendar::apportion(const std::vector<float> & weights) {
+            const uint32_t size = slots.size();
+            const size_t n = weights.size();
+
+            counts.assign(n, 0);
+            if (n == 0) return false;
+
+            double sum = 0.;
+            for (float w : weights) {
+                if (w > 0.F) sum += w;
+            }
+            if (sum <= 0.) {
+                counts[0] = size;
+                return true;
+            }
+
+            // Whole slots first, then one more each for the largest remainders
+            remainders.resize(n);
+            uint32_t assigned = 0;
+            for (size_t i = 0; i < n; i++) {
+                double share = weights[i] > 0.F ? weights[i] * size / sum : 0.;
+                counts[i] = std::min((uint32_t)share, size - assigned);
+                remainders[i] = share - counts[i];
+                assigned += counts[i];
+            }
+
+            uint32_t left = size - assigned;
+            if (left > 0) {
+                order.resize(n);
+                for (size_t i = 0; i < n; i++) order[i] = i;
+                auto byRemainder = [this](uint32_t a, uint32_t b) {return remainders[a] > remainders[b];};
+                if (left < n) std::nth_element(order.begin(), order.begin() + left, order.end(), byRemainder);
+                for (uint32_t i = 0; i < left; i++) counts[order[i % n]]++;
+            }
+            return true;
+        }
+
+
+        /** @return number of slots in calendar. */
+        uint32_t LbCalendar::getSize() const {return slots.size();}
+
+        /** @return backend (index into weights given to fill() or update()) of each slot. */
+        const std::vector<uint32_t> & LbCalendar::getSlots() const {return slots;}
+
+        /** @return number of slots of each backend. */
+        const std::vector<uint32_t> & LbCalendar::getSlotCounts() const {return counts;}
+
+        /** @return slots changed by the last fill() or update(), in order. */
+        const std::vector<uint32_t> & LbCalendar::getChanges() const {return changes;}
+
+
+
+
+
+        /////////////////////////////////
+        // LbSchedule class
+        /////////////////////////////////
+
+
+        /**
+         * Take one step of the control loop: adjust the schedule density of each backend
+         * by its latest control signal, and normalize. A backend not seen before starts with
+         * a tiny share so that its control signal can grow it.
+         *
+         * @param backends  latest state of backends.
+         */
+        void LbSchedule::update(const std::vector<LbBackEndState> & backends) {
+            const size_t n = backends.size();
+            control.resize(n);
+            density.resize(n);
+
+            // Gather each backend's density from its place in the registry
+            for (size_t i = 0; i < n; i++) {
+                uint32_t place = (uint32_t)backends[i].handle;
+                if (place >= handles.size()) {
+                    handles.resize(place + 1, 0);
+                    weights.resize(place + 1, 0.F);
+                }
+                if (handles[place] != backends[i].handle) {
+                    handles[place] = backends[i].handle;
+                    weights[place] = 0.F;
+                }
+                control[i] = backends[i].pidError;
+                density[i] = weights[place];
+            }
+
+            // Activate new backends, update weights from control signals, and sum them
+            float *d = density.data();
+            const float *c = control.data();
+            float sum = 0.F;
+            size_t i = 0;
+#ifdef __SSE2__
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 tiny = _mm_set1_ps(1e-6F);
+            const __m128 one  = _mm_set1_ps(1.F);
+            __m128 sum4 = zero;
+            for (; i + 4 <= n; i += 4) {
+                __m128 w = _mm_loadu_ps(d + i);
+                __m128 unset = _mm_cmpeq_ps(w, zero);
+                w = _mm_or_ps(_mm_and_ps(unset, tiny), _mm_andnot_ps(unset, w));
+                w = _mm_mul_ps(w, _mm_add_ps(one, _mm_loadu_ps(c + i)));
+                _mm_storeu_ps(d + i, w);
+                sum4 = _mm_add_ps(sum4, w);
+            }
+            float part[4];
+            _mm_storeu_ps(part, sum4);
+            sum = (part[0] + part[1]) + (part[2] + part[3]);
+#endif
+            for (; i < n; i++) {
+                float w = d[i] == 0.F ? 1e-6F : d[i];
+                d[i] = w * (1.F + c[i]);
+                sum += d[i];
+            }
+
+            // Normalize
+            float scale = sum == 0.F ? 1.F : 1.F / sum;
+            i = 0;
+#ifdef __SSE2__
+            const __m128 scale4 = _mm_set1_ps(scale);
+            for (; i + 4 <= n; i += 4) {
+                _mm_storeu_ps(d + i, _mm_mul_ps(_mm_loadu_ps(d + i), scale4));
+            }
+#endif
+            for (; i < n; i++) {
+                d[i] *= scale;
+            }
+
+            // Keep them for the next step
+            for (i = 0; i < n; i++) {
+                weights[(uint32_t)backends[i].handle] = density[i];
+            }
+        }
+
+
+        /** @return schedule density (0-1) of each backend of the last update, in the order given. */
+        const std::vector<float> & LbSchedule::getDensity() const {return density;}
+
+        /** @return control signal of each backend of the last update, in the order given. */
+        const std::vector<float> & LbSchedule::getControl() const {return control;}
+
+
+
+        
+ 		/////////////////////////////////
+		// Calls to control plane
+		/////////////////////////////////
+
+
+        /** Method of stub which makes a blocking unary call. */
+        template <typename Req, typename Rep>
+        using BlockingRpc = Status (LoadBalancer::Stub::*)(ClientContext*, const Req&, Rep*);
+
+        /** Method of stub which prepares an asynchronous unary call. */
+        template <typename Req, typename Rep>
+        using PrepareRpc = std::unique_ptr<ClientAsyncResponseReader<Rep>>
+                           (LoadBalancer::Stub::*)(ClientContext*, const Req&, CompletionQueue*);
+
+
+        /**
+         * Make one attempt at a call which is not hedged, blocking until it is done.
+         * Nothing is made for the call beyond its context, so this is the path for frequent calls.
+         *
+         * @param stub     stub to call with.
+         * @param call     stub method making the call.
+         * @param request  request to send.
+         * @param reply    filled with reply.
+         * @param policy   deadline policy.
+         * @param stats    counters to update.
+         * @return status of call.
+         */
+        template <typename Req, typename Rep>
+        static Status attemptRpc(LoadBalancer::Stub *stub, BlockingRpc<Req, Rep> call,
+                                 const Req & request, Rep *reply,
+                                 const LbRpcPolicy & policy, LbRpcStats & stats) {
+            ClientContext context;
+            if (policy.deadline > 0) context.set_deadline(system_clock::now() + milliseconds(policy.deadline));
+
+            Status status = (stub->*call)(&context, request, reply);
+            if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+                stats.timeouts++;
+            }
+            return status;
+        }
+
+
+        /**
+         * Make one hedged attempt at a call.
+         * The call is made asynchronously so that, if no successful reply comes within
+         * the hedge delay, a second copy can be sent, at once if the first has already failed.
+         * The first successful reply is used (or the last failure if both fail)
+         * and the other copy is cancelled.
+         *
+         * @param stub     stub to call with.
+         * @param prepare  stub method preparing the call.
+         * @param request  request to send.
+         * @param reply    filled with reply.
+         * @param policy   deadline and hedging policy.
+         * @param stats    counters to update.
+         * @return status of call.
+         */
+        template <typename Req, typename Rep>
+        static Status attemptHedgedRpc(LoadBalancer::Stub *stub, PrepareRpc<Req, Rep> prepare,
+                                       const Req & request, Rep *reply,
+                                       const LbRpcPolicy & policy, LbRpcStats & stats) {
+            CompletionQueue cq;
+            ClientContext context[2];
+            Status status[2];
+            Rep hedgeReply;
+            Rep *replies[2] = {reply, &hedgeReply};
+            std::unique_ptr<ClientAsyncResponseReader<Rep>> call[2];
+            bool done[2] = {false, false};
+
+            auto deadline = system_clock::now() + milliseconds(policy.deadline);
+            int started = 0, pending = 0, winner = -1, last = -1;
+
+            auto start = [&](int i) {
+                if (policy.deadline > 0) context[i].set_deadline(deadline);
+                call[i] = (stub->*prepare)(&context[i], request, &cq);
+                call[i]->StartCall();
+                call[i]->Finish(replies[i], &status[i], (void *)(intptr_t)i);
+                started++;
+                pending++;
+            };
+
+            auto finish = [&](void *tag) {
+                int i = (int)(intptr_t)tag;
+                done[i] = true;
+                pending--;
+                last = i;
+                if (status[i].ok()) winner = i;
+            };
+
+            start(0);
+
+            void *tag;
+            bool ok;
+
+            auto hedgeTime = system_clock::now() + milliseconds(policy.hedgeDelay);
+            if (cq.AsyncNext(&tag, &ok, hedgeTime) == CompletionQueue::GOT_EVENT) {
+                finish(tag);
+            }
+
+            // Send the hedge unless the first copy already succeeded, even if it failed quickly
+            if (winner < 0 && !(policy.deadline > 0 && system_clock::now() >= deadline)) {
+                start(1);
+                stats.hedges++;
+            }
+
+            while (winner < 0 && pending > 0) {
+                cq.Next(&tag, &ok);
+                finish(tag);
+            }
+
+            // If both failed, the one finishing last is reported
+            if (winner < 0) winner = last;
+
+            // Cancel and wait for the copy whose reply is not used
+            for (int i=0; i < started; i++) {
+                if (!done[i]) context[i].TryCancel();
+            }
+            while (pending > 0) {
+                cq.Next(&tag, &ok);
+                pending--;
+            }
+            cq.Shutdown();
+            while (cq.Next(&tag, &ok));
+
+            if (winner == 1) {
+                reply->Swap(&hedgeReply);
+                stats.hedgeWins++;
+            }
+            if (status[winner].error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+                stats.timeouts++;
+            }
+            return status[winner];
+        }
+
+
+        /**
+         * Make a call to the control plane following the given policy.
+         * Each attempt has a deadline. If the control plane is unavailable, or if a repeatable
+         * call timed out, the call is tried again after an exponential backoff with jitter.
+         * Repeatable calls may also be hedged, in which case they are made asynchronously,
+         * otherwise the blocking stub method is used.
+         *
+         * @param stub        stub to call with.
+         * @param call        stub method making the call.
+         * @param prepare     stub method preparing the call, used if hedged.
+         * @param request     request to send.
+         * @param reply       filled with reply.
+         * @param policy      deadline, retry and hedging policy.
+         * @param stats       counters to update.
+         * @param repeatable  true if repeating the call has no further effect on the CP.
+         * @return status of last attempt.
+         */
+        template <typename Req, typename Rep>
+        static Status callRpc(LoadBalancer::Stub *stub, BlockingRpc<Req, Rep> call, PrepareRpc<Req, Rep> prepare,
+                              const Req & request, Rep *reply,
+                              const LbRpcPolicy & policy, LbRpcStats & stats, bool repeatable) {
+
+            static thread_local std::mt19937 generator(std::random_device{}());
+            std::uniform_real_distribution<float> jitter(1.F - policy.jitter, 1.F + policy.jitter);
+
+            auto t1 = steady_clock::now();
+            uint32_t backoff = policy.backoff;
+            bool hedge = repeatable && policy.hedgeDelay > 0;
+            Status status;
+
+            for (uint32_t attempt = 0; ; attempt++) {
+                status = hedge ? attemptHedgedRpc(stub, prepare, request, reply, policy, stats) :
+                                 attemptRpc(stub, call, request, reply, policy, stats);
+                if (status.ok()) break;
+
+                bool retry = status.error_code() == grpc::StatusCode::UNAVAILABLE ||
+                             (repeatable && status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED);
+                if (!retry || attempt >= policy.retries) break;
+
+                std::this_thread::sleep_for(microseconds((int64_t)(1000.F * backoff * jitter(generator))));
+                backoff = std::min(2*backoff, policy.maxBackoff);
+                stats.retries++;
+            }
+
+            stats.record(duration_cast<microseconds>(steady_clock::now() - t1).count(), status.ok());
+            return status;
+        }
+
+
+namespace {
+
+        /**
+         * A call to the control plane made on the completion queue of LbCallQueue.
+         * Made with new, it is deleted by the queue's thread once done.
+         */
+        class LbQueuedCall {
+            public:
+            virtual ~LbQueuedCall() = default;
+
+            /**
+             * Carry on with the call after it got an event from the queue.
+             * @return true if the call is done.
+             */
+            virtual bool proceed() = 0;
+        };
+
+
+        /**
+         * Completion queue shared by all calls made without waiting for their answer,
+         * with the one thread which finishes them. So any number of calls can be in flight
+         * without a thread for each. Made on first use and intentionally leaked: it is never
+         * shut down and its thread never joined, so that calls may still be made and finished
+         * while static objects are destroyed at exit. The OS reclaims both when the process ends.
+         */
+        class LbCallQueue {
+            public:
+
+            /** @return shared queue, or null if its thread could not be started. */
+            static CompletionQueue * get() {
+                static LbCallQueue *queue = make();
+                return queue == nullptr ? nullptr : &queue->cq;
+            }
+
+            private:
+
+            CompletionQueue cq;
+            std::thread thread;
+
+            LbCallQueue() : thread(&LbCallQueue::drain, this) {}
+
+            static LbCallQueue * make() {
+                try {
+                    return new LbCallQueue;
+                }
+                catch (const std::system_error & e) {
+                    std::cout << "Cannot start thread for calls to control plane: " << e.what() << std::endl;
+                    return nullptr;
+                }
+            }
+
+            void drain() {
+                void *tag;
+                bool ok;
+                while (cq.Next(&tag, &ok)) {
+                    LbQueuedCall *call = static_cast<LbQueuedCall *>(tag);
+                    if (call->proceed()) delete call;
+                }
+            }
+        };
+
+
+        /**
+         * A unary call made on the LbCallQueue following the given policy, as callRpc() does
+         * but without hedging. A failed attempt is retried after a backoff timed by an alarm
+         * on the queue, so the queue's thread never waits. Once done, the reply is handed to
+         * a function whose return value completes the future given by start().
+         */
+        template <typename Req, typename Rep>
+        class LbQueuedUnaryCall : public LbQueuedCall {
+            public:
+
+            /** Message to send, filled in before start(). */
+            Req request;
+
+            /**
+             * Constructor.
+             * @param stub        stub to call with, which must last until the call is done.
+             * @param prepare     stub method preparing the call.
+             * @param cq          queue from LbCallQueue::get().
+             * @param policy      deadline and retry policy.
+             * @param stats       counters to update, which must last until the call is done.
+             * @param repeatable  true if repeating the call has no further effect on the CP.
+             * @param done        called with the final status and reply, returns the future's value.
+             */
+            LbQueuedUnaryCall(LoadBalancer::Stub *stub, PrepareRpc<Req, Rep> prepare, CompletionQueue *cq,
+                        const LbRpcPolicy & policy, LbRpcStats & stats, bool repeatable,
+                        std::function<int(const Status &, const Rep &)> done) :
+                    stub(stub), prepare(prepare), cq(cq), policy(policy), stats(stats),
+                    repeatable(repeatable), done(std::move(done)), backoff(policy.backoff) {}
+
+            /**
+             * Make the call. The object is then owned by the queue.
+             * @return future holding the value returned by done.
+             */
+            std::future<int> start() {
+                std::future<int> result = promise.get_future();
+                t1 = steady_clock::now();
+                attempt();
+                return result;
+            }
+
+            bool proceed() override {
+                if (waiting) {
+                    waiting = false;
+                    attempt();
+                    return false;
+                }
+
+                if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+                    stats.timeouts++;
+                }
+
+                bool retry = status.error_code() == grpc::StatusCode::UNAVAILABLE ||
+                             (repeatable && status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED);
+                if (retry && attempts <= policy.retries) {
+                    static thread_local std::mt19937 generator(std::random_device{}());
+                    std::uniform_real_distribution<float> jitter(1.F - policy.jitter, 1.F + policy.jitter);
+
+                    waiting = true;
+                    alarm.reset(new grpc::Alarm);
+                    alarm->Set(cq, system_clock::now() + microseconds((int64_t)(1000.F * backoff * jitter(generator))), this);
+                    backoff = std::min(2*backoff, policy.maxBackoff);
+                    stats.retries++;
+                    return false;
+                }
+
+                stats.record(duration_cast<microseconds>(steady_clock::now() - t1).count(), status.ok());
+                promise.set_value(done(status, reply));
+                return true;
+            }
+
+            private:
+
+            LoadBalancer::Stub *stub;
+            PrepareRpc<Req, Rep> prepare;
+            CompletionQueue *cq;
+            LbRpcPolicy policy;
+            LbRpcStats & stats;
+            bool repeatable;
+            std::function<int(const Status &, const Rep &)> done;
+
+            std::unique_ptr<ClientContext> context;
+            std::unique_ptr<ClientAsyncResponseReader<Rep>> reader;
+            std::unique_ptr<grpc::Alarm> alarm;
+            Rep reply;
+            Status status;
+            std::promise<int> promise;
+
+            steady_clock::time_point t1;
+            uint32_t backoff;
+            uint32_t attempts = 0;
+            /** True while waiting for the alarm ending a backoff. */
+            bool waiting = false;
+
+            /** Start an attempt, a context cannot be used twice so each gets its own. */
+            void attempt() {
+                attempts++;
+                context.reset(new ClientContext);
+                if (policy.deadline > 0) context->set_deadline(system_clock::now() + milliseconds(policy.deadline));
+                reader = (stub->*prepare)(context.get(), request, cq);
+                reader->StartCall();
+                reader->Finish(&reply, &status, this);
+            }
+        };
+
+} // anonymous namespace
+
+
+
+ 		/////////////////////////////////
+		// LbChannelPool class
+		/////////////////////////////////
+
+
+        std::mutex LbChannelPool::poolMutex;
+        std::unordered_map<std::string, LbChannelPool::targetChannels> LbChannelPool::pool;
+        uint32_t LbChannelPool::subchannels = 1;
+        std::unordered_map<std::string, Server *> LbChannelPool::inProcessServers;
+
+
+        /**
+         * Make the target of a control plane.
+         * @param cpIP    IP address or host name of control plane, or a full target
+         *                starting with "unix:" or "inproc:" in which case port is ignored.
+         * @param cpPort  grpc port of control plane.
+         * @return target.
+         */
+        std::string LbChannelPool::target(const std::string& cpIP, uint16_t cpPort) {
+            if (cpIP.compare(0, 5, "unix:") == 0 || cpIP.compare(0, 7, "inproc:") == 0) {
+                return cpIP;
+            }
+            return cpIP + ":" + std::to_string(cpPort);
+        }
+
+
+        /**
+         * Make a server in this process reachable by the target "inproc:name".
+         * Calls made this way skip the network stack entirely, which is useful for benchmarks.
+         * Add it before making any channel to that target.
+         * @param name    name of server.
+         * @param server  started server.
+         */
+        void LbChannelPool::addInProcessServer(const std::string& name, Server *server) {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            inProcessServers[name] = server;
+        }
+
+
+        /**
+         * Forget a server added with addInProcessServer(). Channels to it must no longer be used.
+         * @param name  name of server.
+         */
+        void LbChannelPool::removeInProcessServer(const std::string& name) {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            inProcessServers.erase(name);
+            pool.erase("inproc:" + name);
+        }
+
+
+        /**
+         * Get a channel to the given target, shared with other users of that target
+         * asking for the same keepalive.
+         * @param target     host:port of control plane.
+         * @param keepalive  if > 0, millisec between keepalive pings on a call in progress. If a ping
+         *                   is not answered within as long again, the connection is closed, so calls
+         *                   to a control plane which has hung, without closing it, end in error.
+         *                   The control plane must allow pings that often.
+         * @return channel to target.
+         */
+        std::shared_ptr<Channel> LbChannelPool::getChannel(const std::string& target, uint32_t keepalive) {
+            std::lock_guard<std::mutex> lock(poolMutex);
+
+            bool inProcess = target.compare(0, 7, "inproc:") == 0;
+            if (inProcess) keepalive = 0;
+
+            targetChannels & tc = pool[keepalive > 0 ? target + "#keepalive=" + std::to_string(keepalive) : target];
+            if (tc.channels.size() != subchannels) {
+                tc.channels.resize(subchannels);
+            }
+
+            uint32_t index = tc.next++ % subchannels;
+            std::shared_ptr<Channel> channel = tc.channels[index].lock();
+
+            if (!channel) {
+                // grpc shares connections between channels with the same args,
+                // so make each channel's args differ to give it its own.
+                grpc::ChannelArguments args;
+                args.SetInt("ejfat.subchannel", (int)index);
+                if (keepalive > 0) {
+                    args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, (int)keepalive);
+                    args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, (int)keepalive);
+                    // Keep pinging a stream on which only this end writes
+                    args.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+                }
+
+                auto server = inProcess ?
+                              inProcessServers.find(target.substr(7)) : inProcessServers.end();
+                if (server != inProcessServers.end()) {
+                    channel = server->second->InProcessChannel(args);
+                }
+                else {
+                    channel = grpc::CreateCustomChannel(target, grpc::InsecureChannelCredentials(), args);
+                }
+                tc.channels[index] = channel;
+            }
+
+            return channel;
+        }
+
+
+        /**
+         * Set the number of separate connections made to each target.
+         * Channels already handed out are not affected.
+         * @param count  number of connections (1 by default), 0 is taken as 1.
+         */
+        void LbChannelPool::setSubchannels(uint32_t count) {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            subchannels = count < 1 ? 1 : count;
+        }
+
+
+        /** @return number of separate connections made to each target. */
+        uint32_t LbChannelPool::getSubchannels() {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            return subchannels;
+        }
+
+
+        /** @return number of channels currently in use, over all targets. */
+        size_t LbChannelPool::getChannelCount() {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            size_t count = 0;
+            for (const auto & entry : pool) {
+                for (const auto & channel : entry.second.channels) {
+                    if (!channel.expired()) count++;
+                }
+            }
+            return count;
+        }
+
+
+
+ 		/////////////////////////////////
+		// LbControlPlaneClient class
+		/////////////////////////////////
+
+
+        /**
+         * Constructor.
+         * @param URL   URL obtained from running lbReserve. This string
+         *              contains all info needed to register with reasonable
+         *              defaults for unspecified quantities.
+         *              Anything not specified by the URL can be set using
+         *              provided methods.
+         *
+         */
+        LbControlPlaneClient::LbControlPlaneClient(const std::string& URL) {
+
+
+
+            //std::string cpTarget = LbChannelPool::target(cpIP, cpPort);
+            //stub_ = LoadBalancer::NewStub(LbChannelPool::getChannel(cpTarget));
+        }
+
+        /**
+         * Constructor.
+         * @param cpIp         grpc IP address of control plane (dotted decimal format),
+         *                     or "unix:path" or "inproc:name" (see {@link LbChannelPool}).
+         * @param cpPort       grpc port of control plane.
+         * @param beIp         data-receiving IP address of this backend client.
+         * @param bePort       data-receiving port of this backend client.
+         * @param beRange      range of data-receiving ports for this backend client.
+         * @param cliName      name of this backend.
+         * @param token        administration or instance token.
+         * @param lbId         LB's id.
+         * @param weight       weight of this client compared to others in schedule density.
+         *
+         */
+        LbControlPlaneClient::LbControlPlaneClient(
+                const std::string& cpIP, uint16_t cpPort,
+                const std::string& beIP, uint16_t bePort,
+                PortRange beRange,
+                const std::string& cliName, const std::string& token,
+                const std::string& lbId, float weight) :
+
+                cpAddr(cpIP), cpPort(cpPort), beAddr(beIP), bePort(bePort),
+                beRange(beRange), name(cliName), token(token),
+                lbId(lbId), weight(weight) {
+
+            addStandbyCp(cpIP, cpPort);
+        }
+
+
+        /**
+         * Destructor. Cancels any asynchronous SendState call in progress
+         * and stops the thread handling them.
+         */
+        LbControlPlaneClient::~LbControlPlaneClient() {
+            StopReporter();
+
+            if (stateStream) {
+                streamContext->TryCancel();
+                streamThread.join();
+                stateStream->Finish();
+            }
+
+            if (!asyncThread.joinable()) return;
+
+            {
+                std::lock_guard<std::mutex> lock(asyncMutex);
+                asyncQuit = true;
+                if (asyncInFlight) asyncContext->TryCancel();
+            }
+
+            asyncCq.Shutdown();
+            asyncThread.join();
+        }
+
+
+
+        /**
+         * Update internal state of this object (eventually sent to control plane).
+         * @param fill      % of fifo filled
+         * @param pidErr    pid error (units of % fifo filled)
+         */
+        void LbControlPlaneClient::update(float fill, float pidErr) {
+        	// This is NOT working
+        	//if (fill >= 0.95) {
+        	//    isReady = false;
+        	//}
+        	state.publish(fill, pidErr, true);
+        }
+
+
+        /**
+         * Update internal state of this object (eventually sent to control plane).
+         * Does not lock or allocate, so may be called by any thread in the data path
+         * while another thread sends the state.
+         * @param fill      % of fifo filled
+         * @param pidErr    pid error (units of % fifo filled)
+         * @param ready     ready to receive data or not
+         */
+        void LbControlPlaneClient::update(float fill, float pidErr, bool ready) {
+        	state.publish(fill, pidErr, ready);
+        }
+
+
+        /** @return consistent copy of the state last given to update(). */
+        LbState LbControlPlaneClient::getState() const {
+            return state.read();
+        }
+
+
+
+        /**
+		 * Register this backend with the control plane.
+		 * If that fails and standby control planes were added, register with
+		 * the first of them which works.
+		 * @return 0 if successful, 1 if error in grpc communication
+		 */
+    	int LbControlPlaneClient::Register() {
+            int err = registerActive();
+            if (err == 1 && cpEndpoints.size() > 1) {
+                err = failover();
+            }
+            return err;
+        }
+
+
+        /**
+		 * Register this backend with the control plane in use.
+		 * @return 0 if successful, 1 if error in grpc communication
+		 */
+    	int LbControlPlaneClient::registerActive() {
+		    // Registration message we are sending to server
+		    RegisterRequest request;
+
+            request.set_token(token);
+            request.set_name(name);
+            request.set_lbid(lbId);
+            request.set_weight(weight);
+
+		    // Network info for this client
+            request.set_ipaddress(beAddr);
+            request.set_udpport(bePort);
+            request.set_portrange(beRange);
+
+		    // Container for the response we expect from server
+		    RegisterReply reply;
+
+		    // The actual RPC
+		    Status status = callRpc(stub(), &LoadBalancer::Stub::Register, &LoadBalancer::Stub::PrepareAsyncRegister,
+		                            request, &reply, callPolicy(), rpcStats, false);
+
+		    // Act upon its status
+		    if (!status.ok()) {
+		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+		        return 1;
+		    }
+
+		    // Two things returned from CP
+            {
+                std::lock_guard<std::mutex> lock(sessionMutex);
+                sessionId    = reply.sessionid();
+                sessionToken = reply.token();
+            }
+
+            // The session does not change from report to report, so set it in the
+            // reused report messages only once
+            setSession(stateRequest);
+            {
+                std::lock_guard<std::mutex> lock(asyncMutex);
+                setSession(asyncRequest);
+                setSession(pendingRequest);
+            }
+
+		    return 0;
+    	}
+    	
+ 
+        /**
+		 * Unregister this backend with the control plane.
+		 * @return 0 if successful, 1 if error in grpc communication
+		 */
+    	int LbControlPlaneClient::Deregister() const {
+
+    	    // Deregistration message we are sending to server
+		    DeregisterRequest request;
+            std::string id, token;
+            getSession(id, token);
+            request.set_token(token);
+            request.set_lbid(lbId);
+            request.set_sessionid(id);
+
+		    // Container for the response we expect from server
+		    DeregisterReply reply;
+
+		    // The actual RPC
+		    Status status = callRpc(stub(), &LoadBalancer::Stub::Deregister, &LoadBalancer::Stub::PrepareAsyncDeregister,
+		                            request, &reply, callPolicy(), rpcStats, false);
+
+		    // Act upon its status
+		    if (!status.ok()) {
+		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+		        return 1;
+		    }
+            return 0;
+        }
+    	
+    	  	
+    	
+        /**
+         * Set this backend's session in a message used to report its state.
+         * @param request message to set.
+         */
+        void LbControlPlaneClient::setSession(SendStateRequest & request) const {
+            request.set_token(sessionToken);
+            request.set_lbid(lbId);
+            request.set_sessionid(sessionId);
+        }
+
+
+        /**
+         * Fill a message, whose session is already set, with the current state of this backend.
+         * Only scalars are written. Once the message has been used, its timestamp exists
+         * and is overwritten, so no memory is allocated.
+         * @param request message to fill.
+         */
+        void LbControlPlaneClient::fillStateRequest(SendStateRequest & request) const {
+            // Set the time
+            struct timespec t1;
+            clock_gettime(CLOCK_REALTIME, &t1);
+            auto timestamp = request.mutable_timestamp();
+            timestamp->set_seconds(t1.tv_sec);
+            timestamp->set_nanos(t1.tv_nsec);
+
+            LbState current = state.read();
+            request.set_fillpercent(current.fillPercent);
+            request.set_controlsignal(current.pidError);
+
+            // In order NOT to throw the CP into unstable behavior,
+            // always say the we are ready to receive data.
+            request.set_isready(current.isReady);
+        }
+
+
+        /**
+		 * Send the state of this backend to the control plane.
+		 * The request and reply messages are kept from call to call and only the changing
+		 * values are updated, so building the report allocates no memory.
+		 * The context cannot be reused by gRPC and is made anew each call.
+		 * A report which timed out is not repeated since a newer one will follow,
+		 * unless standbys were added, in which case this backend switches to a standby
+		 * control plane, registers with it and sends the report there.
+		 * @return 0 if successful, 1 if error in grpc communication
+		 */
+    	int LbControlPlaneClient::SendState() {
+            fillStateRequest(stateRequest);
+
+		    // The actual RPC.
+            Status status = callRpc(stub(), &LoadBalancer::Stub::SendState, &LoadBalancer::Stub::PrepareAsyncSendState,
+                                    stateRequest, &stateReply, callPolicy(), rpcStats, false);
+
+            if ((status.error_code() == grpc::StatusCode::UNAVAILABLE ||
+                 status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) && failover() == 0) {
+                fillStateRequest(stateRequest);
+                status = callRpc(stub(), &LoadBalancer::Stub::SendState, &LoadBalancer::Stub::PrepareAsyncSendState,
+                                 stateRequest, &stateReply, callPolicy(), rpcStats, false);
+            }
+
+		    // Act upon its status.
+		    if (!status.ok()) {
+		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+		        return 1;
+		    }
+
+		    return 0;
+		}
+
+
+        /**
+         * Send the state of this backend to the control plane without waiting for the reply.
+         * The call is made on a completion queue which a background thread drains.
+         * Only one call is ever in progress. If a report is made while one is,
+         * it is sent once the one in progress finishes, unless it is replaced by a
+         * newer report first, in which case the older one is dropped as stale.
+         *
+         * If an earlier report failed and standbys were added, this backend switches
+         * to a standby control plane and registers with it before returning.
+         *
+         * @return 0 if successful, 1 if an earlier asynchronous report failed
+         *         since the last call to this method.
+         */
+        int LbControlPlaneClient::SendStateAsync() {
+            bool failed = false;
+
+            {
+                std::lock_guard<std::mutex> lock(asyncMutex);
+
+                if (!asyncThread.joinable()) {
+                    asyncThread = std::thread(&LbControlPlaneClient::drainAsyncSendState, this);
+                }
+
+                if (asyncInFlight) {
+                    if (asyncPending) asyncDropped++;
+                    fillStateRequest(pendingRequest);
+                    asyncPending = true;
+                }
+                else {
+                    fillStateRequest(asyncRequest);
+                    startAsyncSendState();
+                }
+
+                failed = asyncError;
+                asyncError = false;
+            }
+
+            if (failed) {
+                // Registering locks asyncMutex to update the session of queued reports
+                failover();
+                return 1;
+            }
+            return 0;
+        }
+
+
+        /**
+         * Open a stream to the control plane on which to send the state of this backend,
+         * instead of calling SendState each time. This backend's session is identified
+         * only in the first message, which carries the current state.
+         * Scheduling hints sent back by the control plane are read by a background thread
+         * and can be had with getHintWeight() and getHintSlots().
+         * Call after Register().
+         *
+         * @return 0 if successful, 1 if error in grpc communication or stream already open.
+         */
+        int LbControlPlaneClient::OpenStateStream() {
+            if (stateStream) return 1;
+
+            streamContext.reset(new ClientContext);
+            stateStream = stub()->StreamState(streamContext.get());
+            streamBroken = false;
+
+            streamRequest.Clear();
+            streamRequest.set_token(sessionToken);
+            streamRequest.set_lbid(lbId);
+            streamRequest.set_sessionid(sessionId);
+            struct timespec t1;
+            clock_gettime(CLOCK_REALTIME, &t1);
+            streamRequest.mutable_timestamp()->set_seconds(t1.tv_sec);
+            streamRequest.mutable_timestamp()->set_nanos(t1.tv_nsec);
+            LbState current = state.read();
+            streamRequest.set_fillpercent(current.fillPercent);
+            streamRequest.set_controlsignal(current.pidError);
+            streamRequest.set_isready(current.isReady);
+
+            streamThread = std::thread(&LbControlPlaneClient::readStateStream, this);
+
+            if (!stateStream->Write(streamRequest)) {
+                CloseStateStream();
+                return 1;
+            }
+
+            // Session need not be sent again
+            streamRequest.clear_token();
+            streamRequest.clear_lbid();
+            streamRequest.clear_sessionid();
+            return 0;
+        }
+
+
+        /**
+         * Send the state of this backend to the control plane on the stream opened by OpenStateStream().
+         * If the stream is broken and standbys were added, this backend switches to a standby
+         * control plane, registers with it and opens a new stream to it which carries the state.
+         * @return 0 if successful, 1 if stream is not open or is broken.
+         */
+        int LbControlPlaneClient::SendStateStream() {
+            if (!stateStream) return streamLost ? reopenStateStream() : 1;
+            if (streamBroken) return reopenStateStream();
+
+            struct timespec t1;
+            clock_gettime(CLOCK_REALTIME, &t1);
+            streamRequest.mutable_timestamp()->set_seconds(t1.tv_sec);
+            streamRequest.mutable_timestamp()->set_nanos(t1.tv_nsec);
+            LbState current = state.read();
+            streamRequest.set_fillpercent(current.fillPercent);
+            streamRequest.set_controlsignal(current.pidError);
+            streamRequest.set_isready(current.isReady);
+
+            if (!stateStream->Write(streamRequest)) {
+                streamBroken = true;
+                return reopenStateStream();
+            }
+            return 0;
+        }
+
+
+        /**
+         * Replace a broken state stream with one to another control plane, if there is one.
+         * @return 0 if successful, 1 if no standby or no control plane could be reached.
+         */
+        int LbControlPlaneClient::reopenStateStream() {
+            if (cpEndpoints.size() < 2) return 1;
+
+            if (stateStream) {
+                // Don't wait on a hung control plane
+                streamContext->TryCancel();
+                CloseStateStream();
+            }
+
+            streamLost = (failover() != 0 || OpenStateStream() != 0);
+            return streamLost ? 1 : 0;
+        }
+
+
+        /**
+         * Close the stream opened by OpenStateStream().
+         * @return 0 if successful, 1 if stream was not open or ended in error.
+         */
+        int LbControlPlaneClient::CloseStateStream() {
+            streamLost = false;
+            if (!stateStream) return 1;
+
+            stateStream->WritesDone();
+            streamThread.join();
+            Status status = stateStream->Finish();
+            stateStream.reset();
+
+            if (!status.ok()) {
+                std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+
+
+        /**
+         * Start a thread which reports the state of this backend to the control plane,
+         * so the caller need not have its own loop around update() and SendState().
+         * Every minPeriod millisec, the fill level is sampled, either from fillSource or,
+         * if that is not given, from the latest update(). If the fill has changed by at least
+         * fillChange since the last report, it is reported right away and the reporting period
+         * drops back to minPeriod. Otherwise, a report is sent once the period has passed and
+         * the period is doubled, up to maxPeriod. So a steady backend reports seldom and
+         * one going through a load step reports quickly.
+         * Reports go on the state stream if one is open, otherwise by SendState().
+         * Do not call SendState() or SendStateStream() while the reporter runs.
+         *
+         * @param minPeriod   millisec between fill samples and shortest time between reports.
+         * @param maxPeriod   longest millisec between reports.
+         * @param fillChange  change in fill (0-1) that causes an immediate report.
+         * @param fillSource  if not null, function called to get the fill level (0-1).
+         * @return 0 if successful, 1 if reporter is already running or periods are bad.
+         */
+        int LbControlPlaneClient::StartReporter(uint32_t minPeriod, uint32_t maxPeriod, float fillChange,
+                                                std::function<float()> fillSource) {
+            if (reporterThread.joinable() || minPeriod == 0 || maxPeriod < minPeriod) return 1;
+
+            reporterMinPeriod  = minPeriod;
+            reporterMaxPeriod  = maxPeriod;
+            reporterFillChange = fillChange;
+            reporterFillSource = std::move(fillSource);
+            reporterQuit = false;
+
+            reporterThread = std::thread(&LbControlPlaneClient::runReporter, this);
+            return 0;
+        }
+
+
+        /** Stop the thread started by StartReporter(). */
+        void LbControlPlaneClient::StopReporter() {
+            if (!reporterThread.joinable()) return;
+
+            {
+                std::lock_guard<std::mutex> lock(reporterMutex);
+                reporterQuit = true;
+            }
+            reporterCv.notify_all();
+            reporterThread.join();
+        }
+
+
+        /** Run by reporterThread to sample the fill level and send reports. */
+        void LbControlPlaneClient::runReporter() {
+            auto samplePeriod = milliseconds(reporterMinPeriod);
+            auto period = samplePeriod;
+            auto lastReport = steady_clock::now();
+            // Make sure first sample is reported
+            float lastFill = -1.F;
+            reportPeriod = reporterMinPeriod;
+
+            std::unique_lock<std::mutex> lock(reporterMutex);
+
+            while (!reporterCv.wait_for(lock, samplePeriod, [this] {return reporterQuit;})) {
+                lock.unlock();
+
+                LbState current = state.read();
+                if (reporterFillSource) {
+                    current.fillPercent = reporterFillSource();
+                    state.publish(current.fillPercent, current.pidError, current.isReady);
+                }
+
+                float fill = current.fillPercent;
+                bool changed = std::fabs(fill - lastFill) >= reporterFillChange;
+                auto now = steady_clock::now();
+
+                if (changed || now - lastReport >= period) {
+                    int err = stateStream ? SendStateStream() : SendState();
+                    if (err == 0) {
+                        reportCount++;
+                    }
+                    else {
+                        reportErrors++;
+                    }
+
+                    // Fast reports while fill is changing, slower and slower while it's not
+                    if (changed) {
+                        period = samplePeriod;
+                    }
+                    else {
+                        period = std::min(2*period, milliseconds(reporterMaxPeriod));
+                    }
+                    reportPeriod = period.count();
+
+                    lastFill = fill;
+                    lastReport = now;
+                }
+
+                lock.lock();
+            }
+        }
+
+
+        /** Run by streamThread to read scheduling hints from the control plane until the stream ends. */
+        void LbControlPlaneClient::readStateStream() {
+            StreamStateReply hint;
+            while (stateStream->Read(&hint)) {
+                hintWeight = hint.weight();
+                hintSlots  = hint.slotsassigned();
+                hintCount++;
+            }
+            streamBroken = true;
+        }
+
+
+        /**
+         * Start an asynchronous SendState call with asyncRequest.
+         * Call with asyncMutex locked.
+         */
+        void LbControlPlaneClient::startAsyncSendState() {
+            asyncContext.reset(new ClientContext);
+            uint32_t deadline = callPolicy().deadline;
+            if (deadline > 0) {
+                asyncContext->set_deadline(system_clock::now() + milliseconds(deadline));
+            }
+            asyncReader = stub()->PrepareAsyncSendState(asyncContext.get(), asyncRequest, &asyncCq);
+            asyncReader->StartCall();
+            asyncReader->Finish(&asyncReply, &asyncStatus, (void *) this);
+            asyncInFlight = true;
+        }
+
+
+        /**
+         * Run by asyncThread to handle the completion of each asynchronous SendState call
+         * and to send any report waiting on it.
+         */
+        void LbControlPlaneClient::drainAsyncSendState() {
+            void *tag;
+            bool ok;
+
+            while (asyncCq.Next(&tag, &ok)) {
+                std::lock_guard<std::mutex> lock(asyncMutex);
+                asyncInFlight = false;
+
+                if (ok && asyncStatus.ok()) {
+                    asyncSent++;
+                }
+                else {
+                    asyncFailed++;
+                    asyncError = true;
+                    if (!asyncQuit) {
+                        std::cout << asyncStatus.error_code() << ": " << asyncStatus.error_message() << std::endl;
+                    }
+                }
+
+                if (asyncPending && !asyncQuit) {
+                    asyncRequest.Swap(&pendingRequest);
+                    asyncPending = false;
+                    startAsyncSendState();
+                }
+            }
+        }
+		
+  
+		// Getters
+        const std::string & LbControlPlaneClient::getCpAddr()       const   {return cpAddr;}
+        const std::string & LbControlPlaneClient::getDataAddr()     const   {return beAddr;}
+        const std::string & LbControlPlaneClient::getName()         const   {return name;}
+        const std::string & LbControlPlaneClient::getToken()        const   {return token;}
+        const std::string & LbControlPlaneClient::getLbId()         const   {return lbId;}
+
+        /** @return session token given by the control plane in use. */
+        std::string LbControlPlaneClient::getSessionToken() const {
+            std::string id, token;
+            getSession(id, token);
+            return token;
+        }
+
+        /** @return session id given by the control plane in use. */
+        std::string LbControlPlaneClient::getSessionId() const {
+            std::string id, token;
+            getSession(id, token);
+            return id;
+        }
+
+        /**
+         * Get the session given by the control plane in use.
+         * This may be called from any thread while reports are being sent.
+         * @param id     filled with session id.
+         * @param token  filled with session token.
+         */
+        void LbControlPlaneClient::getSession(std::string & id, std::string & token) const {
+            std::lock_guard<std::mutex> lock(sessionMutex);
+            id    = sessionId;
+            token = sessionToken;
+        }
+
+        const LbRpcPolicy & LbControlPlaneClient::getRpcPolicy()    const   {return rpcPolicy;}
+        const LbRpcStats  & LbControlPlaneClient::getRpcStats()     const   {return rpcStats;}
+
+        /**
+         * Set the deadline, retry and hedging policy for calls to the control plane.
+         * Set it before making calls.
+         * @param policy  policy to use.
+         */
+        void LbControlPlaneClient::setRpcPolicy(const LbRpcPolicy & policy) {rpcPolicy = policy;}
+
+
+        /**
+         * Add a control plane to switch to if the one in use stops answering.
+         * Standbys are tried in the order added. Add them before registering.
+         * A connection to each is made right away so switching is quick.
+         * @param cpIP    grpc IP address of control plane (dotted decimal format).
+         * @param cpPort  grpc port of control plane.
+         * @return 0 if successful, 1 if already registered.
+         */
+        int LbControlPlaneClient::addStandbyCp(const std::string& cpIP, uint16_t cpPort) {
+            if (!sessionId.empty()) return 1;
+
+            // With standbys, connections are pinged so that a hung control plane is noticed
+            // even by the state stream, which has no deadline
+            uint32_t keepalive = cpEndpoints.empty() ? 0 : keepaliveTime;
+            if (cpEndpoints.size() == 1 && keepalive > 0) {
+                LbCpEndpoint & first = cpEndpoints[0];
+                first.channel = LbChannelPool::getChannel(first.target, keepalive);
+                first.stub    = LoadBalancer::NewStub(first.channel);
+            }
+
+            LbCpEndpoint endpoint;
+            endpoint.target  = LbChannelPool::target(cpIP, cpPort);
+            endpoint.channel = LbChannelPool::getChannel(endpoint.target, keepalive);
+            endpoint.stub    = LoadBalancer::NewStub(endpoint.channel);
+            if (!cpEndpoints.empty()) {
+                endpoint.channel->GetState(true);
+            }
+            cpEndpoints.push_back(std::move(endpoint));
+            return 0;
+        }
+
+
+        /**
+         * Set the millisec a call to the control plane in use may take, when there are standbys,
+         * before switching to one. Default is 250.
+         * @param millisec  time before switching.
+         */
+        void LbControlPlaneClient::setFailoverTimeout(uint32_t millisec) {failoverTimeout = millisec;}
+
+        /**
+         * Set the millisec between keepalive pings to the control planes, used once there are
+         * standbys. An unanswered ping closes the connection after as long again, so that a
+         * hung control plane is switched from even when reporting on a stream. The control
+         * planes must allow pings that often. Default is 1000, 0 for none. Set it before
+         * adding standbys.
+         * @param millisec  time between pings.
+         */
+        void LbControlPlaneClient::setKeepaliveTime(uint32_t millisec) {keepaliveTime = millisec;}
+
+        /** @return host:port of control plane in use. */
+        const std::string & LbControlPlaneClient::getActiveCp() const {return cpEndpoints[activeCp].target;}
+
+        /** @return number of times switched to another control plane. */
+        uint64_t LbControlPlaneClient::getFailoverCount() const {return failoverCount;}
+
+
+        /** @return object used to call the control plane in use. */
+        LoadBalancer::Stub * LbControlPlaneClient::stub() const {
+            return cpEndpoints[activeCp].stub.get();
+        }
+
+
+        /**
+         * Get the policy for a call to the control plane in use. With standbys, a call is
+         * not retried and may take only the failover timeout, so switching is quick.
+         * @return policy of call.
+         */
+        LbRpcPolicy LbControlPlaneClient::callPolicy() const {
+            LbRpcPolicy policy = rpcPolicy;
+            if (cpEndpoints.size() > 1) {
+                policy.retries = 0;
+                if (policy.deadline == 0 || policy.deadline > failoverTimeout) {
+                    policy.deadline = failoverTimeout;
+                }
+            }
+            return policy;
+        }
+
+
+        /**
+         * Switch to the next control plane which can be reached and register with it, so that
+         * reports continue under a new session. Those whose channel is known to be failing are
+         * tried last. Call only from the thread sending reports, which is the LbStateAggregator's
+         * for a client added to one.
+         * @return 0 if successful, 1 if no standby or none could be registered with.
+         */
+        int LbControlPlaneClient::failover() {
+            size_t count = cpEndpoints.size();
+            if (count < 2) return 1;
+
+            uint32_t from = activeCp;
+
+            for (int pass = 0; pass < 2; pass++) {
+                for (size_t k = 1; k < count; k++) {
+                    uint32_t next = (from + k) % count;
+
+                    grpc_connectivity_state cs = cpEndpoints[next].channel->GetState(true);
+                    bool failing = (cs == GRPC_CHANNEL_TRANSIENT_FAILURE || cs == GRPC_CHANNEL_SHUTDOWN);
+                    if (failing != (pass == 1)) continue;
+
+                    activeCp = next;
+                    if (registerActive() == 0) {
+                        failoverCount++;
+                        std::cout << "Switched from control plane " << cpEndpoints[from].target <<
+                                     " to " << cpEndpoints[next].target << std::endl;
+                        return 0;
+                    }
+                }
+            }
+
+            activeCp = from;
+            return 1;
+        }
+
+        uint16_t   LbControlPlaneClient::getCpPort()                const   {return cpPort;}
+        uint16_t   LbControlPlaneClient::getDataPort()              const   {return bePort;}
+
+		PortRange  LbControlPlaneClient::getDataPortRange()         const   {return beRange;}
+
+		float      LbControlPlaneClient::getFillPercent()           const   {return state.read().fillPercent;}
+        float      LbControlPlaneClient::getPidError()              const   {return state.read().pidError;}
+
+        bool       LbControlPlaneClient::getIsReady()               const   {return state.read().isReady;}
+
+        uint64_t   LbControlPlaneClient::getAsyncSent()             const   {return asyncSent;}
+        uint64_t   LbControlPlaneClient::getAsyncDropped()          const   {return asyncDropped;}
+        uint64_t   LbControlPlaneClient::getAsyncFailed()           const   {return asyncFailed;}
+
+        uint32_t   LbControlPlaneClient::getReportPeriod()          const   {return reportPeriod;}
+        uint64_t   LbControlPlaneClient::getReportCount()           const   {return reportCount;}
+        uint64_t   LbControlPlaneClient::getReportErrors()          const   {return reportErrors;}
+
+        float      LbControlPlaneClient::getHintWeight()            const   {return hintWeight;}
+        uint32_t   LbControlPlaneClient::getHintSlots()             const   {return hintSlots;}
+        uint64_t   LbControlPlaneClient::getHintCount()             const   {return hintCount;}
+
+
+
+        /////////////////////////////////
+        // LbStateAggregator class
+        /////////////////////////////////
+
+
+        /**
+         * Constructor.
+         * @param cpIP     grpc IP address of control plane (dotted decimal format) the clients use first.
+         * @param cpPort   grpc port of control plane.
+         * @param lbId     id of LB all the clients are registered with.
+         */
+        LbStateAggregator::LbStateAggregator(const std::string& cpIP, uint16_t cpPort,
+                                             const std::string& lbId) : lbId(lbId) {
+
+            Batch batch;
+            batch.target = LbChannelPool::target(cpIP, cpPort);
+            batch.stub   = LoadBalancer::NewStub(LbChannelPool::getChannel(batch.target));
+            batch.request.set_lbid(lbId);
+            batches.push_back(std::move(batch));
+        }
+
+
+        /** Destructor. Stops the thread started by Start(). */
+        LbStateAggregator::~LbStateAggregator() {
+            Stop();
+        }
+
+
+        /**
+         * Add a client whose state is to be sent in each batch.
+         * The client must already be registered and must be removed before it is destroyed.
+         * @param client  registered client.
+         */
+        void LbStateAggregator::add(LbControlPlaneClient *client) {
+            std::lock_guard<std::mutex> lock(clientMutex);
+            if (std::find(clients.begin(), clients.end(), client) != clients.end()) return;
+
+            clients.push_back(client);
+            failovers.push_back(0);
+            regroup = true;
+        }
 
-		    // Container for the response we expect from server
-		    RegisterReply reply;
 
-		    // Context for the client. It could be used to convey extra information to
-		    // the server and/or tweak certain RPC behaviors.
-		    ClientContext context;
+        /**
+         * Stop sending the state of a client.
+         * @param client  client previously added.
+         */
+        void LbStateAggregator::remove(LbControlPlaneClient *client) {
+            std::lock_guard<std::mutex> lock(clientMutex);
+            auto it = std::find(clients.begin(), clients.end(), client);
+            if (it == clients.end()) return;
+
+            failovers.erase(failovers.begin() + (it - clients.begin()));
+            clients.erase(it);
+            regroup = true;
+        }
 
-		    // The actual RPC
-		    Status status = stub_->Register(&context, request, &reply);
 
-		    // Act upon its status
-		    if (!status.ok()) {
-		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
-		        return 1;
-		    }
+        /**
+         * Put each client, with its current session, in the batch of the control plane it uses.
+         * Session info is only set here, so from batch to batch only the states change.
+         * Call with clientMutex held.
+         */
+        void LbStateAggregator::makeBatches() {
+            for (Batch & batch : batches) {
+                batch.members.clear();
+                batch.request.clear_states();
+            }
+
+            for (size_t i=0; i < clients.size(); i++) {
+                const std::string & target = clients[i]->getActiveCp();
+                auto it = std::find_if(batches.begin(), batches.end(),
+                                       [&](const Batch & b) {return b.target == target;});
+                if (it == batches.end()) {
+                    Batch batch;
+                    batch.target = target;
+                    batch.stub   = LoadBalancer::NewStub(LbChannelPool::getChannel(target));
+                    batch.request.set_lbid(lbId);
+                    batches.push_back(std::move(batch));
+                    it = batches.end() - 1;
+                }
+
+                // Read the count first, so a switch made while copying is seen next time
+                failovers[i] = clients[i]->getFailoverCount();
+                SessionState *state = it->request.add_states();
+                clients[i]->getSession(*state->mutable_sessionid(), *state->mutable_token());
+                it->members.push_back(i);
+            }
+
+            // Keep one batch around, if only to keep its stub for the next clients
+            batches.erase(std::remove_if(batches.begin() + 1, batches.end(),
+                                         [](const Batch & b) {return b.members.empty();}),
+                          batches.end());
+            regroup = false;
+        }
 
-		    // Two things returned from CP
-            sessionId    = reply.sessionid();
-            sessionToken = reply.token();
 
-		    return 0;
-    	}
-    	
- 
         /**
-		 * Unregister this backend with the control plane.
-		 * @return 0 if successful, 1 if error in grpc communication
-		 */
-    	int LbControlPlaneClient::Deregister() const {
+         * Send the current state of every added client to the control plane it uses, in one call
+         * for each control plane in use. If a call fails because the control plane cannot be reached
+         * or does not answer in time, the clients of that batch switch to a standby, if they have any,
+         * and the next batch goes there.
+         * @return 0 if successful, 1 if error in grpc communication.
+         */
+        int LbStateAggregator::SendStateBatch() {
+            std::lock_guard<std::mutex> lock(clientMutex);
 
-    	    // Deregistration message we are sending to server
-		    DeregisterRequest request;
-            request.set_token(sessionToken);
-            request.set_lbid(lbId);
-            request.set_sessionid(sessionId);
+            // A client which switched control plane has a new session, maybe with another one
+            for (size_t i=0; i < clients.size(); i++) {
+                if (clients[i]->getFailoverCount() != failovers[i]) regroup = true;
+            }
+            if (regroup) makeBatches();
 
-		    // Container for the response we expect from server
-		    DeregisterReply reply;
+            struct timespec t1;
+            clock_gettime(CLOCK_REALTIME, &t1);
 
-		    // Context for the client. It could be used to convey extra information to
-		    // the server and/or tweak certain RPC behaviors.
-		    ClientContext context;
+            int err = 0;
+            uint32_t accepted = 0;
+
+            for (Batch & batch : batches) {
+                if (batch.members.empty()) continue;
+
+                for (size_t k=0; k < batch.members.size(); k++) {
+                    LbState current = clients[batch.members[k]]->getState();
+                    SessionState *state = batch.request.mutable_states((int)k);
+                    state->mutable_timestamp()->set_seconds(t1.tv_sec);
+                    state->mutable_timestamp()->set_nanos(t1.tv_nsec);
+                    state->set_fillpercent(current.fillPercent);
+                    state->set_controlsignal(current.pidError);
+                    state->set_isready(current.isReady);
+                }
+
+                Status status = callRpc(batch.stub.get(), &LoadBalancer::Stub::SendStateBatch,
+                                        &LoadBalancer::Stub::PrepareAsyncSendStateBatch,
+                                        batch.request, &batch.reply, rpcPolicy, rpcStats, false);
+
+                if (!status.ok()) {
+                    std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+                    err = 1;
+
+                    if (status.error_code() == grpc::StatusCode::UNAVAILABLE ||
+                        status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+                        for (size_t i : batch.members) {
+                            if (clients[i]->failover() == 0) regroup = true;
+                        }
+                    }
+                    continue;
+                }
+
+                accepted += batch.reply.accepted();
+            }
 
-		    // The actual RPC
-		    Status status = stub_->Deregister(&context, request, &reply);
+            if (err) {
+                batchErrors++;
+                return 1;
+            }
 
-		    // Act upon its status
-		    if (!status.ok()) {
-		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
-		        return 1;
-		    }
+            lastAccepted = accepted;
+            batchCount++;
             return 0;
         }
-    	
-    	  	
-    	
-        /**
-		 * Send the state of this backend to the control plane.
-		 * @return 0 if successful, 1 if error in grpc communication
-		 */
-    	int LbControlPlaneClient::SendState() const {
-		    // Data we are sending to the server.
-		    SendStateRequest request;
 
-            request.set_token(sessionToken);
-            request.set_lbid(lbId);
-            request.set_sessionid(sessionId);
 
-            // Set the time
-            struct timespec t1;
-            clock_gettime(CLOCK_REALTIME, &t1);
-            auto timestamp = new google::protobuf::Timestamp{};
-            timestamp->set_seconds(t1.tv_sec);
-            timestamp->set_nanos(t1.tv_nsec);
-            // Give ownership of object to protobuf
-            request.set_allocated_timestamp(timestamp);
+        /**
+         * Start a thread which calls SendStateBatch() every period.
+         * @param period  millisec between batches.
+         * @return 0 if successful, 1 if already started or period is 0.
+         */
+        int LbStateAggregator::Start(uint32_t period) {
+            if (sendThread.joinable() || period == 0) return 1;
+            quit = false;
+            sendThread = std::thread(&LbStateAggregator::run, this, period);
+            return 0;
+        }
 
-            request.set_fillpercent(fillPercent);
-            request.set_controlsignal(pidError);
 
-            // In order NOT to throw the CP into unstable behavior,
-            // always say the we are ready to receive data.
-            request.set_isready(isReady);
+        /** Stop the thread started by Start(). */
+        void LbStateAggregator::Stop() {
+            if (!sendThread.joinable()) return;
 
-		    // Container for the data we expect from the server.
-		    SendStateReply reply;
+            {
+                std::lock_guard<std::mutex> lock(quitMutex);
+                quit = true;
+            }
+            quitCv.notify_all();
+            sendThread.join();
+        }
 
-		    // Context for the client. It could be used to convey extra information to
-		    // the server and/or tweak certain RPC behaviors.
-		    ClientContext context;
 
-		    // The actual RPC.
-            Status status = stub_->SendState(&context, request, &reply);
+        /** Run by sendThread to send a batch each period. */
+        void LbStateAggregator::run(uint32_t period) {
+            auto wakeTime = steady_clock::now();
+            std::unique_lock<std::mutex> lock(quitMutex);
 
-		    // Act upon its status.
-		    if (!status.ok()) {
-		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
-		        return 1;
-		    }
+            while (true) {
+                wakeTime += milliseconds(period);
+                if (quitCv.wait_until(lock, wakeTime, [this] {return quit;})) break;
 
-		    return 0;
-		}
-		
-  
-		// Getters
-        const std::string & LbControlPlaneClient::getCpAddr()       const   {return cpAddr;}
-        const std::string & LbControlPlaneClient::getDataAddr()     const   {return beAddr;}
-        const std::string & LbControlPlaneClient::getName()         const   {return name;}
-        const std::string & LbControlPlaneClient::getToken()        const   {return token;}
-        const std::string & LbControlPlaneClient::getSessionToken() const   {return sessionToken;}
+                lock.unlock();
+                SendStateBatch();
+                lock.lock();
+            }
+        }
 
-        uint16_t   LbControlPlaneClient::getCpPort()                const   {return cpPort;}
-        uint16_t   LbControlPlaneClient::getDataPort()              const   {return bePort;}
 
-		PortRange  LbControlPlaneClient::getDataPortRange()         const   {return beRange;}
+        size_t     LbStateAggregator::getClientCount()  const {std::lock_guard<std::mutex> lock(clientMutex); return clients.size();}
+        uint64_t   LbStateAggregator::getBatchCount()   const {return batchCount;}
+        uint64_t   LbStateAggregator::getBatchErrors()  const {return batchErrors;}
+        uint32_t   LbStateAggregator::getLastAccepted() const {return lastAccepted;}
 
-		float      LbControlPlaneClient::getFillPercent()           const   {return fillPercent;}
-        float      LbControlPlaneClient::getPidError()              const   {return pidError;}
+        const LbRpcStats & LbStateAggregator::getRpcStats() const {return rpcStats;}
 
-        bool       LbControlPlaneClient::getIsReady()               const   {return isReady;}
+        /**
+         * Set the deadline, retry and hedging policy for calls to the control plane.
+         * Set it before making calls.
+         * @param policy  policy to use.
+         */
+        void LbStateAggregator::setRpcPolicy(const LbRpcPolicy & policy) {rpcPolicy = policy;}
 
 
 
@@ -366,8 +3112,52 @@ using namespace std::chrono;
                 adminToken(admintoken),
                 untilSeconds(until) {
 
-            std::string cpTarget = cpIP + ":" + std::to_string(cpPort);
-            stub_ = LoadBalancer::NewStub(grpc::CreateChannel(cpTarget, grpc::InsecureChannelCredentials()));
+            std::string cpTarget = LbChannelPool::target(cpIP, cpPort);
+            stub_ = LoadBalancer::NewStub(LbChannelPool::getChannel(cpTarget));
+        }
+
+
+        /**
+         * Constructor for an LB that has already been reserved, for example by another program.
+         * Use this to monitor the LB with {@link #LoadBalancerStatus()} or to free it.
+         * Since the reservation details are not known, {@link #reserved()} returns false.
+         *
+         * @param cIp       grpc IP address of control plane (dotted decimal format).
+         * @param cPort     grpc port of control plane.
+         * @param lbId      id of reserved LB.
+         * @param token     administration token.
+         */
+        LbReservation::LbReservation (const std::string& cpIP, uint16_t cpPort,
+                                      const std::string& lbId,
+                                      const std::string& admintoken) :
+
+                cpAddr(cpIP), cpPort(cpPort),
+                adminToken(admintoken), untilSeconds(0),
+                lbId(lbId) {
+
+            std::string cpTarget = LbChannelPool::target(cpIP, cpPort);
+            stub_ = LoadBalancer::NewStub(LbChannelPool::getChannel(cpTarget));
+        }
+
+
+        /** Destructor which stops any status watch. */
+        LbReservation::~LbReservation() {
+            StopWatch();
+        }
+
+
+        /**
+         * Set the stats of an LB client from its status sent by the control plane.
+         * @param stats   stats to set.
+         * @param worker  client status from CP.
+         */
+        static void setClientStatus(LbClientStatus & stats, const WorkerStatus & worker) {
+            stats.name          = worker.name();
+            stats.fillPercent   = worker.fillpercent();
+            stats.controlSignal = worker.controlsignal();
+            stats.slotsAssigned = worker.slotsassigned();
+            stats.lastUpdated   = worker.lastupdated();
+            stats.updateTime    = google::protobuf::util::TimeUtil::TimestampToMilliseconds(stats.lastUpdated);
         }
 
 
@@ -379,7 +3169,24 @@ using namespace std::chrono;
         int LbReservation::ReserveLoadBalancer() {
             // Reserve-LB message we are sending to server
             ReserveLoadBalancerRequest request;
+            fillReserveRequest(request);
+
+            // Container for the response we expect from server
+            ReserveLoadBalancerReply reply;
+
+            // The actual RPC
+            Status status = callRpc(stub_.get(), &LoadBalancer::Stub::ReserveLoadBalancer, &LoadBalancer::Stub::PrepareAsyncReserveLoadBalancer,
+                                    request, &reply, rpcPolicy, rpcStats, false);
 
+            return reserved(status, reply);
+        }
+
+
+        /**
+         * Fill the message reserving this LB.
+         * @param request  message to fill.
+         */
+        void LbReservation::fillReserveRequest(ReserveLoadBalancerRequest & request) const {
             request.set_token(adminToken);
             request.set_name(lbName);
 
@@ -393,17 +3200,16 @@ using namespace std::chrono;
 //            std::cout << "ReserveLoadBalancer: " <<
 //                      ", admin token = " << adminToken <<
 //                      ", lb name = " << lbName << std::endl;
+        }
 
-            // Container for the response we expect from server
-            ReserveLoadBalancerReply reply;
-
-            // Context for the client. It could be used to convey extra information to
-            // the server and/or tweak certain RPC behaviors.
-            ClientContext context;
-
-            // The actual RPC
-            Status status = stub_->ReserveLoadBalancer(&context, request, &reply);
 
+        /**
+         * Act upon the control plane's answer to reserving this LB.
+         * @param status  status of call.
+         * @param reply   reply from control plane.
+         * @return 0 if reserved, 1 if error in grpc communication.
+         */
+        int LbReservation::reserved(const Status & status, const ReserveLoadBalancerReply & reply) {
             // Act upon its status
             if (!status.ok()) {
                 std::cout << status.error_code() << ": " << status.error_message() << std::endl;
@@ -430,6 +3236,41 @@ using namespace std::chrono;
         }
 
 
+        /**
+         * Get the details of the reserved LB (with this object's LB id) from the control plane.
+         * Use this with an LB reserved by another program to find where to send data.
+         * Since this call can safely be repeated, it is retried on timeouts and may be hedged.
+         * @return 0 if successful, 1 if error in grpc communication.
+         */
+        int LbReservation::GetLoadBalancer() {
+            GetLoadBalancerRequest request;
+            request.set_token(adminToken);
+            request.set_lbid(lbId);
+
+            // Container for the response we expect from server
+            ReserveLoadBalancerReply reply;
+
+            // The actual RPC
+            Status status = callRpc(stub_.get(), &LoadBalancer::Stub::GetLoadBalancer, &LoadBalancer::Stub::PrepareAsyncGetLoadBalancer,
+                                    request, &reply, rpcPolicy, rpcStats, true);
+
+            // Act upon its status
+            if (!status.ok()) {
+                std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+                return 1;
+            }
+
+            // things returned from CP
+            instanceToken   = reply.token();
+            syncIpAddress   = reply.syncipaddress();
+            syncUdpPort     = reply.syncudpport();
+            dataIpv4Address = reply.dataipv4address();
+            dataIpv6Address = reply.dataipv6address();
+
+            return 0;
+        }
+
+
         /**
          * Free the LB from a single reserved slot.
          * @return 0 if successful, 1 if error in grpc communication
@@ -438,21 +3279,14 @@ using namespace std::chrono;
 
             // Free-LB message we are sending to server
             FreeLoadBalancerRequest request;
-            request.set_token(adminToken);
-            request.set_lbid(lbId);
+            fillFreeRequest(request);
 
             // Container for the response we expect from server
             FreeLoadBalancerReply reply;
 
-            // Context for the client. It could be used to convey extra information to
-            // the server and/or tweak certain RPC behaviors.
-            ClientContext context;
-
-            std::cout << "FreeLoadBalancer: lbid = " << lbId <<
-                      ", admin token = " << adminToken << std::endl;
-
             // The actual RPC
-            Status status = stub_->FreeLoadBalancer(&context, request, &reply);
+            Status status = callRpc(stub_.get(), &LoadBalancer::Stub::FreeLoadBalancer, &LoadBalancer::Stub::PrepareAsyncFreeLoadBalancer,
+                                    request, &reply, rpcPolicy, rpcStats, false);
 
             // Act upon its status
             if (!status.ok()) {
@@ -463,6 +3297,19 @@ using namespace std::chrono;
         }
 
 
+        /**
+         * Fill the message freeing this LB.
+         * @param request  message to fill.
+         */
+        void LbReservation::fillFreeRequest(FreeLoadBalancerRequest & request) const {
+            request.set_token(adminToken);
+            request.set_lbid(lbId);
+
+            std::cout << "FreeLoadBalancer: lbid = " << lbId <<
+                      ", admin token = " << adminToken << std::endl;
+        }
+
+
 
         /**
          * STATIC method to free the LB from a single reserved slot.
@@ -474,9 +3321,9 @@ using namespace std::chrono;
         int LbReservation::FreeLoadBalancer(const std::string& cpIP, uint16_t cpPort,
                                             std::string lbId, std::string adminToken) {
 
-            std::string cpTarget = cpIP + ":" + std::to_string(cpPort);
+            std::string cpTarget = LbChannelPool::target(cpIP, cpPort);
             std::unique_ptr<LoadBalancer::Stub> stub_ =
-                    LoadBalancer::NewStub(grpc::CreateChannel(cpTarget, grpc::InsecureChannelCredentials()));
+                    LoadBalancer::NewStub(LbChannelPool::getChannel(cpTarget));
 
             // Free-LB message we are sending to server
             FreeLoadBalancerRequest request;
@@ -486,12 +3333,10 @@ using namespace std::chrono;
             // Container for the response we expect from server
             FreeLoadBalancerReply reply;
 
-            // Context for the client. It could be used to convey extra information to
-            // the server and/or tweak certain RPC behaviors.
-            ClientContext context;
-
-            // The actual RPC
-            Status status = stub_->FreeLoadBalancer(&context, request, &reply);
+            // The actual RPC, with the default policy
+            LbRpcStats stats;
+            Status status = callRpc(stub_.get(), &LoadBalancer::Stub::FreeLoadBalancer, &LoadBalancer::Stub::PrepareAsyncFreeLoadBalancer,
+                                    request, &reply, LbRpcPolicy(), stats, false);
 
             // Act upon its status
             if (!status.ok()) {
@@ -503,6 +3348,103 @@ using namespace std::chrono;
 
 
 
+        /**
+         * Reserve this LB without waiting for the control plane to answer.
+         * The call goes out over the channel shared by all objects talking to the same CP
+         * and is finished by the one thread shared by all such calls, so any number of these
+         * can be in flight at once. Don't use this object until the future is ready.
+         * If that thread cannot be started, the call is made here and the future is ready on return.
+         * @return future holding 0 if successful, 1 if error in grpc communication.
+         */
+        std::future<int> LbReservation::ReserveLoadBalancerAsync() {
+            CompletionQueue *cq = LbCallQueue::get();
+            if (cq == nullptr) {
+                std::promise<int> result;
+                result.set_value(ReserveLoadBalancer());
+                return result.get_future();
+            }
+
+            auto call = new LbQueuedUnaryCall<ReserveLoadBalancerRequest, ReserveLoadBalancerReply>(
+                    stub_.get(), &LoadBalancer::Stub::PrepareAsyncReserveLoadBalancer, cq, rpcPolicy, rpcStats, false,
+                    [this](const Status & status, const ReserveLoadBalancerReply & reply) {return reserved(status, reply);});
+            fillReserveRequest(call->request);
+            return call->start();
+        }
+
+
+        /**
+         * Free this LB without waiting for the control plane to answer, as ReserveLoadBalancerAsync() does.
+         * @return future holding 0 if successful, 1 if error in grpc communication.
+         */
+        std::future<int> LbReservation::FreeLoadBalancerAsync() const {
+            CompletionQueue *cq = LbCallQueue::get();
+            if (cq == nullptr) {
+                std::promise<int> result;
+                result.set_value(FreeLoadBalancer());
+                return result.get_future();
+            }
+
+            auto call = new LbQueuedUnaryCall<FreeLoadBalancerRequest, FreeLoadBalancerReply>(
+                    stub_.get(), &LoadBalancer::Stub::PrepareAsyncFreeLoadBalancer, cq, rpcPolicy, rpcStats, false,
+                    [](const Status & status, const FreeLoadBalancerReply &) {
+                        if (!status.ok()) {
+                            std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+                            return 1;
+                        }
+                        return 0;
+                    });
+            fillFreeRequest(call->request);
+            return call->start();
+        }
+
+
+        /**
+         * STATIC method to reserve many LBs at once. All the reservations are sent
+         * before waiting for any answer, so this takes about as long as a single one,
+         * and no thread is started for any of them.
+         * @param reservations  LBs to reserve.
+         * @return number of LBs which could not be reserved, 0 if all were.
+         */
+        int LbReservation::ReserveLoadBalancers(const std::vector<LbReservation*> & reservations) {
+            std::vector<std::future<int>> results;
+            results.reserve(reservations.size());
+
+            for (LbReservation *r : reservations) {
+                results.push_back(r->ReserveLoadBalancerAsync());
+            }
+
+            int failures = 0;
+            for (auto & result : results) {
+                failures += result.get();
+            }
+            return failures;
+        }
+
+
+        /**
+         * STATIC method to free many LBs at once. All the requests are sent
+         * before waiting for any answer, so this takes about as long as a single one,
+         * and no thread is started for any of them.
+         * @param reservations  LBs to free.
+         * @return number of LBs which could not be freed, 0 if all were.
+         */
+        int LbReservation::FreeLoadBalancers(const std::vector<LbReservation*> & reservations) {
+            std::vector<std::future<int>> results;
+            results.reserve(reservations.size());
+
+            for (LbReservation *r : reservations) {
+                results.push_back(r->FreeLoadBalancerAsync());
+            }
+
+            int failures = 0;
+            for (auto & result : results) {
+                failures += result.get();
+            }
+            return failures;
+        }
+
+
+
         /**
          * Get LB status.
          * @return 0 if successful, 1 if error in grpc communication
@@ -517,12 +3459,9 @@ using namespace std::chrono;
             // Container for the response we expect from server
             LoadBalancerStatusReply reply;
 
-            // Context for the client. It could be used to convey extra information to
-            // the server and/or tweak certain RPC behaviors.
-            ClientContext context;
-
-            // The actual RPC
-            Status status = stub_->LoadBalancerStatus(&context, request, &reply);
+            // The actual RPC, which can safely be repeated or hedged
+            Status status = callRpc(stub_.get(), &LoadBalancer::Stub::LoadBalancerStatus, &LoadBalancer::Stub::PrepareAsyncLoadBalancerStatus,
+                                    request, &reply, rpcPolicy, rpcStats, true);
 
             // Act upon its status
             if (!status.ok()) {
@@ -531,26 +3470,88 @@ using namespace std::chrono;
             }
 
             // Things returned from CP
+            std::lock_guard<std::mutex> lock(statsMutex);
 
-            // How many clients on this LB?
-            int clientCount = reply.workers_size();
-
-            for (size_t j = 0; j < clientCount; j++) {
-                std::string name = reply.workers(j).name();
-
+            for (const WorkerStatus & worker : reply.workers()) {
                 // Either returns the entry at this key, or creates one if none exists
-                auto & stats = clientStats[name];
-                stats.fillPercent   = reply.workers(j).fillpercent();
-                stats.controlSignal = reply.workers(j).controlsignal();
-                stats.slotsAssigned = reply.workers(j).slotsassigned();
-                stats.lastUpdated   = reply.workers(j).lastupdated();
-                stats.updateTime = google::protobuf::util::TimeUtil::TimestampToMilliseconds(stats.lastUpdated);
+                setClientStatus(clientStats[worker.name()], worker);
             }
 
             return 0;
         }
 
 
+        /**
+         * Start getting the LB's status pushed from the control plane instead of polling
+         * with LoadBalancerStatus(). The CP first sends the status of all clients and
+         * after that only of those which change, which a background thread applies to
+         * the client stats. While watching, read the stats with copyClientStats().
+         *
+         * @param minInterval    min millisec between status messages, 0 to get each change.
+         * @param refreshPeriod  millisec after which an unchanged client's status is sent
+         *                       anyway, to keep its update time fresh, 0 for CP's default.
+         * @return 0 if successful, 1 if already watching.
+         */
+        int LbReservation::WatchLoadBalancerStatus(uint32_t minInterval, uint32_t refreshPeriod) {
+            if (watchReader) return 1;
+
+            WatchLoadBalancerStatusRequest request;
+            request.set_token(adminToken);
+            request.set_lbid(lbId);
+            request.set_mininterval(minInterval);
+            request.set_refreshperiod(refreshPeriod);
+
+            watchContext.reset(new ClientContext);
+            watchReader = stub_->WatchLoadBalancerStatus(watchContext.get(), request);
+            watching = true;
+            watchThread = std::thread(&LbReservation::readStatusWatch, this);
+            return 0;
+        }
+
+
+        /**
+         * Stop the watch started by WatchLoadBalancerStatus().
+         * @return 0 if successful, 1 if not watching or the watch had ended in error.
+         */
+        int LbReservation::StopWatch() {
+            if (!watchReader) return 1;
+
+            watchContext->TryCancel();
+            watchThread.join();
+            Status status = watchReader->Finish();
+            watchReader.reset();
+
+            if (!status.ok() && status.error_code() != grpc::StatusCode::CANCELLED) {
+                std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+
+
+        /** Run by watchThread to apply status changes to the client stats until the watch ends. */
+        void LbReservation::readStatusWatch() {
+            LoadBalancerStatusDelta delta;
+
+            while (watchReader->Read(&delta)) {
+                std::lock_guard<std::mutex> lock(statsMutex);
+
+                if (delta.snapshot()) {
+                    clientStats.clear();
+                }
+                for (const WorkerStatus & worker : delta.workers()) {
+                    setClientStatus(clientStats[worker.name()], worker);
+                }
+                for (const std::string & name : delta.removed()) {
+                    clientStats.erase(name);
+                }
+                watchUpdates++;
+            }
+
+            watching = false;
+        }
+
+
 
         // Getters
         const std::string & LbReservation::getLbName()        const   {return lbName;}
@@ -558,6 +3559,16 @@ using namespace std::chrono;
         const std::string & LbReservation::getInstanceToken() const   {return instanceToken;}
         const std::string & LbReservation::getLbId()          const   {return lbId;}
 
+        const LbRpcPolicy & LbReservation::getRpcPolicy()     const   {return rpcPolicy;}
+        const LbRpcStats  & LbReservation::getRpcStats()      const   {return rpcStats;}
+
+        /**
+         * Set the deadline, retry and hedging policy for calls to the control plane.
+         * Set it before making calls.
+         * @param policy  policy to use.
+         */
+        void LbReservation::setRpcPolicy(const LbRpcPolicy & policy) {rpcPolicy = policy;}
+
         const std::string & LbReservation::getCpAddr()        const   {return cpAddr;}
         const std::string & LbReservation::getSyncAddr()      const   {return syncIpAddress;}
         const std::string & LbReservation::getDataAddrV4()    const   {return dataIpv4Address;}
@@ -580,6 +3591,18 @@ using namespace std::chrono;
         bool LbReservation::reserved() const {return isReserved && !reservationElapsed();}
         const std::unordered_map<std::string, LbClientStatus> & LbReservation::getClientStats() const {return clientStats;}
 
+        /** @return copy of client stats, safe to use while watching the LB's status. */
+        std::unordered_map<std::string, LbClientStatus> LbReservation::copyClientStats() const {
+            std::lock_guard<std::mutex> lock(statsMutex);
+            return clientStats;
+        }
+
+        /** @return true if status changes are still being received from the control plane. */
+        bool LbReservation::isWatching() const {return watching;}
+
+        /** @return number of status messages received while watching. */
+        uint64_t LbReservation::getWatchUpdates() const {return watchUpdates;}
+
 
 
 
@@ -12,16 +12,17 @@
 * @file
 * This file contains code to implement an ERSAP backend communication to an EJFAT LB's control plane.
 *
-* It contains the BackEnd class is a simple class to hold and modify data.
+* It contains the BackEnd class, a simple class to hold a backend's registration data,
+* and the LbBackEndRegistry class which holds the changing state of all registered backends.
 *
 * It contains the LoadBalancerServiceImpl class which acts as a simulated control plane.
 * It is setup to do synchronous communication with the backend. It defines commands that
-* handle the backend's call to invoke an action on the server such as: Register, SendState, and Deregister.
+* handle the backend's call to invoke an action on the server such as: Register, SendState, StreamState, and Deregister.
 * It also defines the runServer method which implements these functions in a grpc server.
 *
 * Finally, it contains the LbControlPlaneClient class which is used by a backend in order
 * to communicate with a simulated (or perhaps a real) control plane server. It allows the
-* backend to Register, SendState, and Deregister as well as control the state that it sends.
+* backend to Register, SendState (or StreamState), and Deregister as well as control the state that it sends.
 */
 
 
@@ -35,6 +36,9 @@
 #include <utility>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include <chrono>
 #include <thread>
 #include <atomic>
@@ -43,6 +47,17 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <regex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <cmath>
+#include <random>
+#include <cinttypes>
+#include <cerrno>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
 
 #ifdef __APPLE__
     #include <sys/sysctl.h>
@@ -70,14 +85,22 @@ using grpc::ServerContext;
 using grpc::Status;
 using grpc::CompletionQueue;
 using grpc::ServerAsyncResponseWriter;
+using grpc::ClientAsyncResponseReader;
+using grpc::ClientReaderWriter;
+using grpc::ServerReaderWriter;
+using grpc::ServerWriter;
+using grpc::ClientReader;
 
 using loadbalancer::PortRange;
 using loadbalancer::FreeLoadBalancerRequest;
 using loadbalancer::FreeLoadBalancerReply;
 using loadbalancer::ReserveLoadBalancerRequest;
 using loadbalancer::ReserveLoadBalancerReply;
+using loadbalancer::GetLoadBalancerRequest;
 using loadbalancer::LoadBalancerStatusRequest;
 using loadbalancer::LoadBalancerStatusReply;
+using loadbalancer::WatchLoadBalancerStatusRequest;
+using loadbalancer::LoadBalancerStatusDelta;
 using loadbalancer::LoadBalancer;
 using loadbalancer::RegisterRequest;
 using loadbalancer::DeregisterRequest;
@@ -85,43 +108,46 @@ using loadbalancer::SendStateRequest;
 using loadbalancer::RegisterReply;
 using loadbalancer::DeregisterReply;
 using loadbalancer::SendStateReply;
+using loadbalancer::StreamStateRequest;
+using loadbalancer::StreamStateReply;
+using loadbalancer::WorkerStatus;
+using loadbalancer::SessionState;
+using loadbalancer::SendStateBatchRequest;
+using loadbalancer::SendStateBatchReply;
 
 
 //using google::protobuf::util;
 
 
 
-/** Class to represent a single backend and store its state in the control plane / server. */
+/**
+ * Class to represent a single backend registered with the control plane / server.
+ * It holds what the backend registered with, which never changes. The state it reports
+ * and its share of the calendar are kept in the LbBackEndRegistry.
+ */
 class BackEnd {
 
     public:
 
 
     BackEnd(const RegisterRequest* req);
+    BackEnd(const RegisterRequest* req, const std::string & sessionId, const std::string & sessionToken);
 
-    void update(const SendStateRequest* state);
     void printBackendState() const;
 
     const std::string & getAdminToken()    const;
     const std::string & getInstanceToken() const;
     const std::string & getSessionId()     const;
+    const std::string & getSessionToken()  const;
     const std::string & getName()          const;
     const std::string & getLbId()          const;
     const std::string & getIpAddress()     const;
 
-    google::protobuf::Timestamp getTimestamp()  const;
-    int64_t  getTime()         const;
-    int64_t  getLocalTime()    const;
-
     float   getWeight()           const;
 
     uint32_t getUdpPort()              const;
     uint32_t getPortRange()            const;
 
-    bool getIsReady()  const;
-    bool getIsActive() const;
-    void setIsActive(bool active);
-
 
 	private:
 
@@ -139,6 +165,9 @@ class BackEnd {
     /** Backend's session ID. */
     std::string sessionId;
 
+    /** Backend's session token. */
+    std::string sessionToken;
+
     /** Backend's name. */
     std::string name;
 
@@ -156,33 +185,716 @@ class BackEnd {
 
     /** Receiving UDP port range of backend. */
     uint16_t  portRange;
+};
 
 
-    // Data for sending state updates to CP ...
 
-    /** Time in milliseconds past epoch that this data was taken by backend. */
-    google::protobuf::Timestamp timestamp;
 
-    /** Time in milliseconds past epoch that this data was taken by backend.
-     *  Same as timestamp but in different format. */
-    int64_t time = 0;
+/**
+ * Handle of a backend registered with the simulated CP, also given to the backend as its session id.
+ * The low 32 bits index the registry's arrays and the high 32 bits count how many times
+ * that index has been used, so a handle never names a later backend. 0 is never a handle.
+ */
+typedef uint64_t LbSessionHandle;
 
-    /** Local time in milliseconds past epoch corresponding to backend time.
-     *  Hopefully this takes care of time delays and nodes not setting their clocks properly.
-     *  Set locally when SendState msg arrives, this helps find how long ago the backend reported data. */
-    int64_t localTime = 0;
 
+/** State of a registered backend, as copied out of an LbBackEndRegistry. */
+typedef struct LbBackEndState_t {
+    /** Backend's handle. */
+    LbSessionHandle handle = 0;
+    /** What the backend registered with (name, address, ...), never changed. */
+    std::shared_ptr<const BackEnd> info;
 
+    /** Time in millisec past epoch that the latest state was taken by backend. */
+    int64_t time = 0;
+    /** Local time in millisec past epoch that the latest state arrived. */
+    int64_t localTime = 0;
+    /** Percent of fifo entries filled (0-1). */
+    float fillPercent = 0.F;
+    /** PID error term / control signal. */
+    float pidError = 0.F;
     /** Ready to receive more data if true. */
-    bool isReady;
+    bool isReady = true;
+
+    /** Fraction of LB calendar assigned to this backend. */
+    float schedWeight = 0.F;
+    /** Number of LB calendar slots assigned to this backend. */
+    uint32_t slotsAssigned = 0;
+    /** Incremented each time the schedule for this backend changes. */
+    uint64_t schedVersion = 0;
+} LbBackEndState;
+
+
+/**
+ * Sequence number of a seqlock, which lets one thread change a set of values while others read
+ * them without either taking a lock. A writer calls writeBegin(), which makes the number odd,
+ * stores the values and calls writeEnd(), which makes it even again. A reader calls readBegin(),
+ * which waits for the number to be even, loads the values and tries again if readRetry() says
+ * the number changed meanwhile, so it always gets a consistent set of values.
+ * Each value must be a std::atomic stored with memory_order_release and loaded with
+ * memory_order_acquire. A reader that loads any value being written then sees the odd number
+ * and retries. This needs no fences, so race checkers such as TSAN follow it, and on x86 it
+ * costs no more than relaxed stores and loads. Writers are serialized by the number itself.
+ */
+class LbSeqLock {
+
+    public:
+
+        /** Make the number odd, once no other write is in progress. */
+        void writeBegin() {
+            uint32_t s = seq.load(std::memory_order_relaxed);
+            do {
+                while (s & 1) s = seq.load(std::memory_order_relaxed);
+            } while (!seq.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed));
+        }
+
+        /** Make the number even again, publishing the values stored since writeBegin(). */
+        void writeEnd() {
+            seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        /** @return number to give readRetry(), once no write is in progress. */
+        uint32_t readBegin() const {
+            uint32_t s;
+            while ((s = seq.load(std::memory_order_acquire)) & 1) {
+                std::this_thread::yield();
+            }
+            return s;
+        }
+
+        /**
+         * @param s  number returned by readBegin().
+         * @return true if a write started since readBegin(), so the values must be read again.
+         */
+        bool readRetry(uint32_t s) const {return seq.load(std::memory_order_relaxed) != s;}
+
+        /** @return number of writes finished. */
+        uint32_t getWrites() const {return seq.load(std::memory_order_acquire) >> 1;}
+
+    private:
+
+        /** Odd while a write is in progress. */
+        std::atomic<uint32_t> seq {0};
+};
+
+
+/**
+ * State of a block of places in a shard of an LbBackEndRegistry, each part in its own array.
+ * Only written with the shard locked, but read without locking through each place's LbSeqLock.
+ * A block never moves once made, so views of the shard can share it.
+ */
+typedef struct LbBackEndBlock_t {
+    /** Places in a block. */
+    static const uint32_t size = 256;
+
+    LbSeqLock             sequence[size];
+    /** Uses of each place, as in the registry, so readers can tell if it changed hands. */
+    std::atomic<uint32_t> generation[size];
+    std::atomic<int64_t>  time[size];
+    std::atomic<int64_t>  localTime[size];
+    std::atomic<float>    fillPercent[size];
+    std::atomic<float>    pidError[size];
+    std::atomic<bool>     isReady[size];
+    std::atomic<float>    schedWeight[size];
+    std::atomic<uint32_t> slotsAssigned[size];
+    std::atomic<uint64_t> schedVersion[size];
+    /** Version of the shard made by the latest change to each place, so readers can skip the others. */
+    std::atomic<uint64_t> changed[size];
+} LbBackEndBlock;
+
+
+/**
+ * Backends of one shard of the registry, as last published for readers.
+ * Made anew only when a backend registers or deregisters, and never changed once published,
+ * so readers use it without locking. The state of the backends is loaded from the shard's blocks.
+ */
+class LbBackEndView {
+
+public:
+
+    /** Handle of each backend in the shard. */
+    std::vector<LbSessionHandle> handles;
+    /** What each backend registered with. */
+    std::vector<std::shared_ptr<const BackEnd>> infos;
+    /** Place of each backend in the shard. */
+    std::vector<uint32_t> places;
+    /** Blocks holding the shard's places. */
+    std::vector<std::shared_ptr<LbBackEndBlock>> blocks;
+
+    size_t size() const;
+    bool load(size_t i, LbBackEndState *state) const;
+    bool changedAfter(size_t i, uint64_t version) const;
+    bool isRegistered(size_t i) const;
+};
+
+
+/** Published backends of each shard of the registry. */
+typedef std::vector<std::shared_ptr<const LbBackEndView>> LbBackEndSnapshot;
 
-    /** Is active (reported its status on time). */
-    bool isActive;
+
+
+
+/**
+ * Class holding the backends registered with the simulated CP.
+ * Each backend gets a handle when it registers, which later calls use to find its state
+ * by indexing, instead of by looking up strings. Session tokens are random 64 bit numbers,
+ * so they are checked by comparing numbers too.
+ *
+ * The backends are split among shards, each with its own lock and with each part of
+ * the state kept in its own array (fill of all backends in one, control signals in the next, ...).
+ * A call from a backend only locks that backend's shard, so calls from different backends
+ * rarely wait on each other.
+ *
+ * Readers of all backends do not lock, so neither they nor writers wait for each other.
+ * Each shard publishes a view listing its backends, made anew (copy on write) only when one
+ * registers or deregisters. The state of each backend is kept in blocks of atomics that never
+ * move, which readers load place by place, trying again if a writer was changing that place.
+ */
+class LbBackEndRegistry {
+
+public:
+
+    explicit LbBackEndRegistry(uint32_t shards = 16);
+
+    LbSessionHandle add(const RegisterRequest *req, std::string & sessionId, std::string & token);
+    bool remove(LbSessionHandle handle);
+
+    bool checkToken(LbSessionHandle handle, const std::string & token) const;
+    bool update(LbSessionHandle handle, const SendStateRequest & state);
+    bool update(LbSessionHandle handle, const StreamStateRequest & state, LbBackEndState *current = nullptr);
+    bool update(LbSessionHandle handle, const SessionState & state);
+    bool setSchedule(LbSessionHandle handle, float weight, uint32_t slots);
+
+    bool   get(LbSessionHandle handle, LbBackEndState *state) const;
+    void   getAll(std::vector<LbBackEndState> & states) const;
+    void   snapshot(LbBackEndSnapshot & views, std::vector<uint64_t> *versions = nullptr) const;
+    size_t size() const;
+    uint64_t getVersion() const;
+
+    static LbSessionHandle parseHandle(const std::string & sessionId);
+    static uint64_t parseToken(const std::string & token);
+
+private:
+
+    /** One shard of the backends. A backend's place in the arrays is its handle's index / shard count. */
+    typedef struct Shard_t {
+        /** Protects everything below; blocks and published are also read without it. */
+        mutable std::mutex mutex;
+        /** Changes made to this shard. Only written with the lock held. */
+        std::atomic<uint64_t> version {0};
+        /** Makes session tokens. */
+        std::mt19937_64 random;
+
+        /** Uses of each place, the high half of the handle; the place is free if even. */
+        std::vector<uint32_t> generation;
+        std::vector<uint64_t> token;
+        std::vector<std::shared_ptr<const BackEnd>> info;
+        /** State of the places, LbBackEndBlock::size to a block. */
+        std::vector<std::shared_ptr<LbBackEndBlock>> blocks;
+
+        /** Free places. */
+        std::vector<uint32_t> freed;
+        /** Backends registered in this shard. */
+        size_t count = 0;
+
+        /** Backends of the shard, read and written with std::atomic_load and std::atomic_store. */
+        std::shared_ptr<const LbBackEndView> published = std::make_shared<const LbBackEndView>();
+    } Shard;
+
+    /** Shards, each allocated on its own so their locks do not share cache lines. */
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    /** Used to spread new backends over the shards. */
+    std::atomic<uint32_t> nextShard {0};
+
+    Shard & shardOf(LbSessionHandle handle, uint32_t *place) const;
+    template <class STATE> bool updateState(LbSessionHandle handle, const STATE & state,
+                                            const std::string *token, LbBackEndState *current);
+    static void copyState(const Shard & shard, uint32_t place, LbSessionHandle handle, LbBackEndState *state);
 };
 
 
 
 
+/** Epoch of the simulated LB: a calendar in use from a given event number on. */
+typedef struct LbEpoch_t {
+    /** Number of epoch, counting from 1. */
+    uint64_t epoch = 0;
+    /** First event number sent by the epoch's calendar. */
+    uint64_t startEvent = 0;
+    /** Local time the epoch was predicted to start, when it was begun. */
+    std::chrono::steady_clock::time_point startTime;
+} LbEpoch;
+
+
+/**
+ * Class managing the simulated LB's epochs. A real LB switches to a new calendar only
+ * at an event number, so that the packets of any one event all go by the same calendar.
+ * Data sources' sync messages say which event each has sent and at what rate, from which
+ * the event number now (or at any time) is predicted. A new epoch starts at the event
+ * predicted a lead time from now, rounded up to a multiple of the calendar size,
+ * and the epoch before it is kept until its last events have had the lead time to arrive.
+ * Since a real LB has room for only so many calendars, no new epoch is begun while
+ * the most allowed are in use, nor while no source has been heard from lately.
+ * Epochs are retired by the local time each was predicted to start, not by event number,
+ * so they still go when every source is silent or a source restarts from event 0.
+ */
+class LbEpochs {
+
+public:
+
+    explicit LbEpochs(uint32_t maxEpochs = 4, uint32_t boundary = 512,
+                      std::chrono::milliseconds lead = std::chrono::milliseconds(1000));
+
+    void sync(uint32_t srcId, uint64_t eventNumber, uint32_t eventRate);
+    uint64_t predictEventNumber(std::chrono::milliseconds ahead = std::chrono::milliseconds(0)) const;
+
+    bool newEpoch(LbEpoch *epoch);
+    bool isFull();
+    uint64_t getCurrentEpoch() const;
+    std::vector<LbEpoch> getEpochs() const;
+    void setMaxEpochs(uint32_t count);
+
+private:
+
+    /** Latest sync message of a data source. */
+    typedef struct Source_t {
+        uint64_t eventNumber;
+        uint32_t eventRate;
+        /** Local time sync arrived, not the time in the message, in case clocks differ. */
+        std::chrono::steady_clock::time_point arrival;
+    } Source;
+
+    /** Most epochs in use at once. */
+    uint32_t maxEpochs;
+
+    /** Epochs start at a multiple of this many events. */
+    uint32_t boundary;
+
+    /** How far ahead an epoch starts, and how long the one before is kept once it starts. */
+    std::chrono::milliseconds lead;
+
+    /** Protects everything below. */
+    mutable std::mutex mutex;
+
+    /** Latest sync of each data source. Key is source id. */
+    std::unordered_map<uint32_t, Source> sources;
+
+    /** Epochs in use or about to be, oldest first. */
+    std::deque<LbEpoch> epochs;
+
+    /** Number of last epoch begun. */
+    uint64_t lastEpoch = 0;
+
+    uint64_t predict(std::chrono::steady_clock::time_point when, bool *heard = nullptr) const;
+    void retire(std::chrono::steady_clock::time_point now);
+};
+
+
+
+
+/** What a client watching the LB's status has been sent so far. */
+typedef struct LbStatusWatch_t {
+    /** Millisec after which a worker's status is sent even if unchanged. */
+    std::chrono::milliseconds refreshPeriod {1000};
+
+    /** Change count of the simulated CP when last looked at. */
+    uint64_t seenChanges = 0;
+
+    /** True until the first (full) message has been made. */
+    bool snapshot = true;
+
+    /** What was last sent of a worker. */
+    typedef struct Sent_t {
+        float fillPercent;
+        float pidError;
+        uint32_t slotsAssigned;
+        /** Local time of the report sent. */
+        int64_t localTime;
+    } Sent;
+
+    /** Last status sent of each worker. Key is backend handle. */
+    std::unordered_map<LbSessionHandle, Sent> sent;
+
+    /** Backends of each shard of the registry when last looked at. */
+    LbBackEndSnapshot views;
+
+    /** Version of each shard when last looked at. */
+    std::vector<uint64_t> versions;
+} LbStatusWatch;
+
+
+
+
+/**
+ * Class acting as a simulated control plane.
+ * It handles, synchronously, the backends' calls to Register, SendState, StreamState, and Deregister,
+ * and answers LoadBalancerStatus. The schedule of the simulated LB is set from outside with setSchedule().
+ * To handle calls asynchronously instead, run it with LoadBalancerAsyncServer (lb_cplane_async.h).
+ */
+class LoadBalancerServiceImpl final : public LoadBalancer::Service {
+
+    public:
+
+        Status Register   (ServerContext* context, const RegisterRequest* request, RegisterReply* reply) override;
+        Status Deregister (ServerContext* context, const DeregisterRequest* request, DeregisterReply* reply) override;
+        Status SendState  (ServerContext* context, const SendStateRequest* state, SendStateReply* reply) override;
+        Status StreamState(ServerContext* context,
+                           ServerReaderWriter<StreamStateReply, StreamStateRequest>* stream) override;
+        Status SendStateBatch(ServerContext* context, const SendStateBatchRequest* batch,
+                              SendStateBatchReply* reply) override;
+        Status LoadBalancerStatus(ServerContext* context, const LoadBalancerStatusRequest* request,
+                                  LoadBalancerStatusReply* reply) override;
+        Status WatchLoadBalancerStatus(ServerContext* context, const WatchLoadBalancerStatusRequest* request,
+                                       ServerWriter<LoadBalancerStatusDelta>* writer) override;
+
+        void getBackEnds(std::vector<LbBackEndState> & backends) const;
+        const LbBackEndRegistry & getRegistry() const;
+        LbEpochs & getEpochs();
+        uint64_t getVersion() const;
+        void setSchedule(LbSessionHandle handle, float weight, uint32_t slots);
+
+        std::unique_ptr<Server> buildServer(uint16_t port, const std::string & unixPath = "");
+        int runServer(uint16_t port, LoadBalancerServiceImpl *service, const std::string & unixPath = "");
+        static void setupBuilder(ServerBuilder & builder, uint16_t port, const std::string & unixPath);
+
+        // Steps of the streaming calls, shared with the asynchronous server (lb_cplane_async.h)
+        Status checkStreamSession(const StreamStateRequest & state, LbSessionHandle *handle);
+        Status applyStreamState(LbSessionHandle handle, const StreamStateRequest & state,
+                                uint64_t & hintVersion, StreamStateReply *hint, bool *sendHint);
+        bool statusDelta(LbStatusWatch & watch, LoadBalancerStatusDelta *delta);
+
+    private:
+
+        /** Backends registered with this server. */
+        LbBackEndRegistry backends;
+
+        /** Epochs of the simulated LB's calendars. */
+        LbEpochs epochs;
+
+        /** Number of status watchers waiting on changeCv. */
+        std::atomic<int> waiting {0};
+
+        /** Used with changeCv to wake status watchers when data changes. */
+        std::mutex watch_mutex;
+
+        /** Used with watch_mutex to wake status watchers when data changes. */
+        std::condition_variable changeCv;
+
+        void changed();
+        bool fillStatusDelta(LbStatusWatch & watch, LoadBalancerStatusDelta *delta);
+};
+
+
+
+
+/**
+ * Class making the simulated LB's calendar, which says which backend each of its slots sends events to.
+ * Each backend gets the whole number of slots nearest its share of the weights (largest remainders
+ * get the slots left over), and a backend's slots are spread evenly over the calendar,
+ * so consecutive events go to different backends as much as possible. Making it takes
+ * time in proportion to the number of slots plus backends and, once the calendar
+ * is as big as it gets, no memory allocation.
+ * As backends' weights change, update() moves only the slots it must to reach the new shares,
+ * and lists every slot whose value changed, so a calendar table need only be rewritten there.
+ * Since a slot holds its backend's index into the weights, that includes slots kept by a backend
+ * whose index changed because one before it came or went.
+ */
+class LbCalendar {
+
+public:
+
+    explicit LbCalendar(uint32_t size = 512);
+
+    void     fill(const std::vector<float> & weights);
+    uint32_t update(const std::vector<float> & weights, const std::vector<LbSessionHandle> & ids);
+
+    uint32_t getSize() const;
+    const std::vector<uint32_t> & getSlots() const;
+    const std::vector<uint32_t> & getSlotCounts() const;
+    const std::vector<uint32_t> & getChanges() const;
+
+private:
+
+    /** Backend (index into weights) of each slot. */
+    std::vector<uint32_t> slots;
+
+    /** Id of backend of each slot, empty until update() is called. */
+    std::vector<LbSessionHandle> members;
+
+    /** Slots changed by the last fill() or update(). */
+    std::vector<uint32_t> changes;
+
+    /** Slots before the last update(). */
+    std::vector<uint32_t> previous;
+
+    /** Slots given up in the last update(), to be handed out again. */
+    std::vector<uint32_t> moved;
+
+    /** Index into weights of each backend id, used by update(). */
+    std::unordered_map<LbSessionHandle, uint32_t> index;
+
+    /** Number of slots each backend held before, used by update(). */
+    std::vector<uint32_t> held;
+
+    /** Number of its slots listed for each backend, used by update(). */
+    std::vector<uint32_t> seen;
+
+    /** Number of its slots each backend has kept, used by update(). */
+    std::vector<uint32_t> kept;
+
+    /** Index into placed of each backend's first slot, used by update(). */
+    std::vector<uint32_t> first;
+
+    /** Slots held, by backend, those kept first, used by update(). */
+    std::vector<uint32_t> placed;
+
+    /** Slot held before and after each of a backend's slots not yet given up, used by update(). */
+    std::vector<uint32_t> before, after;
+
+    /** Distance between the neighbours of each of a backend's slots, with the slot, as a heap, used by update(). */
+    std::vector<std::pair<uint32_t, uint32_t>> drops;
+
+    /** Width of each part of a backend's widest gaps, with the gap, as a heap, used by update(). */
+    std::vector<std::pair<double, uint32_t>> gaps;
+
+    /** Number of times each gap of a backend is split, used by update(). */
+    std::vector<uint32_t> splits;
+
+    /** Position wanted for each freed slot, with the backend wanting it, used by update(). */
+    std::vector<std::pair<uint32_t, uint32_t>> wants;
+
+    /** Number of slots of each backend. */
+    std::vector<uint32_t> counts;
+
+    /** Fraction of a slot each backend has beyond its whole number. */
+    std::vector<double> remainders;
+
+    /** Backends in order of remainder, or those short of their share. */
+    std::vector<uint32_t> order;
+
+    /** Index into slots where each position's backends start, used to spread them out. */
+    std::vector<uint32_t> starts;
+
+    bool apportion(const std::vector<float> & weights);
+};
+
+
+
+
+/**
+ * Class keeping the simulated CP's schedule density, each backend's share of the LB calendar,
+ * from one step of its control loop to the next. Each step the share of every backend is
+ * multiplied by (1 + its control signal) and all are normalized to sum to 1.
+ * A backend's share is kept at its place in the registry (its handle's low half),
+ * so it stays with the backend however others come and go, and starts over if another
+ * backend takes the place. The step itself runs on dense arrays, with SIMD where available.
+ */
+class LbSchedule {
+
+public:
+
+    void update(const std::vector<LbBackEndState> & backends);
+
+    const std::vector<float> & getDensity() const;
+    const std::vector<float> & getControl() const;
+
+private:
+
+    /** Handle of backend at each registry place. */
+    std::vector<LbSessionHandle> handles;
+
+    /** Schedule density of backend at each registry place. */
+    std::vector<float> weights;
+
+    /** Control signal of each backend of the last step, in order given. */
+    std::vector<float> control;
+
+    /** Schedule density of each backend of the last step, in order given. */
+    std::vector<float> density;
+};
+
+
+
+
+/**
+ * Policy for making a call to the control plane.
+ * A call is tried again, after a backoff which doubles each time and is randomly
+ * stretched or shrunk by the jitter fraction, if the CP is unavailable or, for calls
+ * which may safely be repeated, if the deadline passed.
+ * Calls which may be repeated can also be hedged: if no reply comes within
+ * the hedge delay, a second copy is sent and the first reply of the two is used.
+ */
+typedef struct LbRpcPolicy_t {
+    /** Millisec each attempt may take, 0 = no deadline. */
+    uint32_t deadline = 5000;
+    /** Max number of attempts after the first. */
+    uint32_t retries = 2;
+    /** Millisec to wait before the first retry. */
+    uint32_t backoff = 100;
+    /** Max millisec to wait between retries. */
+    uint32_t maxBackoff = 2000;
+    /** Fraction (0-1) by which to randomly vary the backoff. */
+    float jitter = 0.2F;
+    /** Millisec to wait for reply before sending a hedged copy of a repeatable call, 0 = no hedging. */
+    uint32_t hedgeDelay = 0;
+} LbRpcPolicy;
+
+
+/** Latency and failure counters for the calls made to the control plane by one object. */
+typedef struct LbRpcStats_t {
+    /** Calls made (not counting retries and hedges). */
+    std::atomic<uint64_t> calls {0};
+    /** Calls that failed after all attempts. */
+    std::atomic<uint64_t> failures {0};
+    /** Attempts whose deadline passed. */
+    std::atomic<uint64_t> timeouts {0};
+    /** Attempts made after the first. */
+    std::atomic<uint64_t> retries {0};
+    /** Hedged copies sent. */
+    std::atomic<uint64_t> hedges {0};
+    /** Hedged copies whose reply was used. */
+    std::atomic<uint64_t> hedgeWins {0};
+    /** Sum of latencies of all calls in microsec, including retries. */
+    std::atomic<uint64_t> latencyTotal {0};
+    /** Largest latency of a call in microsec. */
+    std::atomic<uint64_t> latencyMax {0};
+
+    /**
+     * Record the result of a call.
+     * @param micros  latency in microsec.
+     * @param ok      true if call succeeded.
+     */
+    void record(uint64_t micros, bool ok) {
+        calls++;
+        if (!ok) failures++;
+        latencyTotal += micros;
+        uint64_t max = latencyMax.load(std::memory_order_relaxed);
+        while (micros > max && !latencyMax.compare_exchange_weak(max, micros, std::memory_order_relaxed));
+    }
+
+    /** @return mean latency of calls in microsec. */
+    double meanLatency() const {
+        uint64_t n = calls;
+        return n == 0 ? 0. : (double)latencyTotal / (double)n;
+    }
+} LbRpcStats;
+
+
+/**
+ * Class which hands out grpc channels to the control plane so that all the clients
+ * and reservations in one process which talk to the same CP share connections,
+ * instead of each opening its own and paying for the handshake.
+ * For each target, up to a set number of channels (each with its own connection)
+ * are made and handed out in turn. A channel closes when no stub uses it any more.
+ * Besides host:port, a target may be "unix:path" for a unix domain socket or
+ * "inproc:name" for a server in this process added with addInProcessServer().
+ */
+class LbChannelPool {
+
+    public:
+
+        static std::shared_ptr<Channel> getChannel(const std::string& target, uint32_t keepalive = 0);
+        static std::string target(const std::string& cpIP, uint16_t cpPort);
+        static void addInProcessServer(const std::string& name, Server *server);
+        static void removeInProcessServer(const std::string& name);
+        static void setSubchannels(uint32_t count);
+        static uint32_t getSubchannels();
+        static size_t getChannelCount();
+
+    private:
+
+        /** Channels to each target. */
+        typedef struct targetChannels_t {
+            std::vector<std::weak_ptr<Channel>> channels;
+            /** Index of channel to hand out next. */
+            uint32_t next = 0;
+        } targetChannels;
+
+        /** Protect the map. */
+        static std::mutex poolMutex;
+
+        /** Map with key = target (host:port) and val = its channels. */
+        static std::unordered_map<std::string, targetChannels> pool;
+
+        /** Number of separate connections to make to each target. */
+        static uint32_t subchannels;
+
+        /** Map with key = name and val = server in this process reached by "inproc:name". */
+        static std::unordered_map<std::string, Server *> inProcessServers;
+};
+
+
+/** State of a backend as reported to the control plane. */
+typedef struct LbState_t {
+    /** Fraction of fifo entries filled with unprocessed data. */
+    float fillPercent = 0.F;
+    /** PID error term in fraction of backend's fifo entries. */
+    float pidError = 0.F;
+    /** Ready to receive more data or not. */
+    bool isReady = true;
+} LbState;
+
+
+/**
+ * Class holding the state of a backend so that any thread may publish it and another read it
+ * without either taking a lock, through an LbSeqLock. Writers never wait on readers.
+ */
+class LbStateCell {
+
+    public:
+
+        /**
+         * Publish new state.
+         * @param fill      fraction of fifo filled.
+         * @param pidErr    pid error.
+         * @param ready     ready to receive data or not.
+         */
+        void publish(float fill, float pidErr, bool ready) {
+            seq.writeBegin();
+            fillPercent.store(fill, std::memory_order_release);
+            pidError.store(pidErr, std::memory_order_release);
+            isReady.store(ready, std::memory_order_release);
+            seq.writeEnd();
+        }
+
+        /** @return consistent copy of the last published state. */
+        LbState read() const {
+            LbState state;
+            uint32_t s;
+            do {
+                s = seq.readBegin();
+                state.fillPercent = fillPercent.load(std::memory_order_acquire);
+                state.pidError    = pidError.load(std::memory_order_acquire);
+                state.isReady     = isReady.load(std::memory_order_acquire);
+            } while (seq.readRetry(s));
+            return state;
+        }
+
+        /** @return number of times state was published. */
+        uint32_t getVersion() const {return seq.getWrites();}
+
+    private:
+
+        LbSeqLock seq;
+
+        std::atomic<float> fillPercent {0.F};
+        std::atomic<float> pidError {0.F};
+        std::atomic<bool>  isReady {true};
+};
+
+
+/** A control plane that a client can talk to. */
+typedef struct LbCpEndpoint_t {
+    /** Host:port of control plane. */
+    std::string target;
+    /** Channel to control plane, possibly shared with other clients. */
+    std::shared_ptr<Channel> channel;
+    /** Object used to call control plane's grpc API routines. */
+    std::unique_ptr<LoadBalancer::Stub> stub;
+} LbCpEndpoint;
+
+
 /** Class used to send data from backend (client) to control plane (server). */
 class LbControlPlaneClient {
     
@@ -196,17 +908,44 @@ class LbControlPlaneClient {
                              const std::string& name, const std::string& token,
                              const std::string& lbId, float weight);
 
+        ~LbControlPlaneClient();
+
       	int Register();
       	int Deregister() const;
-        int SendState()  const;
+        int SendState();
+        int SendStateAsync();
+
+        int OpenStateStream();
+        int SendStateStream();
+        int CloseStateStream();
+
+        int  StartReporter(uint32_t minPeriod, uint32_t maxPeriod, float fillChange,
+                           std::function<float()> fillSource = nullptr);
+        void StopReporter();
 
         void update(float fill, float pidErr);
+        void update(float fill, float pidErr, bool ready);
+        LbState getState() const;
 
         const std::string & getCpAddr()       const;
         const std::string & getDataAddr()     const;
         const std::string & getName()         const;
         const std::string & getToken()   const;
-        const std::string & getSessionToken() const;
+        std::string getSessionToken() const;
+        std::string getSessionId() const;
+        const std::string & getLbId()         const;
+        void getSession(std::string & id, std::string & token) const;
+
+        void setRpcPolicy(const LbRpcPolicy & policy);
+        const LbRpcPolicy & getRpcPolicy()    const;
+        const LbRpcStats  & getRpcStats()     const;
+
+        int  addStandbyCp(const std::string& cpIP, uint16_t cpPort);
+        void setFailoverTimeout(uint32_t millisec);
+        void setKeepaliveTime(uint32_t millisec);
+        int  failover();
+        const std::string & getActiveCp() const;
+        uint64_t getFailoverCount()     const;
 
         uint16_t  getCpPort()           const;
         uint16_t  getDataPort()         const;
@@ -217,12 +956,56 @@ class LbControlPlaneClient {
         float     getPidError()         const;
         bool      getIsReady()          const;
 
+        uint64_t  getAsyncSent()        const;
+        uint64_t  getAsyncDropped()     const;
+        uint64_t  getAsyncFailed()      const;
+
+        uint32_t  getReportPeriod()     const;
+        uint64_t  getReportCount()      const;
+        uint64_t  getReportErrors()     const;
+
+        float     getHintWeight()       const;
+        uint32_t  getHintSlots()        const;
+        uint64_t  getHintCount()        const;
+
 
   
     private:
 
-    /** Object used to call backend's grpc API routines. */
-    std::unique_ptr<LoadBalancer::Stub> stub_;
+        void setSession(SendStateRequest & request) const;
+        void fillStateRequest(SendStateRequest & request) const;
+        void startAsyncSendState();
+        void drainAsyncSendState();
+        void readStateStream();
+        void runReporter();
+
+        LoadBalancer::Stub * stub() const;
+        LbRpcPolicy callPolicy() const;
+        int registerActive();
+        int reopenStateStream();
+
+    /** Control planes this client can use. The first is the one given to the constructor,
+     *  the others are standbys switched to, in order, if the one in use fails.
+     *  Only added to before registering so it never changes while in use. */
+    std::vector<LbCpEndpoint> cpEndpoints;
+
+    /** Index into cpEndpoints of the control plane in use. */
+    std::atomic<uint32_t> activeCp {0};
+
+    /** When there are standbys, millisec a call to the CP in use may take before switching. */
+    uint32_t failoverTimeout = 250;
+
+    /** When there are standbys, millisec between keepalive pings to the control planes. */
+    uint32_t keepaliveTime = 1000;
+
+    /** Number of times switched to another control plane. */
+    std::atomic<uint64_t> failoverCount {0};
+
+    /** Deadline, retry and hedging policy of calls to control plane. */
+    LbRpcPolicy rpcPolicy;
+
+    /** Latency and failure counters of calls to control plane. */
+    mutable LbRpcStats rpcStats;
 
     /** Control plane's IP address (dotted decimal format). */
     std::string cpAddr;
@@ -258,6 +1041,10 @@ class LbControlPlaneClient {
 
     // Reply from registration request
 
+    /** Protects sessionToken and sessionId, which change when switching control plane,
+     *  for getSession() called from other threads. */
+    mutable std::mutex sessionMutex;
+
     /** Token used to send state and to deregister. */
     std::string sessionToken;
 
@@ -268,19 +1055,235 @@ class LbControlPlaneClient {
 
     // Transient data to send to control plane
 
-    /** Percent of fifo entries filled with unprocessed data. */
-    float fillPercent;
+    /** Fill, PID error and readiness, published by update() from any thread. */
+    LbStateCell state;
 
-    /** PID error term in percentage of backend's fifo entries. */
-    float pidError;
+    /** Report reused by each SendState() call. */
+    SendStateRequest stateRequest;
 
-    /** Ready to receive more data or not. */
-    bool isReady = true;
+    /** Reply reused by each SendState() call. */
+    SendStateReply stateReply;
+
+
+    // Asynchronous state reporting
+
+    /** Queue on which asynchronous SendState calls complete. */
+    CompletionQueue asyncCq;
+
+    /** Thread which drains asyncCq, started by the first SendStateAsync(). */
+    std::thread asyncThread;
+
+    /** Protects everything below used by both the caller and asyncThread. */
+    std::mutex asyncMutex;
+
+    /** Is there an asynchronous SendState call in progress? */
+    bool asyncInFlight = false;
+
+    /** Is there a report waiting for the call in progress to finish? */
+    bool asyncPending = false;
+
+    /** Has an asynchronous call failed since the last SendStateAsync()? */
+    bool asyncError = false;
+
+    /** Stop starting new calls since object is being destroyed. */
+    bool asyncQuit = false;
+
+    /** Latest report, waiting for the call in progress to finish. */
+    SendStateRequest pendingRequest;
+
+    /** Report of call in progress. */
+    SendStateRequest asyncRequest;
+
+    /** Reply to call in progress. */
+    SendStateReply asyncReply;
+
+    /** Status of call in progress. */
+    Status asyncStatus;
+
+    /** Context of call in progress. A context cannot be reused so each call gets a new one. */
+    std::unique_ptr<ClientContext> asyncContext;
+
+    /** Reader of call in progress. */
+    std::unique_ptr<ClientAsyncResponseReader<SendStateReply>> asyncReader;
+
+    /** Number of asynchronous reports the CP accepted. */
+    std::atomic<uint64_t> asyncSent {0};
+
+    /** Number of asynchronous reports replaced by a newer one before being sent. */
+    std::atomic<uint64_t> asyncDropped {0};
+
+    /** Number of asynchronous reports which failed. */
+    std::atomic<uint64_t> asyncFailed {0};
+
+
+    // Streamed state reporting
+
+    /** Context of state stream. */
+    std::unique_ptr<ClientContext> streamContext;
+
+    /** State stream to CP, null if not open. */
+    std::unique_ptr<ClientReaderWriter<StreamStateRequest, StreamStateReply>> stateStream;
+
+    /** Message reused for each report on stream. */
+    StreamStateRequest streamRequest;
+
+    /** Thread reading scheduling hints from the stream. */
+    std::thread streamThread;
+
+    /** Set when the stream can no longer be read from. */
+    std::atomic<bool> streamBroken {false};
+
+    /** Set when a broken stream could not be opened to another control plane. */
+    bool streamLost = false;
+
+    /** Latest hint from CP: fraction of LB calendar assigned to this backend. */
+    std::atomic<float> hintWeight {0.F};
+
+    /** Latest hint from CP: number of LB calendar slots assigned to this backend. */
+    std::atomic<uint32_t> hintSlots {0};
+
+    /** Number of hints received. */
+    std::atomic<uint64_t> hintCount {0};
+
+
+    // Built-in reporter
+
+    /** Thread sending reports, started by StartReporter(). */
+    std::thread reporterThread;
+
+    /** Used with reporterCv to wake the reporter to quit. */
+    std::mutex reporterMutex;
+
+    /** Used to wake the reporter to quit. */
+    std::condition_variable reporterCv;
+
+    /** Tell the reporter to quit. */
+    bool reporterQuit = false;
+
+    /** If set, called by the reporter to get the fill level, otherwise the level from update() is used. */
+    std::function<float()> reporterFillSource;
+
+    /** Millisec between fill samples, also the shortest time between reports. */
+    uint32_t reporterMinPeriod = 100;
+
+    /** Longest millisec between reports. */
+    uint32_t reporterMaxPeriod = 1000;
+
+    /** Change in fill since the last report which triggers a report right away. */
+    float reporterFillChange = 0.05F;
+
+    /** Current millisec between reports. */
+    std::atomic<uint32_t> reportPeriod {0};
+
+    /** Number of reports sent by reporter. */
+    std::atomic<uint64_t> reportCount {0};
+
+    /** Number of reports the reporter failed to send. */
+    std::atomic<uint64_t> reportErrors {0};
 
 };
 
 
 
+/**
+ * Class used to send the states of many backends on one node to the control plane
+ * in a single call, rather than having each backend send its own.
+ * Backends are registered (by their own LbControlPlaneClient) and then added here.
+ * Each batch contains the state last given to update() of each added client.
+ * Batches go to the control plane each client uses. If a client switched to a standby
+ * control plane, its new session is sent there. If a batch cannot be sent, its clients
+ * switch to a standby, if they have any, so added clients should send no reports of their own.
+ */
+class LbStateAggregator {
+
+    public:
+
+        LbStateAggregator(const std::string& cpIP, uint16_t cpPort, const std::string& lbId);
+        ~LbStateAggregator();
+
+        void add(LbControlPlaneClient *client);
+        void remove(LbControlPlaneClient *client);
+
+        int SendStateBatch();
+
+        int  Start(uint32_t period);
+        void Stop();
+
+        void setRpcPolicy(const LbRpcPolicy & policy);
+        const LbRpcStats & getRpcStats() const;
+
+        size_t    getClientCount()      const;
+        uint64_t  getBatchCount()       const;
+        uint64_t  getBatchErrors()      const;
+        uint32_t  getLastAccepted()     const;
+
+    private:
+
+        void run(uint32_t period);
+        void makeBatches();
+
+    /** Clients using one control plane, and the batch sent to it. */
+    typedef struct Batch_t {
+        /** Control plane's target. */
+        std::string target;
+        /** Object used to call the control plane's grpc API routines. */
+        std::unique_ptr<LoadBalancer::Stub> stub;
+        /** Index into clients of the client of each state in request. */
+        std::vector<size_t> members;
+        /** Batch reused by each SendStateBatch() call. */
+        SendStateBatchRequest request;
+        /** Reply reused by each SendStateBatch() call. */
+        SendStateBatchReply reply;
+    } Batch;
+
+    /** Deadline, retry and hedging policy of calls to control plane. */
+    LbRpcPolicy rpcPolicy;
+
+    /** Latency and failure counters of calls to control plane. */
+    mutable LbRpcStats rpcStats;
+
+    /** LB id all clients are registered with. */
+    std::string lbId;
+
+    /** Protects clients, failovers, batches and regroup. */
+    mutable std::mutex clientMutex;
+
+    /** Clients whose states are sent. */
+    std::vector<LbControlPlaneClient *> clients;
+
+    /** Failover count of each client when its session was put in a batch. */
+    std::vector<uint64_t> failovers;
+
+    /** One batch for each control plane in use, remade when regroup is set. */
+    std::vector<Batch> batches;
+
+    /** True if clients were added, removed or switched control plane since batches were made. */
+    bool regroup = true;
+
+    /** Thread started by Start() to send a batch each period. */
+    std::thread sendThread;
+
+    /** Used with quitCv to wake the thread to quit. */
+    std::mutex quitMutex;
+
+    /** Used to wake the thread to quit. */
+    std::condition_variable quitCv;
+
+    /** Tell the thread to quit. */
+    bool quit = false;
+
+    /** Number of batches sent. */
+    std::atomic<uint64_t> batchCount {0};
+
+    /** Number of batches that failed. */
+    std::atomic<uint64_t> batchErrors {0};
+
+    /** Number of states CP accepted in the last batch. */
+    std::atomic<uint32_t> lastAccepted {0};
+};
+
+
+
 
 /** Class used to keep status data for a single client/backend. */
 class LbClientStatus {
@@ -312,13 +1315,27 @@ public:
                   const std::string& _name, const std::string& adminToken,
                   int64_t untilSeconds);
 
+    LbReservation(const std::string& cpIP, uint16_t cpPort,
+                  const std::string& lbId, const std::string& adminToken);
+
+    ~LbReservation();
+
     int ReserveLoadBalancer();
+    int GetLoadBalancer();
     int FreeLoadBalancer() const;
     int LoadBalancerStatus();
+    int WatchLoadBalancerStatus(uint32_t minInterval = 0, uint32_t refreshPeriod = 0);
+    int StopWatch();
 
     static int FreeLoadBalancer(const std::string& cpIP, uint16_t cpPort,
                                 std::string lbId, std::string adminToken);
 
+    std::future<int> ReserveLoadBalancerAsync();
+    std::future<int> FreeLoadBalancerAsync() const;
+
+    static int ReserveLoadBalancers(const std::vector<LbReservation*> & reservations);
+    static int FreeLoadBalancers(const std::vector<LbReservation*> & reservations);
+
     const std::string & getLbName()        const;
     const std::string & getAdminToken()    const;
     const std::string & getInstanceToken() const;
@@ -337,6 +1354,13 @@ public:
     bool reservationElapsed() const;
     bool reserved() const;
     const std::unordered_map<std::string, LbClientStatus> & getClientStats() const;
+    std::unordered_map<std::string, LbClientStatus> copyClientStats() const;
+    bool isWatching() const;
+    uint64_t getWatchUpdates() const;
+
+    void setRpcPolicy(const LbRpcPolicy & policy);
+    const LbRpcPolicy & getRpcPolicy() const;
+    const LbRpcStats  & getRpcStats()  const;
 
 
 private:
@@ -349,6 +1373,12 @@ private:
     /** Object used to call backend's grpc API routines. */
     std::unique_ptr<LoadBalancer::Stub> stub_;
 
+    /** Deadline, retry and hedging policy of calls to control plane. */
+    LbRpcPolicy rpcPolicy;
+
+    /** Latency and failure counters of calls to control plane. */
+    mutable LbRpcStats rpcStats;
+
     /** Control plane's IP address (dotted decimal format). */
     std::string cpAddr;
 
@@ -399,6 +1429,32 @@ private:
     /** Map used to store stats on LB clients.
      * Key is client name, val is LbClientStatus struct. */
     std::unordered_map<std::string, LbClientStatus> clientStats;
+
+    /** Protects clientStats while watching status. */
+    mutable std::mutex statsMutex;
+
+
+    // Status watch
+
+    /** Context of status watch. */
+    std::unique_ptr<ClientContext> watchContext;
+
+    /** Stream of status changes from CP, null if not watching. */
+    std::unique_ptr<ClientReader<LoadBalancerStatusDelta>> watchReader;
+
+    /** Thread reading status changes into clientStats. */
+    std::thread watchThread;
+
+    /** True while status changes are being read. */
+    std::atomic<bool> watching {false};
+
+    /** Number of status changes read. */
+    std::atomic<uint64_t> watchUpdates {0};
+
+    void readStatusWatch();
+    void fillReserveRequest(ReserveLoadBalancerRequest & request) const;
+    void fillFreeRequest(FreeLoadBalancerRequest & request) const;
+    int  reserved(const Status & status, const ReserveLoadBalancerReply & reply);
 };
 
 
@@ -12,478 +12,527 @@
 
 #include "lb_cplane_async.h"
 
-static std::atomic<std::uint64_t>  backendToken{0};
 using namespace std::chrono;
 
 
-		//////////////////
-		// BackEnd class
-		/////////////////
+        /** How often a status watch looks for changes. */
+        static const milliseconds watchPollPeriod(10);
 
+        /** How long calls have to end on their own at shutdown before being cancelled. */
+        static const milliseconds shutdownGrace(1000);
 
-        /**
-         * Constructor.
-         * @param req registration request from backend.
-         */
-        BackEnd::BackEnd(const RegisterRequest* req) {
-            authToken       = req->authtoken();
-        	name            = req->name();
-
-            cpus            = req->cpus();
-        	ramBytes        = req->rambytes();
-        	bufCount        = req->bufcount();
-        	bufSizeBytes    = req->bufsizebytes();
-            setPointPercent = req->setpointpercent();
-
-            targetIP        = req->dplanetargetip();
-            targetPort      = req->dplanetargetport();
-            targetPortRange = req->dplanetargetportrange();
-        }
+
+namespace {
+
+        /////////////////////////////////
+        // Unary calls
+        /////////////////////////////////
 
 
         /**
-         * Update values.
-         * @state current state used to update this object. 
+         * Unary call. Once the request arrives, another of the same kind is awaited,
+         * the request is answered by the simulated CP's handler for it, and the reply sent.
          */
-        void BackEnd::update(const SendStateRequest* state) {
+        template <typename Req, typename Rep>
+        class LbUnaryCall : public LbAsyncCall {
+
+        public:
+
+            /** Method of the async service which asks for the next call of this kind. */
+            typedef void (LoadBalancer::AsyncService::*RequestMethod)(ServerContext*, Req*,
+                                                                      ServerAsyncResponseWriter<Rep>*,
+                                                                      CompletionQueue*, ServerCompletionQueue*, void*);
+
+            /** Method of the simulated CP which answers it. */
+            typedef Status (LoadBalancerServiceImpl::*HandleMethod)(ServerContext*, const Req*, Rep*);
 
-            if (state->has_timestamp()) {
-                time = google::protobuf::util::TimeUtil::TimestampToMilliseconds(state->timestamp());
-                timestamp = state->timestamp();
+
+            LbUnaryCall(LoadBalancerAsyncServer *server, ServerCompletionQueue *cq,
+                        RequestMethod request, HandleMethod handle) :
+                    server(server), cq(cq), request(request), handle(handle), responder(&context) {
+
+                server->callStarted();
+                (server->getAsyncService()->*request)(&context, &req, &responder, cq, cq, this);
             }
 
-            // Now record local time
-            localTime   = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
 
-            sessionToken = state->sessiontoken();
-            fillPercent  = state->fillpercent();
-            pidError     = state->piderror();
-            isReady      = state->isready();
-        }
+            ~LbUnaryCall() override {
+                server->callEnded();
+            }
 
 
-        /** Print out backend status. */
-        void BackEnd::printBackendState() const {
-        	std::cout << "State of "        << name
-                      << " @ t = "          << time
-                      << " : buf cnt = "    << bufCount
-                      << ", buf size = "    << bufSizeBytes
-                      << ", set pt = "      << setPointPercent
-                      << ", fill % = "      << fillPercent
-                      << ", pid error % = " << pidError
-                      << ", ready = "       << isReady
-                      << std::endl;
-       }
+            void proceed(bool ok) override {
+                if (!ok || replied) {
+                    delete this;
+                    return;
+                }
 
+                // Be ready for the next one
+                if (!server->isShuttingDown()) {
+                    new LbUnaryCall(server, cq, request, handle);
+                }
 
-        /** Get the backend's authentication token.
-         *  @return backend's authentication token. */
-        const std::string & BackEnd::getAuthToken() const {return authToken;}
+                Status status = (server->getService()->*handle)(&context, &req, &rep);
+                replied = true;
+                responder.Finish(rep, status, this);
+            }
 
-        /** Get the backend's session token.
-         *  @return backend's session token. */
-        const std::string & BackEnd::getSessionToken() const {return sessionToken;}
 
-        /** Get the backend's name.
-         *  @return backend's name. */
-        const std::string & BackEnd::getName() const {return name;}
+        private:
 
+            LoadBalancerAsyncServer *server;
+            ServerCompletionQueue *cq;
+            RequestMethod request;
+            HandleMethod handle;
 
-        /** Get the timestamp of the latest backend's sent data.
-         *  @return timestamp of the latest backend's sent data. */
-        google::protobuf::Timestamp BackEnd::getTimestamp() const {return timestamp;}
+            ServerContext context;
+            Req req;
+            Rep rep;
+            ServerAsyncResponseWriter<Rep> responder;
 
-        /** Get the timestamp of the latest backend's sent data.
-         *  @return timestamp of the latest backend's sent data. */
-        int64_t BackEnd::getTime() const {return time;}
+            /** True once the reply has been sent. */
+            bool replied = false;
+        };
 
-        /** Get the locally set timestamp of the arrival of the latest backend's sent data.
-         *  @return locally set timestamp of the arrival of the latest backend's sent data. */
-        int64_t BackEnd::getLocalTime() const {return localTime;}
 
 
-        /** Get total number of cores on backend.
-         *  @return backend's number of cores. */
-        uint32_t BackEnd::getCpus() const {return cpus;}
+        /////////////////////////////////
+        // StreamState
+        /////////////////////////////////
 
-        /** Get total RAM in backend.
-         *  @return backend's total RAM. */
-        uint32_t BackEnd::getRamBytes() const {return ramBytes;}
 
-        /** Get the backend's total number of fifo entries (buffers).
-         *  @return backend's total number of fifo entries. */
-        uint32_t BackEnd::getBufCount() const {return bufCount;}
+        /**
+         * Stream of states from a backend, with schedule hints sent back.
+         * Reads and writes take turns, so only one operation is ever pending.
+         */
+        class LbStreamStateCall : public LbAsyncCall {
 
-        /** Get the byte size of each backend fifo entry (buffer).
-         *  @return byte size of each backend fifo entry. */
-        uint32_t BackEnd::getBufSizeBytes() const {return bufSizeBytes;}
+        public:
 
-        
-        /** Get the fill percentage of the backend fifo (0-1).
-         *  @return fill percentage of the backend fifo. */
-        float BackEnd::getFillPercent() const {return fillPercent;}
-        
-        /** Get the set point of the backend in % fifo filled (0-1).
-         *  @return set point of the backend. */
-        float BackEnd::getSetPointPercent() const {return setPointPercent;}
-        
-        /** Get the PID loop's error term in % fifo (0 - +/- 0.5).
-         *  @return PID loop's error term. */
-        float BackEnd::getPidError() const {return pidError;}
+            LbStreamStateCall(LoadBalancerAsyncServer *server, ServerCompletionQueue *cq) :
+                    server(server), cq(cq), stream(&context) {
 
+                server->callStarted();
+                server->getAsyncService()->RequestStreamState(&context, &stream, cq, cq, this);
+            }
 
-        /** Get the backend's receiving IP address (dot-decimal).
-         *  @return backend's receiving IP address. */
-        const std::string & BackEnd::getTargetIP() const {return targetIP;}
 
-        /** Get the backend's receiving UDP port.
-         *  @return backend's receiving UDP port. */
-        uint32_t BackEnd::getTargetPort() const {return targetPort;}
+            ~LbStreamStateCall() override {
+                server->callEnded();
+            }
 
-        /** Get the backend's receiving UDP port.
-         *  @return backend's receiving UDP port. */
-        uint32_t BackEnd::getTargetPortRange() const {return targetPortRange;}
 
+            void proceed(bool ok) override {
+                switch (state) {
+                    case REQUEST:
+                        if (!ok) {
+                            delete this;
+                            return;
+                        }
+                        if (!server->isShuttingDown()) {
+                            new LbStreamStateCall(server, cq);
+                        }
+                        state = FIRST_READ;
+                        stream.Read(&request, this);
+                        break;
+
+                    case FIRST_READ:
+                        // Stream closed before saying anything
+                        if (!ok) {
+                            finish(Status::OK);
+                            break;
+                        }
+                        {
+                            // Authenticate once, later messages need not identify the session
+                            Status status = server->getService()->checkStreamSession(request, &handle);
+                            if (!status.ok()) {
+                                finish(status);
+                                break;
+                            }
+                        }
+                        apply();
+                        break;
+
+                    case READ:
+                        // Backend closed the stream
+                        if (!ok) {
+                            finish(Status::OK);
+                            break;
+                        }
+                        apply();
+                        break;
+
+                    case WRITE:
+                        if (!ok) {
+                            finish(Status::OK);
+                            break;
+                        }
+                        state = READ;
+                        stream.Read(&request, this);
+                        break;
+
+                    case FINISH:
+                        delete this;
+                        break;
+                }
+            }
 
-        /** Get if backend's ready to receive more data.
-        *  @return true if backend's ready to receive more data. */
-        bool BackEnd::getIsReady() const {return isReady;}
 
-        /** True if backend is actively sending data updates.
-        *  @return true if backend is actively sending data updates. */
-        bool BackEnd::getIsActive() const {return isActive;}
+        private:
 
+            enum CallState {REQUEST, FIRST_READ, READ, WRITE, FINISH};
 
-        /** True if backend is actively sending data updates.
-         *  @param active true if backend is actively sending data updates, else false. */
-        void BackEnd::setIsActive(bool active) {isActive = active;}
+            LoadBalancerAsyncServer *server;
+            ServerCompletionQueue *cq;
 
+            ServerContext context;
+            StreamStateRequest request;
+            StreamStateReply hint;
+            ServerAsyncReaderWriter<StreamStateReply, StreamStateRequest> stream;
 
+            CallState state = REQUEST;
+            LbSessionHandle handle = 0;
+            uint64_t hintVersion = 0;
 
-        /////////////////////////////////
-		// BackEndReportService class
-		/////////////////////////////////
 
-        Status BackendReportServiceImpl::SendStateAsync(ServerContext* context,
-                                                        const SendStateRequest* state,
-                                                        ServerAsyncResponseWriter<SendStateReply> *responder,
-                                                        CompletionQueue *cq1, CompletionQueue *cq2,
-                                                        void  *ptr) {
+            /** Apply the state just read, then send a hint if needed or read the next state. */
+            void apply() {
+                bool sendHint;
+                Status status = server->getService()->applyStreamState(handle, request, hintVersion,
+                                                                         &hint, &sendHint);
+                if (!status.ok()) {
+                    finish(status);
+                }
+                else if (sendHint) {
+                    state = WRITE;
+                    stream.Write(hint, this);
+                }
+                else {
+                    state = READ;
+                    stream.Read(&request, this);
+                }
+            }
+
 
-            return Status::OK;
-        }
+            void finish(const Status & status) {
+                state = FINISH;
+                stream.Finish(status, this);
+            }
+        };
+
+
+
+        /////////////////////////////////
+        // WatchLoadBalancerStatus
+        /////////////////////////////////
 
 
         /**
-         * Send the state of the backend to server / control-plane.
-         * @param contex   unused here
-         * @param request  unused here
-         * @param reply    reply to send to client
+         * Stream of status changes to a client. An alarm wakes the call to look for changes,
+         * no sooner than the client's minInterval after the last message. Since the client may
+         * go away while nothing is pending but the alarm, the call is also told when it is done,
+         * and only deleted once that has happened and its own last operation completed.
          */
-        Status BackendReportServiceImpl::SendState (ServerContext* context,
-                                                    const SendStateRequest* state,
-                                                    SendStateReply* reply) {
+        class LbWatchStatusCall : public LbAsyncCall {
 
-            // Protect map since there's multithreaded access
-            const std::lock_guard<std::mutex> lock(map_mutex);
+        public:
 
-            // Search on the token
-            auto backend = data.find(state->sessiontoken());
+            LbWatchStatusCall(LoadBalancerAsyncServer *server, ServerCompletionQueue *cq) :
+                    server(server), cq(cq), writer(&context), doneTag(this) {
 
-            // If not registered
-            if (backend == data.end()) {
-std::cout << "Receives state of UNREGISTERED session token " << state->sessiontoken() << ", ignore" << std::endl;
-                return Status::OK;
+                server->callStarted();
+                context.AsyncNotifyWhenDone(&doneTag);
+                server->getAsyncService()->RequestWatchLoadBalancerStatus(&context, &request, &writer, cq, cq, this);
             }
 
-//std::cout << "Received state of session token " << state->sessiontoken() << std::endl;
 
-            backend->second.update(state);
+            ~LbWatchStatusCall() override {
+                server->callEnded();
+            }
 
-            return Status::OK;
-        }
 
+            void proceed(bool ok) override {
+                switch (state) {
+                    case REQUEST:
+                        // Never started, so done will not be told
+                        if (!ok) {
+                            delete this;
+                            return;
+                        }
+                        if (!server->isShuttingDown()) {
+                            new LbWatchStatusCall(server, cq);
+                        }
+                        minInterval = milliseconds(request.mininterval());
+                        if (request.refreshperiod() > 0) watch.refreshPeriod = milliseconds(request.refreshperiod());
+                        send();
+                        break;
+
+                    case WAIT:
+                        if (!ok || done) {
+                            finish();
+                            break;
+                        }
+                        send();
+                        break;
+
+                    case WRITE:
+                        lastSend = system_clock::now();
+                        if (!ok || done) {
+                            finish();
+                            break;
+                        }
+                        wait();
+                        break;
+
+                    case FINISH:
+                        finished = true;
+                        if (done) delete this;
+                        break;
+                }
+            }
 
-        /**
-         * Register a backend with the control plane.
-         * @param contex   unused here
-         * @param request  unused here
-         * @param reply    reply to send to client
-         */
-		Status BackendReportServiceImpl::Register (ServerContext* context,
-		                                           const RegisterRequest* request,
-		                                           RegisterReply* reply) {
 
-            const std::lock_guard<std::mutex> lock(map_mutex);
+        private:
+
+            enum CallState {REQUEST, WAIT, WRITE, FINISH};
+
+            /** Tag telling the call that it is done, whether finished or cancelled by the client. */
+            class DoneTag : public LbAsyncCall {
+            public:
+                explicit DoneTag(LbWatchStatusCall *call) : call(call) {}
+                void proceed(bool /*ok*/) override {call->onDone();}
+            private:
+                LbWatchStatusCall *call;
+            };
+
+            LoadBalancerAsyncServer *server;
+            ServerCompletionQueue *cq;
+
+            ServerContext context;
+            WatchLoadBalancerStatusRequest request;
+            LoadBalancerStatusDelta delta;
+            ServerAsyncWriter<LoadBalancerStatusDelta> writer;
+            DoneTag doneTag;
+            Alarm alarm;
+
+            LbStatusWatch watch;
+            milliseconds minInterval {0};
+            system_clock::time_point lastSend;
+
+            CallState state = REQUEST;
+            bool done = false;
+            bool finished = false;
+
+
+            /** Send what changed, or wait if nothing did. */
+            void send() {
+                if (server->isShuttingDown()) {
+                    finish();
+                }
+                else if (server->getService()->statusDelta(watch, &delta)) {
+                    state = WRITE;
+                    writer.Write(delta, this);
+                }
+                else {
+                    wait();
+                }
+            }
 
-std::cout << "Currently NO authentication needed for " << request->name() << std::endl;
 
-            // Generate a unique session token
-            uint64_t val = backendToken.fetch_add(1, std::memory_order_relaxed);
-            std::string sessionToken = std::to_string(val);
+            void wait() {
+                if (server->isShuttingDown()) {
+                    finish();
+                    return;
+                }
+                state = WAIT;
+                alarm.Set(cq, std::max(system_clock::now() + watchPollPeriod, lastSend + minInterval), this);
+            }
 
-            // Save backend info and place in a map
-            BackEnd be(request);
-			data.insert(std::make_pair(sessionToken, be));
 
-std::cout << "Registered client\"" << request->name() << "\" (as token " << val << ")" << std::endl;
+            void finish() {
+                state = FINISH;
+                writer.Finish(Status::OK, this);
+            }
 
-	        reply->set_sessiontoken(sessionToken);
-	        return Status::OK;
-	    }
-	     		
-        
-        /**
-         * Unregister a backend from the control plane.
-         * @param contex   unused here
-         * @param request  unused here
-         * @param reply    reply to send to client
-         */
-		Status BackendReportServiceImpl::DeRegister (ServerContext* context,
-		                                             const DeregisterRequest* request,
-                                                     DeregisterReply* reply) {
-
-		    const std::lock_guard<std::mutex> lock(map_mutex);
-            data.erase(request->sessiontoken());
-std::cout << "De-registered client token " << request->sessiontoken() << std::endl;
-            return Status::OK;
-	    }
-	     		
-             
-        /**
-         * Get a COPY of the map containing all BackEnd objects.
-         * Copying the map while mutex protected and then using it will keep things threadsafe.
-         * This method will need to be called each time updated data is needed.
-         * @return COPY of map containing all BackEnd objects.
-         */       
-        std::shared_ptr<std::unordered_map<std::string, BackEnd>> BackendReportServiceImpl::getBackEnds() {
-            const std::lock_guard<std::mutex> lock(map_mutex);
-            return std::make_shared<std::unordered_map<std::string, BackEnd>>(data);
-        }
 
+            void onDone() {
+                done = true;
+                if (finished) {
+                    delete this;
+                }
+                else if (state == WAIT) {
+                    alarm.Cancel();
+                }
+            }
+        };
 
-//helloworld::Greeter::AsyncService service;
-//ServerBuilder builder;
-//builder.AddListeningPort("0.0.0.0:50051", InsecureServerCredentials());
-//builder.RegisterService(&service);
-//auto cq = builder.AddCompletionQueue();
-//auto server = builder.BuildAndStart();
+} // anonymous namespace
+
+
+
+        /////////////////////////////////
+        // LoadBalancerAsyncServer class
+        /////////////////////////////////
 
 
-        /**
-         * Blocking call to run local server.
-         * @param port port to run server on.
-         */
-        void BackendReportServiceImpl::runServer(uint16_t port, BackendReportServiceImpl *service) {
-		    std::cout << "in runServer method on port " << port << std::endl;
-		    std::string server_address("0.0.0.0:" + std::to_string(port));
-		    //std::string server_address2("0.0.0.0:50051");
-		    //BackendStateServiceImpl service;
-            std::cout << "Server listening on " << server_address << std::endl;
-
-		    grpc::EnableDefaultHealthCheckService(true);
-		    grpc::reflection::InitProtoReflectionServerBuilderPlugin();
-		    ServerBuilder builder;
-		    // Listen on the given address without any authentication mechanism.
-		    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-		    // Register "service" as the instance through which we'll communicate with
-		    // clients. In this case it corresponds to an *synchronous* service.
-		    builder.RegisterService(service);
-            cq = builder.AddCompletionQueue();
-		    // Finally assemble the server.
-		    std::unique_ptr<Server> server(builder.BuildAndStart());
-		    std::cout << "Server listening on " << server_address << std::endl;
-
-		    // Wait for the server to shutdown. Note that some other thread must be
-		    // responsible for shutting down the server for this call to ever return.
-		    server->Wait();
-        }
-        
-        
- 		/////////////////////////////////
-		// LbControlPlaneClient class
-		/////////////////////////////////
-                
-       
         /**
          * Constructor.
-         * @param cpIpAddr     grpc IP address of control plane (dotted decimal format).
-         * @param cpPort       grpc port of control plane.
-         * @param cliName      name of this backend.
-         * @param bufferSize   byte size of each buffer (fifo entry) in this backend.
-         * @param bufferCount  number of buffers in fifo.
-         * @param setPoint     PID loop set point (% of fifo).
-         * 
+         * @param service  simulated CP which keeps the backends' data and answers calls.
+         * @param threads  number of threads, each with its own completion queue,
+         *                 0 for one per core.
          */
-        LbControlPlaneClient::LbControlPlaneClient(
-                             const std::string& cpIP, uint16_t cpPort, const std::string& cliName,
-                             uint32_t bufferSize, uint32_t bufferCount, float setPoint) :
-                             ipAddr(cpIP), port(cpPort), name(cliName),
-                             bufSizeBytes(bufferSize), bufCount(bufferCount), setPointPercent(setPoint) {
-                
-		    target = cpIP + ":" + std::to_string(cpPort);
-		    stub_ = BackendReport::NewStub(grpc::CreateChannel(target, grpc::InsecureChannelCredentials()));
-        }  
-        
-  
-	    /**
-         * Update internal state of this object (eventually sent to control plane).
-         * @param fill     % of fifo filled
-         * @param pdErr    pid error (units of % fifo filled)
-         */
-        void LbControlPlaneClient::update(float fill, float pidErr) {
-        	fillPercent = fill;
-        	pidError = pidErr;
+        LoadBalancerAsyncServer::LoadBalancerAsyncServer(LoadBalancerServiceImpl *service, int threads) :
+                service(service) {
+
+            if (threads < 1) {
+                threads = std::thread::hardware_concurrency();
+                if (threads < 1) threads = 1;
+            }
+            threadCount = threads;
         }
 
 
+        /** Destructor which shuts down the server if running. */
+        LoadBalancerAsyncServer::~LoadBalancerAsyncServer() {
+            shutdown();
+        }
+
 
         /**
-		 * Register this backend with the control plane.
-		 * @return 0 if successful, 1 if error in grpc communication
-		 */
-    	int32_t LbControlPlaneClient::Register() {
-		    // Registration message we are sending to server
-		    RegisterRequest request;
+         * Start the server and the threads handling calls.
+         * @param port      TCP port to listen on, 0 for none.
+         * @param unixPath  path of unix domain socket to listen on, empty for none.
+         * @return 0 if successful, 1 if already started or server could not start.
+         */
+        int LoadBalancerAsyncServer::start(uint16_t port, const std::string & unixPath) {
+            if (server) return 1;
 
-            request.set_authtoken(name);
-            request.set_name(name);
+            ServerBuilder builder;
+            LoadBalancerServiceImpl::setupBuilder(builder, port, unixPath);
 
-            // Get # of cores (0 if unknown) (since C++ 11)
-            unsigned int nthreads = std::thread::hardware_concurrency();
-            request.set_cpus(nthreads);
+            builder.RegisterService(&asyncService);
+            for (int i = 0; i < threadCount; i++) {
+                cqs.emplace_back(builder.AddCompletionQueue());
+            }
 
-            // Find the amount of RAM
-            long page_size = sysconf(_SC_PAGE_SIZE);
-            long pages = 0;
-            uint64_t mem;
+            server = builder.BuildAndStart();
+            if (!server) {
+                std::cout << "Async server could not start" << std::endl;
+                cqs.clear();
+                return 1;
+            }
 
-#ifdef __linux__
+            // Await the first call of each kind on each queue. Every method of the async service is
+            // registered, and one never requested would leave its calls waiting till their deadline.
+            // The simulated CP does not implement reserving, getting or freeing an LB, so those go
+            // to the generated handlers, which answer UNIMPLEMENTED as the sync server does.
+            for (auto & q : cqs) {
+                ServerCompletionQueue *cq = q.get();
+                new LbUnaryCall<ReserveLoadBalancerRequest, ReserveLoadBalancerReply>(this, cq,
+                        &LoadBalancer::AsyncService::RequestReserveLoadBalancer,
+                        &LoadBalancerServiceImpl::ReserveLoadBalancer);
+                new LbUnaryCall<GetLoadBalancerRequest, ReserveLoadBalancerReply>(this, cq,
+                        &LoadBalancer::AsyncService::RequestGetLoadBalancer,
+                        &LoadBalancerServiceImpl::GetLoadBalancer);
+                new LbUnaryCall<LoadBalancerStatusRequest, LoadBalancerStatusReply>(this, cq,
+                        &LoadBalancer::AsyncService::RequestLoadBalancerStatus,
+                        &LoadBalancerServiceImpl::LoadBalancerStatus);
+                new LbUnaryCall<FreeLoadBalancerRequest, FreeLoadBalancerReply>(this, cq,
+                        &LoadBalancer::AsyncService::RequestFreeLoadBalancer,
+                        &LoadBalancerServiceImpl::FreeLoadBalancer);
+                new LbUnaryCall<RegisterRequest, RegisterReply>(this, cq,
+                        &LoadBalancer::AsyncService::RequestRegister,
+                        &LoadBalancerServiceImpl::Register);
+                new LbUnaryCall<DeregisterRequest, DeregisterReply>(this, cq,
+                        &LoadBalancer::AsyncService::RequestDeregister,
+                        &LoadBalancerServiceImpl::Deregister);
+                new LbUnaryCall<SendStateRequest, SendStateReply>(this, cq,
+                        &LoadBalancer::AsyncService::RequestSendState,
+                        &LoadBalancerServiceImpl::SendState);
+                new LbUnaryCall<SendStateBatchRequest, SendStateBatchReply>(this, cq,
+                        &LoadBalancer::AsyncService::RequestSendStateBatch,
+                        &LoadBalancerServiceImpl::SendStateBatch);
+                new LbStreamStateCall(this, cq);
+                new LbWatchStatusCall(this, cq);
+            }
 
-            // NOT POSIX
-            pages = sysconf(_SC_PHYS_PAGES);
+            for (auto & q : cqs) {
+                threads.emplace_back(&LoadBalancerAsyncServer::serve, this, q.get());
+            }
 
-#elif __APPLE__
+            std::cout << "Async server running " << threadCount << " threads" << std::endl;
+            return 0;
+        }
 
-            size_t len = sizeof(mem);
-            sysctlbyname("hw.memsize", &mem, &len, NULL, 0);
 
-#endif
+        /**
+         * Run by each thread to move along the calls of its completion queue until it is shut down.
+         * @param cq  completion queue.
+         */
+        void LoadBalancerAsyncServer::serve(ServerCompletionQueue *cq) {
+            void *tag;
+            bool ok;
+            while (cq->Next(&tag, &ok)) {
+                static_cast<LbAsyncCall *>(tag)->proceed(ok);
+            }
+        }
 
-            mem = pages * page_size;
-            request.set_rambytes(mem);
 
+        /**
+         * Stop the server and wait for the threads to finish. Status watches end at once,
+         * other calls (such as open state streams) are cancelled if not done within a second.
+         */
+        void LoadBalancerAsyncServer::shutdown() {
+            if (!server || shuttingDown) return;
+
+            shuttingDown = true;
+            server->Shutdown(system_clock::now() + shutdownGrace);
+
+            // Calls still cancelled by Shutdown finish and are deleted on the serve threads.
+            // No operation may be started once a queue is shut down, so wait for them first.
+            // Shutdown has cancelled any call left after the grace period, so this ends.
+            {
+                std::unique_lock<std::mutex> lock(callMutex);
+                callsEnded.wait(lock, [this] {return callCount == 0;});
+            }
 
-            request.set_bufsizebytes(bufSizeBytes);
-		    request.set_bufcount(bufCount);
-		    request.set_setpointpercent(setPointPercent);
+            for (auto & q : cqs) {
+                q->Shutdown();
+            }
+            wait();
+        }
 
-		    // Container for the response we expect from server
-		    RegisterReply reply;
 
-		    // Context for the client. It could be used to convey extra information to
-		    // the server and/or tweak certain RPC behaviors.
-		    ClientContext context;
+        /** Wait for the threads handling calls to finish, which happens only after shutdown(). */
+        void LoadBalancerAsyncServer::wait() {
+            for (auto & t : threads) {
+                if (t.joinable()) t.join();
+            }
+        }
 
-		    // The actual RPC
-		    Status status = stub_->Register(&context, request, &reply);
 
-		    // Act upon its status
-		    if (!status.ok()) {
-		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
-		        return 1;
-		    }
+        /** @return simulated CP which keeps the backends' data and answers calls. */
+        LoadBalancerServiceImpl * LoadBalancerAsyncServer::getService() const {return service;}
 
-		    sessionToken = reply.sessiontoken();
-		    return 0;
-    	}
-    	
- 
-        /**
-		 * Unregister this backend with the control plane.
-		 * @return 0 if successful, 1 if error in grpc communication
-		 */
-    	int LbControlPlaneClient::Deregister() const {
-
-    	    // Deregistration message we are sending to server
-		    DeregisterRequest request;
-		    request.set_sessiontoken(sessionToken);
-
-		    // Container for the response we expect from server
-		    DeregisterReply reply;
-
-		    // Context for the client. It could be used to convey extra information to
-		    // the server and/or tweak certain RPC behaviors.
-		    ClientContext context;
-
-		    // The actual RPC
-		    Status status = stub_->Deregister(&context, request, &reply);
-
-		    // Act upon its status
-		    if (!status.ok()) {
-		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
-		        return 1;
-		    }
-            return 0;
+        /** @return service through which calls are requested. */
+        LoadBalancer::AsyncService * LoadBalancerAsyncServer::getAsyncService() {return &asyncService;}
+
+        /** @return true once shutdown has started. */
+        bool LoadBalancerAsyncServer::isShuttingDown() const {return shuttingDown;}
+
+        /** @return number of threads, each with its own completion queue. */
+        int LoadBalancerAsyncServer::getThreadCount() const {return threadCount;}
+
+
+        /** Count a call as started, which its constructor does. */
+        void LoadBalancerAsyncServer::callStarted() {
+            std::lock_guard<std::mutex> lock(callMutex);
+            callCount++;
         }
-    	
-    	  	
-    	
-        /**
-		 * Send the state of this backend to the control plane.
-		 * @return 0 if successful, 1 if error in grpc communication
-		 */
-    	int LbControlPlaneClient::SendState() const {
-		    // Data we are sending to the server.
-		    SendStateRequest request;
-
-            request.set_sessiontoken(sessionToken);
-
-            // Set the time
-            struct timespec t1;
-            clock_gettime(CLOCK_REALTIME, &t1);
-            auto timestamp = new google::protobuf::Timestamp{};
-            timestamp->set_seconds(t1.tv_sec);
-            timestamp->set_nanos(t1.tv_nsec);
-            // Give ownership of object to protobuf
-            request.set_allocated_timestamp(timestamp);
-
-            request.set_fillpercent(fillPercent);
-            request.set_piderror(pidError);
-            request.set_isready(true);
-
-		    // Container for the data we expect from the server.
-		    SendStateReply reply;
-
-		    // Context for the client. It could be used to convey extra information to
-		    // the server and/or tweak certain RPC behaviors.
-		    ClientContext context;
-
-		    // The actual RPC.
-            Status status = stub_->SendState(&context, request, &reply);
-
-		    // Act upon its status.
-		    if (!status.ok()) {
-		        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
-		        return 1;
-		    }
-
-		    return 0;
-		}
-		
-  
-		// Getters
-		const std::string & LbControlPlaneClient::getIP()        const   {return ipAddr;}
-        const std::string & LbControlPlaneClient::getName()      const   {return name;}
-
-		uint16_t      LbControlPlaneClient::getPort()            const   {return port;}
-		uint32_t      LbControlPlaneClient::getBufCount()        const   {return bufCount;}
-		uint32_t      LbControlPlaneClient::getBufSizeBytes()    const   {return bufSizeBytes;}
-
-		float         LbControlPlaneClient::getSetPointPercent() const   {return setPointPercent;}
-		float         LbControlPlaneClient::getFillPercent()     const   {return fillPercent;}
-		float         LbControlPlaneClient::getPidError()        const   {return pidError;}
- 
-    
-  
 
+
+        /** Count a call as ended, which its destructor does. */
+        void LoadBalancerAsyncServer::callEnded() {
+            std::lock_guard<std::mutex> lock(callMutex);
+            if (--callCount == 0) callsEnded.notify_all();
+        }
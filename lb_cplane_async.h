@@ -9,267 +9,116 @@
 
 
 /**
- * @file Contains code to implement ERSAP backend communication to EJFAT LB's control plane.
+ * @file Contains an asynchronous server for the simulated control plane of lb_cplane.h.
+ * Each thread has its own completion queue, and each call in progress is a small state machine
+ * moved along as its operations complete, so no thread ever blocks on a client.
  */
-#ifndef LB_CONTROL_PLANE_H
-#define LB_CONTROL_PLANE_H
+#ifndef LB_CPLANE_ASYNC_H
+#define LB_CPLANE_ASYNC_H
 
 
-#include <iostream>
 #include <memory>
 #include <string>
-#include <utility>
-#include <mutex>
-#include <unordered_map>
-#include <chrono>
 #include <thread>
+#include <vector>
 #include <atomic>
-#include <chrono>
-#include <time.h>
-#include <unistd.h>
-
-#include <sys/types.h>
-
-#include <google/protobuf/util/time_util.h>
-
-
-
-
-#include <grpcpp/ext/proto_server_reflection_plugin.h>
-#include <grpcpp/grpcpp.h>
-#include <grpcpp/health_check_service_interface.h>
-
-#ifdef BAZEL_BUILD
-#include "examples/protos/loadbalancer.pb.h"
-#include "examples/protos/loadbalancer_enum.grpc.pb.h"
-#else
-#include "loadbalancer.grpc.pb.h"
-#include "loadbalancer_enum.grpc.pb.h"
-#endif
-
-
-using grpc::Channel;
-using grpc::ClientContext;
-
-using grpc::Server;
-using grpc::ServerBuilder;
-using grpc::ServerContext;
-using grpc::Status;
-using grpc::CompletionQueue;
-using grpc::ServerAsyncResponseWriter;
-
-using loadbalancer::BackendReport;
-using loadbalancer::RegisterRequest;
-using loadbalancer::DeregisterRequest;
-using loadbalancer::SendStateRequest;
-using loadbalancer::RegisterReply;
-using loadbalancer::DeregisterReply;
-using loadbalancer::SendStateReply;
-
-
-//using google::protobuf::util;
-
-
-
-// Class to represent a single backend and store its state in the control plane / server.
-class BackEnd {
+#include <mutex>
+#include <condition_variable>
 
-    public:
-    
-        BackEnd(const RegisterRequest* req);
-        
-        void update(const SendStateRequest* state);
-        void printBackendState() const;
+#include <grpcpp/alarm.h>
 
-        const std::string & getAuthToken()    const;
-        const std::string & getSessionToken() const;
-        const std::string & getName()         const;
+#include "lb_cplane.h"
 
-        google::protobuf::Timestamp getTimestamp()  const;
-        int64_t  getTime()         const;
-        int64_t  getLocalTime()    const;
-        uint32_t getCpus()         const;
-        uint32_t getRamBytes()     const;
-        uint32_t getBufCount()     const;
-        uint32_t getBufSizeBytes() const;
 
-        float   getFillPercent()      const;
-        float   getSetPointPercent()  const;
-        float   getPidError()         const;
+using grpc::ServerCompletionQueue;
+using grpc::ServerAsyncWriter;
+using grpc::ServerAsyncReaderWriter;
+using grpc::Alarm;
 
-        const std::string & getTargetIP() const;
-        uint32_t getTargetPort()          const;
-        uint32_t getTargetPortRange()     const;
 
-        bool getIsReady()  const;
-        bool getIsActive() const;
-        void setIsActive(bool active);
 
-	private:
-        
-        // Data to return to from control-plane/client
 
-        /** Backend's authentication token. */
-        std::string authToken;
+/**
+ * Call being handled by LoadBalancerAsyncServer.
+ * The address of the object is the tag of each of its operations.
+ */
+class LbAsyncCall {
 
-        /** Backend's session token. */
-        std::string sessionToken;
+public:
 
-        /** Backend's name. */
-        std::string name;
+    virtual ~LbAsyncCall() = default;
 
+    /**
+     * Move the call along once an operation completes.
+     * @param ok  true if the operation succeeded.
+     */
+    virtual void proceed(bool ok) = 0;
+};
 
-        /** Time in milliseconds past epoch that this data was taken by backend. */
-        google::protobuf::Timestamp timestamp;
 
-        /** Time in milliseconds past epoch that this data was taken by backend.
-         *  Same as timestamp but in different format. */
-        int64_t time = 0;
 
-        /** Local time in milliseconds past epoch corresponding to backend time.
-         *  Hopefully this takes care of time delays and nodes not setting their clocks properly.
-         *  Set locally when SendState msg arrives, this helps find how long ago the backend reported data. */
-        int64_t localTime = 0;
 
+/**
+ * Class running the simulated control plane asynchronously. It handles every call in
+ * loadbalancer.proto with one completion queue and thread per core (or as many as asked for).
+ * The backends and their state are kept in, and the calls are answered by, the
+ * LoadBalancerServiceImpl given, so everything else can use that object as usual.
+ * Calls to WatchLoadBalancerStatus look for changes every 10 millisec.
+ */
+class LoadBalancerAsyncServer {
 
-        /** Backend's cpu count. */
-        uint32_t cpus;
+public:
 
-        /** Backend's RAM. */
-        uint32_t ramBytes;
+    explicit LoadBalancerAsyncServer(LoadBalancerServiceImpl *service, int threads = 0);
+    ~LoadBalancerAsyncServer();
 
-        /** Number of backend's fifo entries. */
-        uint32_t bufCount;
-        
-        /** Bytes in each backend fifo entry. */
-        uint32_t bufSizeBytes;
+    int  start(uint16_t port, const std::string & unixPath = "");
+    void shutdown();
+    void wait();
 
-        
-        /** Percent of fifo entries filled with unprocessed data (0-1). */
-        float fillPercent;
-        
-        /** PID loop set point (0-1). */
-        float setPointPercent;
-        
-        /** PID error term in percentage of backend's fifo entries (0 - +/-0.5). */
-        float pidError;
+    LoadBalancerServiceImpl * getService()      const;
+    LoadBalancer::AsyncService * getAsyncService();
+    bool isShuttingDown() const;
+    int  getThreadCount() const;
 
+    void callStarted();
+    void callEnded();
 
-        /** Receiving IP address of backend. */
-        std::string  targetIP;
 
-        /** Receiving UDP port of backend. */
-        uint16_t  targetPort;
+private:
 
-        /** Receiving UDP port range of backend. */
-        uint16_t  targetPortRange;
+    /** Holds backend data and answers calls. */
+    LoadBalancerServiceImpl *service;
 
-        /** Ready to receive more data if true. */
-        bool isReady;
+    /** Service through which calls are requested. */
+    LoadBalancer::AsyncService asyncService;
 
-        /** Is active (reported its status on time). */
-        bool isActive;
-};
+    /** Number of threads, each with its own completion queue. */
+    int threadCount;
 
+    /** Completion queue of each thread. */
+    std::vector<std::unique_ptr<ServerCompletionQueue>> cqs;
 
-/** Class implementing logic and data behind the control plane / server's behavior. */
-class BackendReportServiceImpl final : public BackendReport::AsyncService {
+    /** Threads handling calls. */
+    std::vector<std::thread> threads;
 
-    public:
-        Status SendStateAsync(ServerContext* context, const SendStateRequest* state, ServerAsyncResponseWriter<SendStateReply> *responder,
-                              CompletionQueue *cq1, CompletionQueue *cq2, void  *ptr);
+    /** Server, null until started. */
+    std::unique_ptr<Server> server;
 
-        Status SendState  (ServerContext* context, const SendStateRequest* state, SendStateReply* reply);
-		Status Register   (ServerContext* context, const RegisterRequest* request, RegisterReply* reply);
-		Status DeRegister (ServerContext* context, const DeregisterRequest* request, DeregisterReply* reply);
+    /** Set once shutdown starts, after which calls start no new operations of their own. */
+    std::atomic<bool> shuttingDown {false};
 
-        std::shared_ptr<std::unordered_map<std::string, BackEnd>> getBackEnds();
+    /** Number of calls not yet deleted, queues are only shut down once it is 0. */
+    int callCount = 0;
 
-        void runServer(uint16_t port, BackendReportServiceImpl *service);
-        
-    private:
+    /** Protects callCount. */
+    std::mutex callMutex;
 
-        // Another instance when java is soooo much easier, C++ has no thread-safe containers :(
-        // Since the control plane will be accessing this map while potentially multiple threads are
-        // writing to it SIMULTANEOUSLY, we'll need to protect its access.
-        // Easiest to protect writing into it (only in the SendState, Register, and UnRegister methods
-        // above) with a mutex. For the control plane reading it, we can return a copy when asked for
-        // it in getBackEnds()
-  
-        // Store data reported from backends to this server
-        std::unordered_map<std::string, BackEnd> data;
-        std::mutex map_mutex;
-        std::unique_ptr<grpc::ServerCompletionQueue> cq;
+    /** Signaled when the last call is deleted. */
+    std::condition_variable callsEnded;
 
+    void serve(ServerCompletionQueue *cq);
 };
 
 
-/** Class client sends data from backend to control plane (server). */
-class LbControlPlaneClient {
-    
-    public:     
-        
-        LbControlPlaneClient(const std::string& targetIP, uint16_t targetPort, const std::string& _name,
-                             uint32_t _bufferSize, uint32_t _bufferCount, float _setPoint);
-        
-      	int Register();
-      	int Deregister() const;
-        int SendState()  const;
-
-        void update(float fill, float pidErr);
-        
-        const std::string & getIP()    const;
-        const std::string & getName()  const;
-
-		uint16_t  getPort()             const;
-		uint32_t  getBufCount()         const;
-		uint32_t  getBufSizeBytes()     const;
-		float     getSetPointPercent()  const;
-		float     getFillPercent()      const;
-        float     getPidError()         const;
-        bool      getIsReady()          const;
-
-
-  
-    private:
-  
-        /** Object used to call backend's grpc API routines. */
-        std::unique_ptr<BackendReport::Stub> stub_;
-
-        // Used to connect to backend
-        
-        /** Control plane's IP address (dotted decimal format). */
-        std::string ipAddr = "localhost";
-         /** Control plane's grpc port. */
-        uint16_t port = 56789;
-        /** Target's name (ipaddr:port). */
-        std::string target;
-        
-        // Fixed data to send-to/get-from control plane during registration
-
-        /** Token used to register. */
-        std::string authToken;
-        /** Token used to send state and to deregister. */
-        std::string sessionToken;
-        
-        /** Client/caller's name. */
-        std::string name;
-        /** PID loop set point. */
-        float setPointPercent;
-        /** Number of backend's fifo entries. */
-        uint32_t bufCount;
-        /** Bytes in each backend fifo entry. */
-        uint32_t bufSizeBytes;
-        
-        // Transcient data to send to control plane
-
-        /** Percent of fifo entries filled with unprocessed data. */
-        float fillPercent;
-        /** PID error term in percentage of backend's fifo entries. */
-        float pidError;
-        /** Ready to receive more data or not. */
-        bool isReady;
-  
-};
-
-#endif
\ No newline at end of file
+#endif
@@ -39,6 +39,7 @@
 
 
 #include <unistd.h>
+#include <netdb.h>
 #include <cstdlib>
 #include <ctime>
 #include <cmath>
@@ -47,7 +48,10 @@
 #include <iostream>
 #include <cinttypes>
 #include <random>
+#include <memory>
+#include <atomic>
 
+#include "lb_cplane.h"
 #include "ersap_grpc_packetize.hpp"
 
 #ifdef __linux__
@@ -63,12 +67,18 @@
 using namespace ejfat;
 
 #define INPUT_LENGTH_MAX 256
+#define MAX_DESTINATIONS 8
+
+
+// Data destinations (host:port), given by -dest or else -host & -p
+static char destinations[MAX_DESTINATIONS][INPUT_LENGTH_MAX];
+static int destinationCount = 0;
 
 
 
 static void printHelp(char *programName) {
     fprintf(stderr,
-            "\nusage: %s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n\n",
+            "\nusage: %s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n\n",
             programName,
             "        [-h] [-v] [-ipv6] [-sync]\n",
 
@@ -85,7 +95,8 @@ static void printHelp(char *programName) {
             "        [-p <destination UDP port (default 19522)>]\n",
 
             "        [-cphost <control plane host (defauls 127.0.0.1)>]",
-            "        [-cpport <control plane sync msg port (default 19523)>]\n",
+            "        [-cpport <control plane sync msg port (default 19523)>]",
+            "        [-syncperiod <millisec between sync msgs (default 1000)>]\n",
 
             "        [-i <outgoing interface name (e.g. eth0, currently only used to find MTU)>]",
             "        [-mtu <desired MTU size>]",
@@ -99,14 +110,36 @@ static void printHelp(char *programName) {
             "        [-bwidth <byte 1/2 width of gaussian for variable buffer size>]",
             "        [-s <UDP send buffer size>]\n",
 
+            "        [-json <file to which per-second stats are appended as JSON lines>]",
             "        [-cores <comma-separated list of cores to run on>]",
             "        [-tpre <tick prescale (1,2, ... tick increment each buffer sent)>]",
-            "        [-dpre <delay prescale (1,2, ... if -d defined, 1 delay for every prescale pkts/bufs)>]\n");
+            "        [-dpre <delay prescale (1,2, ... if -d defined, 1 delay for every prescale pkts/bufs)>]",
+            "        [-adaptive (retry packets on ENOBUFS/EAGAIN and lower send rate to match)]",
+            "        [-dest <host[:port] or [IPv6 host]:port, repeat to send the same events to up to 8 destinations>]\n");
+
+    fprintf(stderr,
+            "%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n\n",
+            "        [-throttle (scale send rate down as all backends fill, needs -lbid & -token)]",
+            "        [-grpcport <control plane grpc port (default 18347)>]",
+            "        [-lbid <id of LB whose status is monitored>]",
+            "        [-token <administrative token>]",
+            "        [-tgain <throttling gain (default 1.)>]",
+            "        [-tfloor <lowest fraction of set send rate when throttling (default 0.1)>]",
+            "        [-tfill <fill of least full backend at which throttling starts (default 0.5)>]",
+            "        [-tperiod <millisec between LB status queries (default 1000)>]\n");
 
     fprintf(stderr, "        EJFAT UDP packet sender that will packetize and send buffer repeatedly and get stats\n");
     fprintf(stderr, "        By default, data is copied into buffer and \"send()\" is used (connect is called).\n");
     fprintf(stderr, "        If specifying twidth or bwidth, backend time and buf size (-time, -b) are mean values and must be > 0\n");
-    fprintf(stderr, "        The -sync option will send a UDP message to LB control plane every second with last tick sent.\n");
+    fprintf(stderr, "        The -throttle option periodically gets the LB's status from the control plane and lowers\n");
+    fprintf(stderr, "        the send rate (-byterate, -bufrate, or -d) as the least full backend fills past -tfill.\n");
+    fprintf(stderr, "        The -adaptive option retries packets the socket or network interface could not take,\n");
+    fprintf(stderr, "        instead of quitting, and paces slower (-byterate, -bufrate, or -d) while that happens.\n");
+    fprintf(stderr, "        Each -dest gets its own socket, pacing, and stats. Any -host & -p are then ignored.\n");
+    fprintf(stderr, "        A -dest or -host given as an address is used as is, a host name is looked up as an IPv4\n");
+    fprintf(stderr, "        address, or with -ipv6 as an IPv6 address. With -ipv6, -cphost must be an IPv6 address.\n");
+    fprintf(stderr, "        Given as many -cores as destinations, each destination sends from its own core.\n");
+    fprintf(stderr, "        The -sync option will send a UDP message to LB control plane every second (or -syncperiod) with last tick sent.\n");
 }
 
 
@@ -119,13 +152,17 @@ static void parseArgs(int argc, char **argv, int* mtu, int *protocol,
                       uint64_t *byteRate, uint32_t *sendBufSize,
                       uint32_t *delayPrescale, uint32_t *tickPrescale,
                       uint32_t *time, uint32_t *timeSigma, uint32_t *sizeWidth, // timeSigma currently not used
-                      uint32_t *delayWidth, int *cores,  bool *debug,
+                      uint32_t *delayWidth, uint32_t *syncPeriod, int *cores,  bool *debug,
                       bool *useIPv6, bool *texp, bool *sendSync,
-                      char* host, char* cphost, char *interface) {
+                      char* host, char* cphost, char *interface, char *jsonFile,
+                      bool *throttle, float *throttleGain, float *throttleFloor,
+                      float *throttleFill, uint32_t *throttlePeriod,
+                      uint16_t *grpcPort, char *lbId, char *token, bool *adaptive) {
 
     *mtu = 0;
     int c, i_tmp;
     int64_t tmp;
+    float f_tmp;
     bool help = false;
 
     /* multiple character command-line options */
@@ -149,6 +186,18 @@ static void parseArgs(int argc, char **argv, int* mtu, int *protocol,
              {"cphost",   1, NULL, 19},
              {"cpport",   1, NULL, 20},
              {"delaywidth",   1, NULL, 21},
+             {"syncperiod",   1, NULL, 22},
+             {"json",     1, NULL, 23},
+             {"throttle", 0, NULL, 24},
+             {"grpcport", 1, NULL, 25},
+             {"lbid",     1, NULL, 26},
+             {"token",    1, NULL, 27},
+             {"tgain",    1, NULL, 28},
+             {"tfloor",   1, NULL, 29},
+             {"tfill",    1, NULL, 30},
+             {"tperiod",  1, NULL, 31},
+             {"adaptive", 0, NULL, 32},
+             {"dest",     1, NULL, 33},
              {0,       0, 0,    0}
             };
 
@@ -491,6 +540,128 @@ static void parseArgs(int argc, char **argv, int* mtu, int *protocol,
                 }
                 break;
 
+            case 22:
+                // Millisec between sync messages sent to control plane
+                tmp = strtol(optarg, nullptr, 0);
+                if (tmp > 0) {
+                    *syncPeriod = tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -syncperiod, period > 0\n");
+                    exit(-1);
+                }
+                break;
+
+            case 23:
+                // File for JSON stats output
+                if (strlen(optarg) >= INPUT_LENGTH_MAX) {
+                    fprintf(stderr, "Invalid argument to -json, file name is too long\n");
+                    exit(-1);
+                }
+                strcpy(jsonFile, optarg);
+                break;
+
+            case 24:
+                // throttle send rate based on backend fill levels
+                *throttle = true;
+                break;
+
+            case 25:
+                // control plane grpc PORT
+                i_tmp = (int) strtol(optarg, nullptr, 0);
+                if (i_tmp > 1023 && i_tmp < 65535) {
+                    *grpcPort = i_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -grpcport, 1023 < port < 65536\n");
+                    exit(-1);
+                }
+                break;
+
+            case 26:
+                // LB id
+                if (strlen(optarg) >= INPUT_LENGTH_MAX) {
+                    fprintf(stderr, "Invalid argument to -lbid, id is too long\n");
+                    exit(-1);
+                }
+                strcpy(lbId, optarg);
+                break;
+
+            case 27:
+                // admin token
+                if (strlen(optarg) >= INPUT_LENGTH_MAX) {
+                    fprintf(stderr, "Invalid argument to -token, token is too long\n");
+                    exit(-1);
+                }
+                strcpy(token, optarg);
+                break;
+
+            case 28:
+                // throttling gain
+                f_tmp = strtof(optarg, nullptr);
+                if (f_tmp > 0.F) {
+                    *throttleGain = f_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -tgain, gain > 0\n");
+                    exit(-1);
+                }
+                break;
+
+            case 29:
+                // lowest fraction of send rate when throttling
+                f_tmp = strtof(optarg, nullptr);
+                if (f_tmp > 0.F && f_tmp <= 1.F) {
+                    *throttleFloor = f_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -tfloor, 0 < floor <= 1\n");
+                    exit(-1);
+                }
+                break;
+
+            case 30:
+                // fill level at which throttling starts
+                f_tmp = strtof(optarg, nullptr);
+                if (f_tmp >= 0.F && f_tmp < 1.F) {
+                    *throttleFill = f_tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -tfill, 0 <= fill < 1\n");
+                    exit(-1);
+                }
+                break;
+
+            case 31:
+                // Millisec between LB status queries
+                tmp = strtol(optarg, nullptr, 0);
+                if (tmp > 0) {
+                    *throttlePeriod = tmp;
+                }
+                else {
+                    fprintf(stderr, "Invalid argument to -tperiod, period > 0\n");
+                    exit(-1);
+                }
+                break;
+
+            case 32:
+                // retry packets on transient send errors
+                *adaptive = true;
+                break;
+
+            case 33:
+                // Another data destination
+                if (strlen(optarg) >= INPUT_LENGTH_MAX) {
+                    fprintf(stderr, "Invalid argument to -dest, destination is too long\n");
+                    exit(-1);
+                }
+                if (destinationCount >= MAX_DESTINATIONS) {
+                    fprintf(stderr, "Too many -dest, %d max\n", MAX_DESTINATIONS);
+                    exit(-1);
+                }
+                strcpy(destinations[destinationCount++], optarg);
+                break;
+
             case 'v':
                 // VERBOSE
                 *debug = true;
@@ -517,309 +688,642 @@ static void parseArgs(int argc, char **argv, int* mtu, int *protocol,
         printHelp(argv[0]);
         exit(2);
     }
+
+    if (*throttle) {
+        if (strlen(lbId) < 1 || strlen(token) < 1) {
+            fprintf(stderr, "-throttle needs both -lbid and -token\n");
+            exit(-1);
+        }
+        if (*byteRate == 0 && *bufRate == 0 && *delay == 0) {
+            fprintf(stderr, "-throttle needs a send rate set with -byterate, -bufrate, or -d\n");
+            exit(-1);
+        }
+    }
 }
 
 
-// Statistics
-static volatile uint64_t totalBytes=0, totalPackets=0, totalEvents=0;
+// Statistics of each destination, written only by its sending thread
+static packetSendStats sendStats[MAX_DESTINATIONS];
 
 
-// Thread to send to print out rates
-static void *thread(void *arg) {
+// Arg to pass to rate thread
+typedef struct rateThreadArg_t {
+    FILE *jsonFp;  // if not null, write per-second stats here as JSON lines
+} rateThreadArg;
+
+
+/**
+ * This thread reads the sending totals of each destination once a second and keeps a history of the rates.
+ * Every 4 seconds it prints the latest rate along with its moving average and min/max.
+ * If a file was given, the stats of every second are also written to it, one JSON object per line
+ * and destination, for use in automated performance runs.
+ *
+ * @param arg struct to be passed to thread.
+ */
+static void *rateThread(void *arg) {
 
-    uint64_t packetCount, byteCount, eventCount;
-    uint64_t prevTotalPackets, prevTotalBytes, prevTotalEvents;
-    uint64_t currTotalPackets, currTotalBytes, currTotalEvents;
-    // Ignore first rate calculation as it's most likely a bad value
-    bool skipFirst = true;
+    rateThreadArg *tArg = (rateThreadArg *) arg;
+    FILE *jsonFp = tArg->jsonFp;
 
-    double rate, avgRate, totalRate, totalAvgRate, evRate, avgEvRate;
-    int64_t totalT = 0, time;
-    uint64_t absTime;
-    struct timespec t1, t2, firstT;
+    // Keep a minute's worth of rates
+    std::vector<sendRateHistory> history(destinationCount, sendRateHistory(60));
+    uint64_t bytes, packets, events, retries, seconds = 0;
+    int64_t time, realTime;
+    struct timespec t, tReal;
+    // Don't calculate rates until data is going out
+    bool started = false;
 
-    // Get the current time
-    clock_gettime(CLOCK_MONOTONIC, &t1);
-    firstT = t1;
+    auto wakeTime = std::chrono::steady_clock::now();
 
     while (true) {
 
-        prevTotalBytes   = totalBytes;
-        prevTotalPackets = totalPackets;
-        prevTotalEvents  = totalEvents;
-
-        // Delay 4 seconds between printouts
-        std::this_thread::sleep_for(std::chrono::seconds(4));
-
-        // Read epoch time
-        clock_gettime(CLOCK_MONOTONIC, &t2);
-        // Epoch time in milliseconds
-        absTime = 1000L*(t2.tv_sec) + (t2.tv_nsec)/1000000L;
-        // time diff in microseconds
-        time = (1000000L * (t2.tv_sec - t1.tv_sec)) + ((t2.tv_nsec - t1.tv_nsec)/1000L);
-        totalT = (1000000L * (t2.tv_sec - firstT.tv_sec)) + ((t2.tv_nsec - firstT.tv_nsec)/1000L);
-
-        currTotalBytes   = totalBytes;
-        currTotalPackets = totalPackets;
-        currTotalEvents  = totalEvents;
-
-        if (skipFirst) {
-            // Don't calculate rates until data is coming in
-            if (currTotalPackets > 0) {
-                skipFirst = false;
+        wakeTime += std::chrono::seconds(1);
+        std::this_thread::sleep_until(wakeTime);
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        time = 1000000L*t.tv_sec + t.tv_nsec/1000L;
+
+        if (!started) {
+            packets = 0;
+            for (int i=0; i < destinationCount; i++) {
+                packets += sendStats[i].packets.load(std::memory_order_relaxed);
             }
-            firstT = t1 = t2;
-            totalT = totalBytes = totalPackets = totalEvents = 0;
-            continue;
+            if (packets == 0) continue;
+            started = true;
         }
 
-        // Use for instantaneous rates
-        byteCount   = currTotalBytes   - prevTotalBytes;
-        packetCount = currTotalPackets - prevTotalPackets;
-        eventCount  = currTotalEvents  - prevTotalEvents;
+        clock_gettime(CLOCK_REALTIME, &tReal);
+        realTime = 1000L*tReal.tv_sec + tReal.tv_nsec/1000000L;
 
-        // Reset things if #s rolling over
-        if ( (byteCount < 0) || (totalT < 0) )  {
-            totalT = totalBytes = totalPackets = totalEvents = 0;
-            firstT = t1 = t2;
-            continue;
+        // Print every 4 seconds
+        bool print = false;
+
+        for (int i=0; i < destinationCount; i++) {
+            events  = sendStats[i].events.load(std::memory_order_relaxed);
+            packets = sendStats[i].packets.load(std::memory_order_relaxed);
+            bytes   = sendStats[i].bytes.load(std::memory_order_relaxed);
+            retries = sendStats[i].retries.load(std::memory_order_relaxed);
+
+            history[i].add(time, bytes, packets, events);
+            if (history[i].size() == 0) continue;
+            if (i == 0) {
+                seconds++;
+                print = seconds % 4 == 0;
+            }
+
+            auto pktRate  = history[i].packetRate();
+            auto byteRate = history[i].byteRate();
+            auto evtRate  = history[i].eventRate();
+
+            if (jsonFp != nullptr) {
+                fprintf(jsonFp, "{\"time_ms\":%" PRId64 ",\"dest\":\"%s\",\"events\":%" PRIu64 ",\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64
+                                ",\"retries\":%" PRIu64
+                                ",\"evt_rate\":%.1f,\"evt_rate_ewma\":%.1f,\"evt_rate_min\":%.1f,\"evt_rate_max\":%.1f"
+                                ",\"pkt_rate\":%.1f,\"pkt_rate_ewma\":%.1f,\"pkt_rate_min\":%.1f,\"pkt_rate_max\":%.1f"
+                                ",\"byte_rate\":%.1f,\"byte_rate_ewma\":%.1f,\"byte_rate_min\":%.1f,\"byte_rate_max\":%.1f}\n",
+                        realTime, destinations[i], events, packets, bytes, retries,
+                        evtRate.current,  evtRate.ewma,  evtRate.min,  evtRate.max,
+                        pktRate.current,  pktRate.ewma,  pktRate.min,  pktRate.max,
+                        byteRate.current, byteRate.ewma, byteRate.min, byteRate.max);
+            }
+
+            if (!print) continue;
+
+            if (destinationCount > 1) {
+                printf("\n%s:", destinations[i]);
+            }
+
+            printf("\nPackets:       %3.4g Hz,  %3.4g EWMA,  %3.4g min,  %3.4g max (over %zu sec)\n",
+                   pktRate.current, pktRate.ewma, pktRate.min, pktRate.max, history[i].size());
+
+            // Data rates (with NO header info), and with RE header info
+            printf("Data (+hdrs):  %3.4g (%3.4g) MB/s,  %3.4g EWMA,  %3.4g min,  %3.4g max\n",
+                   byteRate.current/1000000., (byteRate.current + RE_HEADER_BYTES*pktRate.current)/1000000.,
+                   byteRate.ewma/1000000., byteRate.min/1000000., byteRate.max/1000000.);
+
+            printf("Events:        %3.4g Hz,  %3.4g EWMA,  %3.4g min,  %3.4g max,  total %" PRIu64 "\n",
+                   evtRate.current, evtRate.ewma, evtRate.min, evtRate.max, events);
+
+            printf("Retried pkts:  %" PRIu64 " total\n\n", retries);
         }
 
-        // Packet rates
-        rate = 1000000.0 * ((double) packetCount) / time;
-        avgRate = 1000000.0 * ((double) currTotalPackets) / totalT;
-        printf("\nPackets:       %3.4g Hz,    %3.4g Avg, time: diff = %" PRId64 " usec, abs = %" PRIu64 " epoch msec\n",
-                rate, avgRate, time, absTime);
-
-        // Data rates (with NO header info)
-        rate = ((double) byteCount) / time;
-        avgRate = ((double) currTotalBytes) / totalT;
-        // Data rates (with RE header info)
-        totalRate = ((double) (byteCount + RE_HEADER_BYTES*packetCount)) / time;
-        totalAvgRate = ((double) (currTotalBytes + RE_HEADER_BYTES*currTotalPackets)) / totalT;
-        printf("Data (+hdrs):  %3.4g (%3.4g) MB/s,  %3.4g (%3.4g) Avg\n", rate, totalRate, avgRate, totalAvgRate);
-
-        // Event rates
-        evRate = 1000000.0 * ((double) eventCount) / time;
-        avgEvRate = 1000000.0 * ((double) currTotalEvents) / totalT;
-        printf("Events:        %3.4g Hz,  %3.4g Avg, total %" PRIu64 "\n\n", evRate, avgEvRate, totalEvents);
-
-        t1 = t2;
+        if (jsonFp != nullptr) fflush(jsonFp);
     }
 
     return (nullptr);
 }
 
 
-
-
+// Arg to pass to sync thread
+typedef struct syncThreadArg_t {
+    int      cpSocket;
+    int      version;
+    uint16_t dataId;
+    uint32_t period;  // millisec
+    bool     debug;
+} syncThreadArg;
 
 
 /**
- * Doing things this way is like reading a buffer bit-by-bit
- * and passing it off to the parser bit-by-bit
- * @param argc
- * @param argv
- * @return
+ * This thread sends a sync message to the control plane at a fixed period.
+ * When sending to several destinations, the tick and rate are those of the first.
+ * It runs on a timer of its own so that neither blocking in sendPacketizedBuf
+ * nor delays in the sending loop affect the cadence. Each message carries the latest
+ * tick and the event rate measured over exactly the time elapsed since the previous message.
+ *
+ * @param arg struct to be passed to thread.
  */
-int main(int argc, char **argv) {
+static void *syncThread(void *arg) {
 
-    uint32_t timeSigma = 0; // Currently not used, since we switched from gaussian to exp
-    uint32_t beDelayTime = 0, sizeWidth = 0, delayWidth = 0;
-    uint32_t tickPrescale = 1;
-    uint32_t delayPrescale = 1, delayCounter = 0;
-    uint32_t offset = 0, sendBufSize = 0;
-    uint32_t delay = 0;
-    uint64_t bufRate = 0L, bufSize = 62500L, byteRate = 0L;
-    uint16_t port = 0x4c42, cpport = 0x4c43; // 19522 & 19523
-    uint64_t tick = 0;
-    int cores[10];
-    int mtu, version = 2, protocol = 1, entropy = 0;
-    uint16_t dataId = 1;
-    bool debug = false;
-    bool useIPv6 = false, useExpDist = false;
-    bool setBufRate = false, setByteRate = false;
-    bool sendSync = false;
-    bool useSizeSpread = false, useTimeSpread = false, useDelaySpread = false;
+    syncThreadArg *tArg = (syncThreadArg *) arg;
+
+    int      cpSocket = tArg->cpSocket;
+    int      version  = tArg->version;
+    uint16_t dataId   = tArg->dataId;
+    bool     debug    = tArg->debug;
+    auto     period   = std::chrono::milliseconds(tArg->period);
 
     char syncBuf[28];
-    char host[INPUT_LENGTH_MAX], cphost[INPUT_LENGTH_MAX], interface[16];
-    memset(host, 0, INPUT_LENGTH_MAX);
-    memset(cphost, 0, INPUT_LENGTH_MAX);
-    memset(interface, 0, 16);
-    strcpy(host, "127.0.0.1");
-    strcpy(cphost, "127.0.0.1");
-    strcpy(interface, "lo0");
-    for (int i=0; i < 10; i++) {
-        cores[i] = -1;
-    }
+    uint64_t tick, events, prevEvents, evtRate, windowNanos, nanos;
+    struct timespec tPrev, tNow, tReal;
 
-    parseArgs(argc, argv, &mtu, &protocol, &entropy, &version, &dataId, &port, &cpport, &tick,
-              &delay, &bufSize, &bufRate, &byteRate, &sendBufSize, &delayPrescale, &tickPrescale,
-              &beDelayTime, &timeSigma, &sizeWidth, &delayWidth, cores, &debug, &useIPv6, &useExpDist,
-              &sendSync, host, cphost, interface);
+    prevEvents = sendStats[0].events.load(std::memory_order_relaxed);
+    clock_gettime(CLOCK_MONOTONIC, &tPrev);
 
-#ifdef __linux__
+    // Wake up at absolute times so the period does not drift
+    auto wakeTime = std::chrono::steady_clock::now();
 
-    if (cores[0] > -1) {
-        // Create a cpu_set_t object representing a set of CPUs. Clear it and mark given CPUs as set.
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
+    while (true) {
 
-        if (debug) {
-            for (int i=0; i < 10; i++) {
-                     std::cerr << "core[" << i << "] = " << cores[i] << "\n";
-            }
-        }
+        wakeTime += period;
+        std::this_thread::sleep_until(wakeTime);
 
-        for (int i=0; i < 10; i++) {
-            if (cores[i] >= 0) {
-                std::cerr << "Run sending thread on core " << cores[i] << "\n";
-                CPU_SET(cores[i], &cpuset);
-            }
-            else {
-                break;
-            }
-        }
-        pthread_t current_thread = pthread_self();
-        int rc = pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset);
-        if (rc != 0) {
-            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
-        }
-    }
+        clock_gettime(CLOCK_MONOTONIC, &tNow);
+        tick   = sendStats[0].tick.load(std::memory_order_acquire);
+        events = sendStats[0].events.load(std::memory_order_relaxed);
 
-    std::cerr << "Initially running on cpu " << sched_getcpu() << "\n";
+        // Rate over the actual window between this and the previous message
+        windowNanos = 1000000000UL * (tNow.tv_sec - tPrev.tv_sec) + (tNow.tv_nsec - tPrev.tv_nsec);
+        evtRate = windowNanos > 0 ? (events - prevEvents) * 1000000000UL / windowNanos : 0;
 
-#endif
+        tPrev = tNow;
+        prevEvents = events;
 
-    fprintf(stderr, "send = %s\n", btoa(send));
+        clock_gettime(CLOCK_REALTIME, &tReal);
+        nanos = 1000000000UL * tReal.tv_sec + tReal.tv_nsec;
 
-    if (byteRate > 0) {
-        // Are we trying to send a fixed byte rate?
-        setByteRate = true;
-    }
-    else if (bufRate > 0) {
-        // Are we trying to send a fixed buffer rate?
-        setBufRate = true;
-    }
+        if (debug) fprintf(stderr, "send tick %" PRIu64 ", evtRate %" PRIu64 "\n\n", tick, evtRate);
 
-    // Do we use exponential distribution of simulated BE processing times?
-    if (useExpDist && beDelayTime > 0) {
-        useTimeSpread = true;
-    }
+        setSyncData(syncBuf, version, dataId, tick, evtRate, nanos);
+        int err = send(cpSocket, syncBuf, 28, 0);
+        if (err == -1) {
+            fprintf(stderr, "\nsimSender: error sending sync, errno = %d, %s\n\n", errno, strerror(errno));
+            exit(1);
+        }
 
-    // Do we use gaussian distribution of buffer sizes?
-    if (sizeWidth > 0) {
-        useSizeSpread = true;
+        auto now = std::chrono::system_clock::now();
+        std::time_t now_c = std::chrono::system_clock::to_time_t(now);
+        char timestamp[20];
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", std::localtime(&now_c));
+        fprintf(stdout, "%s,%d,%f,%d\n", timestamp, (int)tick, (double)evtRate, (int)events);
+        fflush(stdout);
     }
 
-    // Do we use gaussian distribution of interarrival times?
-    if (delayWidth > 0) {
-        useDelaySpread = true;
-    }
+    return (nullptr);
+}
 
-    // Break data into multiple packets of max MTU size.
-    // If the mtu was not set on the command line, get it progamatically
-    if (mtu == 0) {
-        mtu = getMTU(interface, true);
-    }
 
-    // Jumbo (> 1500) ethernet frames are 9000 bytes max.
-    // Don't exceed this limit.
-    if (mtu > 9000) {
-        mtu = 9000;
-    }
+// Fraction of the set send rate to actually send at, lowered by the throttle thread
+static std::atomic<float> rateScale{1.F};
 
-    fprintf(stderr, "Using MTU = %d\n", mtu);
 
-    // 20 bytes = normal IPv4 packet header (60 is max), 8 bytes = max UDP packet header
-    // https://stackoverflow.com/questions/42609561/udp-maximum-packet-size
-    int maxUdpPayload = mtu - 20 - 8 - HEADER_BYTES;
+// Arg to pass to throttle thread
+typedef struct throttleThreadArg_t {
+    LbReservation *reservation;
+    float    gain;
+    float    floor;   // lowest rate scale
+    float    onset;   // fill at which throttling starts
+    uint32_t period;  // millisec
+    bool     debug;
+} throttleThreadArg;
 
-    fprintf(stderr, "Setting max UDP payload size to %d bytes, MTU = %d\n", maxUdpPayload, mtu);
 
+/**
+ * This thread closes the loop between the backends' fill levels and the sending rate.
+ * It watches the LB's status, which the control plane pushes as backends change
+ * (or, if the CP cannot do that, polls for it), and periodically finds the fill of the
+ * least full backend. The LB only has to drop data once every backend is full,
+ * so as that fill rises past the onset level, the fraction of the set rate at which
+ * to send is lowered in proportion (times the gain), down to the floor.
+ *
+ * @param arg struct to be passed to thread.
+ */
+static void *throttleThread(void *arg) {
 
-    ///////////////////////////////////////////////////////////////////////////////////////////////
-    // Create a variable backend processing time (exponential distribution around the given backend time)
-    uint32_t backendTime = beDelayTime;
-    double lambda = 1.0/beDelayTime;
-    fprintf(stderr, "beDelayTime = %u, lambda = %g\n", beDelayTime, lambda);
+    throttleThreadArg *tArg = (throttleThreadArg *) arg;
 
-    // For generating random, distributed numbers
-    std::random_device rd;
-    std::mt19937 gen {rd()};
+    LbReservation *reservation = tArg->reservation;
+    float    gain   = tArg->gain;
+    float    floor  = tArg->floor;
+    float    onset  = tArg->onset;
+    uint32_t period = tArg->period;
+    bool     debug  = tArg->debug;
 
-    // exponential distribution for times
-    fprintf(stderr, "BACKEND TIME (exp dist) around t = %u  usec\n", beDelayTime);
-    std::exponential_distribution<double> timeDist {lambda};
+    // Ignore backends that have not reported recently (may be gone)
+    int64_t staleTime = 5L * period > 5000L ? 5L * period : 5000L;
 
-    // normal distribution for times (mean = beDelayTime, stdev = timeSigma), where stdev = FWHM/2.35
-    //fprintf(stderr, "BACKEND TIME (normal dist) = %u, time width = %u usec\n", beDelayTime, timeSigma);
-    //std::normal_distribution<float> timeDist {(float)beDelayTime, (float)timeSigma};
+    // No need to hear of changes faster than they're acted on
+    reservation->WatchLoadBalancerStatus(period, period);
 
-    // To use this to generate time:
-    // float r = timeDist(gen);
+    while (true) {
 
+        std::this_thread::sleep_for(std::chrono::milliseconds(period));
 
-    ///////////////////////////////////////////////////////////////////////////////////////////////
-    // Determine size of data to send
+        if (!reservation->isWatching()) {
+            // The watch ended, with or without error, so start another
+            // and poll for this period only, till it delivers
+            reservation->StopWatch();
+            reservation->WatchLoadBalancerStatus(period, period);
+            if (reservation->LoadBalancerStatus() != 0) {
+                fprintf(stderr, "simSender: cannot get LB status, send rate unchanged\n");
+                continue;
+            }
+        }
 
-    // Create a variable event buffer size (gausssian around the given buf size)
-    uint32_t bufByteSize = bufSize;
+        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
 
-    // Gaussian dist for buffer sizes
-    std::normal_distribution<float> bufDist {(float)bufSize, (float)sizeWidth};
+        int backends = 0;
+        float minFill = 1.F, controlTotal = 0.F;
 
-    // To use this to generate size:
-    // float r = bufDist(gen);
+        for (const auto &entry : reservation->copyClientStats()) {
+            const LbClientStatus &status = entry.second;
+            if (now - status.updateTime > staleTime) continue;
 
+            minFill = std::min(minFill, status.fillPercent);
+            controlTotal += status.controlSignal;
+            backends++;
+        }
 
-    ///////////////////////////////////////////////////////////////////////////////////////////////
+        if (backends == 0) {
+            if (debug) fprintf(stderr, "simSender: no backends reporting, send rate unchanged\n");
+            continue;
+        }
 
-    // Gaussian dist for interarrival times
-    std::normal_distribution<float> delayDist {(float)delay, (float)delayWidth};
+        float scale = 1.F;
+        if (minFill > onset) {
+            scale = 1.F - gain * (minFill - onset) / (1.F - onset);
+        }
+        scale = std::max(floor, std::min(1.F, scale));
+        rateScale.store(scale, std::memory_order_relaxed);
 
-    ///////////////////////////////////////////////////////////////////////////////////////////////
+        if (debug) fprintf(stderr, "simSender: %d backends, min fill %.3f, avg control %.3f, send at %.3f of set rate\n",
+                           backends, minFill, controlTotal/backends, scale);
+    }
 
-    // Create UDP sockets (one for control plane, the other for backend)
-    int cpSocket, clientSocket;
+    return (nullptr);
+}
 
-    // Create socket to backend
-    if (useIPv6) {
-        struct sockaddr_in6 serverAddr6;
 
-        /* create a DGRAM (UDP) socket in the INET/INET6 protocol */
-        if ((clientSocket = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
-            perror("creating IPv6 client socket");
-            return -1;
-        }
+// Settings common to all sending threads
+typedef struct sendSettings_t {
+    uint64_t tick;
+    uint32_t tickPrescale;
+    int      maxUdpPayload;
+    int      protocol;
+    int      entropy;
+    int      version;
+    uint16_t dataId;
+
+    uint32_t bufSize;
+    uint32_t sizeWidth;
+    uint32_t beDelayTime;
+    uint32_t delay;
+    uint32_t delayWidth;
+    uint32_t delayPrescale;
+    bool     useTimeSpread;
+    bool     useSizeSpread;
+    bool     useDelaySpread;
+
+    bool     setRate;               // pace by -byterate or -bufrate
+    int64_t  buffersAtOnce;         // # of buffers sent between checks of the pace
+    int64_t  microSecItShouldTake;  // time it should take to send buffersAtOnce
+
+    bool     throttle;
+    bool     adaptive;
+    bool     debug;
+    uint32_t seed;                  // for random numbers, same for all destinations
+} sendSettings;
+
+
+// Arg to pass to sending thread
+typedef struct senderThreadArg_t {
+    int index;         // destination #
+    int clientSocket;  // socket connected to destination
+    int core;          // if > -1, core to run on
+    const sendSettings *settings;
+} senderThreadArg;
 
-        socklen_t size = sizeof(int);
-        int sendBufBytes = 0;
-#ifndef __APPLE__
-        // Try to increase send buf size - by default to 25 MB
-            sendBufBytes = sendBufSize <= 0 ? 25000000 : sendBufSize;
-            setsockopt(clientSocket, SOL_SOCKET, SO_SNDBUF, &sendBufBytes, sizeof(sendBufBytes));
-#endif
-        sendBufBytes = 0; // clear it
-        getsockopt(clientSocket, SOL_SOCKET, SO_SNDBUF, &sendBufBytes, &size);
-        fprintf(stderr, "UDP socket send buffer = %d bytes\n", sendBufBytes);
 
-        // Configure settings in address struct
-        // Clear it out
-        memset(&serverAddr6, 0, sizeof(serverAddr6));
-        // it is an INET address
-        serverAddr6.sin6_family = AF_INET6;
-        // the port we are going to send to, in network byte order
-        serverAddr6.sin6_port = htons(port);
-        // the server IP address, in network byte order
-        inet_pton(AF_INET6, host, &serverAddr6.sin6_addr);
+/**
+ * This thread sends the stream of events to one destination.
+ * Each destination has its own thread, socket, pacing, backoff and stats,
+ * so one path being slow does not hold back the others.
+ * Since all use the same seed for their random numbers and start at the same tick,
+ * each destination is sent the same events.
+ *
+ * @param arg struct to be passed to thread.
+ */
+static void *senderThread(void *arg) {
 
-        int err = connect(clientSocket, (const sockaddr *) &serverAddr6, sizeof(struct sockaddr_in6));
+    senderThreadArg *tArg = (senderThreadArg *) arg;
+    const sendSettings &set = *(tArg->settings);
+
+    int index        = tArg->index;
+    int clientSocket = tArg->clientSocket;
+    packetSendStats &stats = sendStats[index];
+
+#ifdef __linux__
+    if (tArg->core > -1) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(tArg->core, &cpuset);
+        std::cerr << "Run sending thread for " << destinations[index] << " on core " << tArg->core << "\n";
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+        if (rc != 0) {
+            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
+        }
+    }
+#endif
+
+    uint64_t tick = set.tick;
+    uint32_t backendTime = set.beDelayTime;
+    uint32_t bufByteSize = set.bufSize;
+    uint32_t delayCounter = set.delayPrescale;
+
+    // Sampling distributions in the send loop is too slow at high event rates,
+    // so pre-generate samples in a background thread and just read them in the loop.
+
+    // Exponential distribution of backend processing times
+    std::exponential_distribution<double> timeDist {1.0/set.beDelayTime};
+    std::unique_ptr<variateCache<std::exponential_distribution<double>>> timeCache;
+    if (set.useTimeSpread) {
+        timeCache.reset(new variateCache<std::exponential_distribution<double>>(timeDist, set.seed));
+    }
+
+    // Gaussian dist for buffer sizes
+    std::normal_distribution<float> bufDist {(float)set.bufSize, (float)set.sizeWidth};
+    std::unique_ptr<variateCache<std::normal_distribution<float>>> bufCache;
+    if (set.useSizeSpread) {
+        bufCache.reset(new variateCache<std::normal_distribution<float>>(bufDist, set.seed + 1));
+    }
+
+    // Gaussian dist for interarrival times
+    std::normal_distribution<float> delayDist {(float)set.delay, (float)set.delayWidth};
+    std::unique_ptr<variateCache<std::normal_distribution<float>>> delayCache;
+    if (set.useDelaySpread && set.delay > 0) {
+        delayCache.reset(new variateCache<std::normal_distribution<float>>(delayDist, set.seed + 2));
+    }
+
+    int err;
+    int64_t packetsSent=0;
+    uint32_t fragsRetried = 0;
+    packetSendBackoff backoff;
+    float scale = 1.F;
+    int64_t elapsed;
+    struct timespec t1, t2;
+    int64_t excessTime, lastExcessTime = 0;
+    int64_t countDown = set.buffersAtOnce;
+
+    if (set.setRate) {
+        // Start the clock
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    }
+
+    while (true) {
+
+        // If we're sending buffers at a constant rate AND we've sent the entire bunch
+        if (set.setRate && countDown-- <= 0) {
+            // Get the current time
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            // Time taken to send a bunch of buffers
+            elapsed = 1000000L * (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec)/1000L;
+            // Time yet needed in order for everything we've sent to be at the correct rate
+            if (set.throttle || set.adaptive) {
+                scale = set.throttle ? rateScale.load(std::memory_order_relaxed) : 1.F;
+                if (set.adaptive) scale *= backoff.rateScale;
+                excessTime = (int64_t)(set.microSecItShouldTake / scale) - elapsed + lastExcessTime;
+            }
+            else {
+                excessTime = set.microSecItShouldTake - elapsed + lastExcessTime;
+            }
+
+            // Do we need to wait before sending the next bunch of buffers?
+            if (excessTime > 0) {
+                // We need to wait, but it's possible that after the following delay,
+                // we will have waited too long. We know this since any specified sleep
+                // period is always a minimum.
+                // If that's the case, in the next cycle, excessTime will be < 0.
+                std::this_thread::sleep_for(std::chrono::microseconds(excessTime));
+                // After this wait, we'll do another round of buffers to send,
+                // but we need to start the clock again.
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                // Check to see if we overslept so correction can be done
+                elapsed = 1000000L * (t1.tv_sec - t2.tv_sec) + (t1.tv_nsec - t2.tv_nsec)/1000L;
+                lastExcessTime = excessTime - elapsed;
+            }
+            else {
+                // If we're here, it took longer to send buffers than required in order to meet the
+                // given buffer rate. So, it's likely that the specified rate is too high for this node.
+                // Record any excess previous sleep time so it can be compensated for in next go round
+                // if that is even possible.
+                lastExcessTime = excessTime;
+                t1 = t2;
+            }
+            countDown = set.buffersAtOnce - 1;
+        }
+
+        // Generate spread in backend processing time
+        if (set.useTimeSpread) {
+            backendTime = (uint32_t) timeCache->next();
+        }
+
+        // Generate spread in buffer size
+        if (set.useSizeSpread) {
+            bufByteSize = (uint32_t) bufCache->next();
+        }
+
+        err = sendPacketizedBuf(bufByteSize, set.maxUdpPayload, backendTime, clientSocket,
+                                tick, set.protocol, set.entropy, set.version, set.dataId,
+                                0, set.delayPrescale, &delayCounter,
+                                set.debug, &packetsSent,
+                                set.adaptive ? &backoff : nullptr, &fragsRetried);
+        if (err < 0) {
+            // Should be more info in errno
+            fprintf(stderr, "\nsendPacketizedBuffer to %s: errno = %d, %s\n\n",
+                    destinations[index], errno, strerror(errno));
+            exit(1);
+        }
+
+        tick += set.tickPrescale;
+
+        // Let the rate and sync threads know
+        stats.add(bufByteSize, packetsSent, tick, fragsRetried);
+
+        // delay if any
+        if (set.delay > 0) {
+            if (--delayCounter < 1) {
+                uint32_t nextDelay = set.delay;
+                if (set.useDelaySpread) {
+                    nextDelay = std::round(delayCache->next());
+                }
+                if (set.throttle || set.adaptive) {
+                    scale = set.throttle ? rateScale.load(std::memory_order_relaxed) : 1.F;
+                    if (set.adaptive) scale *= backoff.rateScale;
+                    nextDelay = (uint32_t) (nextDelay / scale);
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(nextDelay));
+                delayCounter = set.delayPrescale;
+            }
+        }
+    }
+
+    return (nullptr);
+}
+
+
+/**
+ * Parse a destination given as host, host:port, [IPv6 host], or [IPv6 host]:port.
+ * An IPv6 host without brackets is taken to have no port.
+ * A literal address is used as is. A host name is looked up as an IPv6 address
+ * if useIPv6 is true, else as an IPv4 address, and host is filled with the address found.
+ *
+ * @param dest         destination to parse.
+ * @param defaultPort  port to use if none given.
+ * @param useIPv6      true if a host name is to be looked up as an IPv6 address (-ipv6).
+ * @param host         filled with host address, at least INPUT_LENGTH_MAX bytes.
+ * @param port         filled with port.
+ * @param ipv6         filled with true if host is an IPv6 address.
+ * @return true if OK, false if destination is not valid or its host name is not found.
+ */
+static bool parseDestination(const char *dest, uint16_t defaultPort, bool useIPv6,
+                             char *host, uint16_t *port, bool *ipv6) {
+
+    std::string s(dest);
+    std::string portStr;
+
+    if (!s.empty() && s[0] == '[') {
+        size_t close = s.find(']');
+        if (close == std::string::npos) return false;
+        if (close + 1 < s.size()) {
+            if (s[close + 1] != ':') return false;
+            portStr = s.substr(close + 2);
+        }
+        s = s.substr(1, close - 1);
+    }
+    else if (std::count(s.begin(), s.end(), ':') == 1) {
+        size_t colon = s.find(':');
+        portStr = s.substr(colon + 1);
+        s = s.substr(0, colon);
+    }
+
+    if (s.empty() || s.size() >= INPUT_LENGTH_MAX) return false;
+
+    *port = defaultPort;
+    if (!portStr.empty()) {
+        int p = (int) strtol(portStr.c_str(), nullptr, 0);
+        if (p <= 1023 || p >= 65535) return false;
+        *port = p;
+    }
+
+    struct in_addr  addr4;
+    struct in6_addr addr6;
+    if (inet_pton(AF_INET6, s.c_str(), &addr6) == 1) {
+        *ipv6 = true;
+    }
+    else if (inet_pton(AF_INET, s.c_str(), &addr4) == 1) {
+        *ipv6 = false;
+    }
+    else {
+        // Host name, so look it up in the family asked for
+        struct addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = useIPv6 ? AF_INET6 : AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        int err = getaddrinfo(s.c_str(), nullptr, &hints, &result);
+        if (err != 0) {
+            fprintf(stderr, "Cannot find %s address of %s: %s\n",
+                    useIPv6 ? "IPv6" : "IPv4", s.c_str(), gai_strerror(err));
+            return false;
+        }
+
+        char addr[INET6_ADDRSTRLEN];
+        if (useIPv6) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *) result->ai_addr)->sin6_addr, addr, sizeof(addr));
+        }
+        else {
+            inet_ntop(AF_INET, &((struct sockaddr_in *) result->ai_addr)->sin_addr, addr, sizeof(addr));
+        }
+        freeaddrinfo(result);
+        s = addr;
+        *ipv6 = useIPv6;
+    }
+
+    strcpy(host, s.c_str());
+    return true;
+}
+
+
+/**
+ * Create a UDP socket with a big send buffer, connected to a data destination.
+ *
+ * @param host         destination host.
+ * @param port         destination port.
+ * @param ipv6         true if host is an IPv6 address.
+ * @param sendBufSize  desired send buffer size in bytes, 0 for 25MB.
+ * @param debug        turn debug printout on & off.
+ * @return socket, or -1 if error.
+ */
+static int createDataSocket(const char *host, uint16_t port, bool ipv6, uint32_t sendBufSize, bool debug) {
+
+    int clientSocket;
+
+    if (ipv6) {
+        struct sockaddr_in6 serverAddr6;
+
+        /* create a DGRAM (UDP) socket in the INET/INET6 protocol */
+        if ((clientSocket = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
+            perror("creating IPv6 client socket");
+            return -1;
+        }
+
+        socklen_t size = sizeof(int);
+        int sendBufBytes = 0;
+#ifndef __APPLE__
+        // Try to increase send buf size - by default to 25 MB
+            sendBufBytes = sendBufSize <= 0 ? 25000000 : sendBufSize;
+            setsockopt(clientSocket, SOL_SOCKET, SO_SNDBUF, &sendBufBytes, sizeof(sendBufBytes));
+#endif
+        sendBufBytes = 0; // clear it
+        getsockopt(clientSocket, SOL_SOCKET, SO_SNDBUF, &sendBufBytes, &size);
+        fprintf(stderr, "UDP socket send buffer = %d bytes\n", sendBufBytes);
+
+        // Configure settings in address struct
+        // Clear it out
+        memset(&serverAddr6, 0, sizeof(serverAddr6));
+        // it is an INET address
+        serverAddr6.sin6_family = AF_INET6;
+        // the port we are going to send to, in network byte order
+        serverAddr6.sin6_port = htons(port);
+        // the server IP address, in network byte order
+        inet_pton(AF_INET6, host, &serverAddr6.sin6_addr);
+
+        fprintf(stderr, "Connection socket to host %s, port %hu\n", host, port);
+        int err = connect(clientSocket, (const sockaddr *) &serverAddr6, sizeof(struct sockaddr_in6));
         if (err < 0) {
             if (debug) perror("Error connecting UDP socket:");
             close(clientSocket);
-            exit(1);
+            return -1;
         }
     }
     else {
@@ -846,9 +1350,7 @@ int main(int argc, char **argv) {
         // Configure settings in address struct
         memset(&serverAddr, 0, sizeof(serverAddr));
         serverAddr.sin_family = AF_INET;
-        //if (debug) fprintf(stderr, "Sending on UDP port %hu\n", lbPort);
         serverAddr.sin_port = htons(port);
-        //if (debug) fprintf(stderr, "Connecting to host %s\n", lbHost);
         serverAddr.sin_addr.s_addr = inet_addr(host);
         memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);
 
@@ -857,7 +1359,7 @@ int main(int argc, char **argv) {
         if (err < 0) {
             if (debug) perror("Error connecting UDP socket:");
             close(clientSocket);
-            return err;
+            return -1;
         }
     }
 
@@ -869,6 +1371,211 @@ int main(int argc, char **argv) {
     }
 #endif
 
+    return clientSocket;
+}
+
+
+/**
+ * Doing things this way is like reading a buffer bit-by-bit
+ * and passing it off to the parser bit-by-bit
+ * @param argc
+ * @param argv
+ * @return
+ */
+int main(int argc, char **argv) {
+
+    uint32_t timeSigma = 0; // Currently not used, since we switched from gaussian to exp
+    uint32_t beDelayTime = 0, sizeWidth = 0, delayWidth = 0;
+    uint32_t tickPrescale = 1;
+    uint32_t delayPrescale = 1;
+    uint32_t sendBufSize = 0;
+    uint32_t delay = 0, syncPeriod = 1000;
+    uint64_t bufRate = 0L, bufSize = 62500L, byteRate = 0L;
+    uint16_t port = 0x4c42, cpport = 0x4c43; // 19522 & 19523
+    uint16_t grpcPort = 18347;
+    uint64_t tick = 0;
+    int cores[10];
+    int mtu, version = 2, protocol = 1, entropy = 0;
+    uint16_t dataId = 1;
+    bool debug = false;
+    bool useIPv6 = false, useExpDist = false;
+    bool setBufRate = false, setByteRate = false;
+    bool sendSync = false;
+    bool throttle = false, adaptive = false;
+    float throttleGain = 1.F, throttleFloor = 0.1F, throttleFill = 0.5F;
+    uint32_t throttlePeriod = 1000;
+    bool useSizeSpread = false, useTimeSpread = false, useDelaySpread = false;
+
+    char host[INPUT_LENGTH_MAX], cphost[INPUT_LENGTH_MAX], interface[16];
+    char jsonFile[INPUT_LENGTH_MAX], lbId[INPUT_LENGTH_MAX], token[INPUT_LENGTH_MAX];
+    memset(jsonFile, 0, INPUT_LENGTH_MAX);
+    memset(lbId, 0, INPUT_LENGTH_MAX);
+    memset(token, 0, INPUT_LENGTH_MAX);
+    memset(host, 0, INPUT_LENGTH_MAX);
+    memset(cphost, 0, INPUT_LENGTH_MAX);
+    memset(interface, 0, 16);
+    strcpy(host, "127.0.0.1");
+    strcpy(cphost, "127.0.0.1");
+    strcpy(interface, "lo0");
+    for (int i=0; i < 10; i++) {
+        cores[i] = -1;
+    }
+
+    parseArgs(argc, argv, &mtu, &protocol, &entropy, &version, &dataId, &port, &cpport, &tick,
+              &delay, &bufSize, &bufRate, &byteRate, &sendBufSize, &delayPrescale, &tickPrescale,
+              &beDelayTime, &timeSigma, &sizeWidth, &delayWidth, &syncPeriod, cores, &debug, &useIPv6, &useExpDist,
+              &sendSync, host, cphost, interface, jsonFile,
+              &throttle, &throttleGain, &throttleFloor, &throttleFill, &throttlePeriod,
+              &grpcPort, lbId, token, &adaptive);
+
+#ifdef __linux__
+
+    if (cores[0] > -1) {
+        // Create a cpu_set_t object representing a set of CPUs. Clear it and mark given CPUs as set.
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+
+        if (debug) {
+            for (int i=0; i < 10; i++) {
+                     std::cerr << "core[" << i << "] = " << cores[i] << "\n";
+            }
+        }
+
+        for (int i=0; i < 10; i++) {
+            if (cores[i] >= 0) {
+                std::cerr << "Run sending thread on core " << cores[i] << "\n";
+                CPU_SET(cores[i], &cpuset);
+            }
+            else {
+                break;
+            }
+        }
+        pthread_t current_thread = pthread_self();
+        int rc = pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset);
+        if (rc != 0) {
+            std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n";
+        }
+    }
+
+    std::cerr << "Initially running on cpu " << sched_getcpu() << "\n";
+
+#endif
+
+    fprintf(stderr, "send = %s\n", btoa(send));
+
+    if (byteRate > 0) {
+        // Are we trying to send a fixed byte rate?
+        setByteRate = true;
+    }
+    else if (bufRate > 0) {
+        // Are we trying to send a fixed buffer rate?
+        setBufRate = true;
+    }
+
+    // Do we use exponential distribution of simulated BE processing times?
+    if (useExpDist && beDelayTime > 0) {
+        useTimeSpread = true;
+    }
+
+    // Do we use gaussian distribution of buffer sizes?
+    if (sizeWidth > 0) {
+        useSizeSpread = true;
+    }
+
+    // Do we use gaussian distribution of interarrival times?
+    if (delayWidth > 0) {
+        useDelaySpread = true;
+    }
+
+    // Break data into multiple packets of max MTU size.
+    // If the mtu was not set on the command line, get it progamatically
+    if (mtu == 0) {
+        mtu = getMTU(interface, true);
+    }
+
+    // Jumbo (> 1500) ethernet frames are 9000 bytes max.
+    // Don't exceed this limit.
+    if (mtu > 9000) {
+        mtu = 9000;
+    }
+
+    fprintf(stderr, "Using MTU = %d\n", mtu);
+
+    // 20 bytes = normal IPv4 packet header (60 is max), 8 bytes = max UDP packet header
+    // https://stackoverflow.com/questions/42609561/udp-maximum-packet-size
+    int maxUdpPayload = mtu - 20 - 8 - HEADER_BYTES;
+
+    fprintf(stderr, "Setting max UDP payload size to %d bytes, MTU = %d\n", maxUdpPayload, mtu);
+
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Create a variable backend processing time (exponential distribution around the given backend time)
+    double lambda = 1.0/beDelayTime;
+    fprintf(stderr, "beDelayTime = %u, lambda = %g\n", beDelayTime, lambda);
+    fprintf(stderr, "BACKEND TIME (exp dist) around t = %u  usec\n", beDelayTime);
+
+    // normal distribution for times (mean = beDelayTime, stdev = timeSigma), where stdev = FWHM/2.35
+    //fprintf(stderr, "BACKEND TIME (normal dist) = %u, time width = %u usec\n", beDelayTime, timeSigma);
+    //std::normal_distribution<float> timeDist {(float)beDelayTime, (float)timeSigma};
+
+    // Seed for the generators of random, distributed numbers.
+    // Every destination uses the same one so all get the identical stream of events.
+    std::random_device rd;
+
+    sendSettings settings;
+    settings.tick          = tick;
+    settings.tickPrescale  = tickPrescale;
+    settings.maxUdpPayload = maxUdpPayload;
+    settings.protocol      = protocol;
+    settings.entropy       = entropy;
+    settings.version       = version;
+    settings.dataId        = dataId;
+    settings.bufSize       = bufSize;
+    settings.sizeWidth     = sizeWidth;
+    settings.beDelayTime   = beDelayTime;
+    settings.delay         = delay;
+    settings.delayWidth    = delayWidth;
+    settings.delayPrescale = delayPrescale;
+    settings.useTimeSpread  = useTimeSpread;
+    settings.useSizeSpread  = useSizeSpread;
+    settings.useDelaySpread = useDelaySpread;
+    settings.setRate       = setByteRate || setBufRate;
+    settings.throttle      = throttle;
+    settings.adaptive      = adaptive;
+    settings.debug         = debug;
+    settings.seed          = rd();
+
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Create UDP sockets (one for control plane, the others for each destination)
+    int cpSocket;
+    int clientSockets[MAX_DESTINATIONS];
+
+    if (destinationCount < 1) {
+        // Only the -host & -p destination
+        strcpy(destinations[0], host);
+        destinationCount = 1;
+    }
+
+    for (int i=0; i < destinationCount; i++) {
+        char destHost[INPUT_LENGTH_MAX];
+        uint16_t destPort;
+        bool destIPv6;
+
+        if (!parseDestination(destinations[i], port, useIPv6, destHost, &destPort, &destIPv6)) {
+            fprintf(stderr, "Invalid destination %s, use host, host:port, or [IPv6 host]:port\n", destinations[i]);
+            return -1;
+        }
+
+        clientSockets[i] = createDataSocket(destHost, destPort, destIPv6, sendBufSize, debug);
+        if (clientSockets[i] < 0) {
+            return -1;
+        }
+
+        snprintf(destinations[i], INPUT_LENGTH_MAX, "%s%s%s:%hu",
+                 destIPv6 ? "[" : "", destHost, destIPv6 ? "]" : "", destPort);
+    }
+
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     // Create socket to send tick/event# update to control plane. No need for big buffers.
@@ -932,8 +1639,26 @@ int main(int argc, char **argv) {
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
     // Start thread to do rate printout
+    rateThreadArg *rArg = (rateThreadArg *) calloc(1, sizeof(rateThreadArg));
+    if (rArg == nullptr) {
+        fprintf(stderr, "out of mem\n");
+        return -1;
+    }
+
+    if (strlen(jsonFile) > 0) {
+        rArg->jsonFp = fopen(jsonFile, "a");
+        if (rArg->jsonFp == nullptr) {
+            fprintf(stderr, "json file open failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    for (int i=0; i < destinationCount; i++) {
+        sendStats[i].tick.store(tick, std::memory_order_release);
+    }
+
     pthread_t thd;
-    int status = pthread_create(&thd, NULL, thread, (void *) nullptr);
+    int status = pthread_create(&thd, NULL, rateThread, (void *) rArg);
     if (status != 0) {
         fprintf(stderr, "\n ******* error creating thread\n\n");
         return -1;
@@ -941,23 +1666,13 @@ int main(int argc, char **argv) {
 
 
     ///////////////////////////////////////////////////////////////////////////////////////////////
-    int err;
-    bool firstBuffer = true;
-    bool lastBuffer  = true;
-    delayCounter = delayPrescale;
-
     fprintf(stderr, "delay prescale = %u\n", delayPrescale);
 
-    // Statistics & rate setting
-    int64_t packetsSent=0;
-    int64_t elapsed, microSecItShouldTake;
-    uint64_t syncTime;
-    struct timespec t1, t2, tStart, tEnd;
-    int64_t excessTime, lastExcessTime = 0, buffersAtOnce, countDown;
-
+    // Rate setting
     if (setByteRate || setBufRate) {
         // Don't send more than about 500k consecutive bytes with no delays to avoid overwhelming UDP bufs
         int64_t bytesToWriteAtOnce = 500000;
+        int64_t buffersAtOnce;
 
         if (setByteRate) {
             // Fixed the BYTE rate when making performance measurements.
@@ -986,151 +1701,100 @@ int main(int argc, char **argv) {
                     bufRate, bufSize, byteRate);
         }
 
-        countDown = buffersAtOnce;
-
         // musec to write data at desired rate
-        microSecItShouldTake = 1000000L * bytesToWriteAtOnce / byteRate;
+        settings.buffersAtOnce = buffersAtOnce;
+        settings.microSecItShouldTake = 1000000L * bytesToWriteAtOnce / byteRate;
+        settings.bufSize = bufSize;
         fprintf(stderr,
                 "simSender: bytesToWriteAtOnce = %" PRId64 ", byteRate = %" PRId64 ", buffersAtOnce = %" PRId64 ", microSecItShouldTake = %" PRId64 "\n",
-                bytesToWriteAtOnce, byteRate, buffersAtOnce, microSecItShouldTake);
+                bytesToWriteAtOnce, byteRate, buffersAtOnce, settings.microSecItShouldTake);
     }
 
     fprintf(stdout, "buf size = %u\n", (uint32_t)bufSize);
 
-    if (setByteRate || setBufRate || sendSync) {
-        // Start the clock
-        clock_gettime(CLOCK_MONOTONIC, &t1);
-        tStart = t1;
-    }
-
     ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Start thread to send sync msgs to control plane
 
-    uint64_t evtRate;
-    uint64_t bufsSent = 0UL;
-    uint64_t totalBufsSent = 0UL;  // unlike bufsSent, does not get reset every sec
+    if (sendSync) {
+        fprintf(stdout, "timestamp,event_number,event_rate_this_period,total_events_sent\n");
 
-    fprintf(stdout, "timestamp,event_number,event_rate_this_period,total_events_sent\n");
+        syncThreadArg *sArg = (syncThreadArg *) calloc(1, sizeof(syncThreadArg));
+        if (sArg == nullptr) {
+            fprintf(stderr, "out of mem\n");
+            return -1;
+        }
 
-    while (true) {
+        sArg->cpSocket = cpSocket;
+        sArg->version  = version;
+        sArg->dataId   = dataId;
+        sArg->period   = syncPeriod;
+        sArg->debug    = debug;
 
-        // If we're sending buffers at a constant rate AND we've sent the entire bunch
-        if ((setByteRate || setBufRate) && countDown-- <= 0) {
-            // Get the current time
-            clock_gettime(CLOCK_MONOTONIC, &t2);
-            // Time taken to send a bunch of buffers
-            elapsed = 1000000L * (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec)/1000L;
-            // Time yet needed in order for everything we've sent to be at the correct rate
-            excessTime = microSecItShouldTake - elapsed + lastExcessTime;
+        pthread_t thdSync;
+        status = pthread_create(&thdSync, NULL, syncThread, (void *) sArg);
+        if (status != 0) {
+            fprintf(stderr, "\n ******* error creating sync thread\n\n");
+            return -1;
+        }
+    }
 
-//fprintf(stderr, "packetBlaster: elapsed = %lld, this excessT = %lld, last excessT = %lld, buffers/sec = %llu\n",
-//        elapsed, (microSecItShouldTake - elapsed), lastExcessTime, buffersAtOnce*1000000/elapsed);
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Start thread to throttle send rate as backends fill
 
-            // Do we need to wait before sending the next bunch of buffers?
-            if (excessTime > 0) {
-                // We need to wait, but it's possible that after the following delay,
-                // we will have waited too long. We know this since any specified sleep
-                // period is always a minimum.
-                // If that's the case, in the next cycle, excessTime will be < 0.
-                std::this_thread::sleep_for(std::chrono::microseconds(excessTime));
-                // After this wait, we'll do another round of buffers to send,
-                // but we need to start the clock again.
-                clock_gettime(CLOCK_MONOTONIC, &t1);
-                // Check to see if we overslept so correction can be done
-                elapsed = 1000000L * (t1.tv_sec - t2.tv_sec) + (t1.tv_nsec - t2.tv_nsec)/1000L;
-                lastExcessTime = excessTime - elapsed;
-            }
-            else {
-                // If we're here, it took longer to send buffers than required in order to meet the
-                // given buffer rate. So, it's likely that the specified rate is too high for this node.
-                // Record any excess previous sleep time so it can be compensated for in next go round
-                // if that is even possible.
-                lastExcessTime = excessTime;
-                t1 = t2;
-            }
-            countDown = buffersAtOnce - 1;
+    if (throttle) {
+        throttleThreadArg *tArg = (throttleThreadArg *) calloc(1, sizeof(throttleThreadArg));
+        if (tArg == nullptr) {
+            fprintf(stderr, "out of mem\n");
+            return -1;
         }
 
-        // Generate spread in backend processing time
-        if (useTimeSpread) {
-            //double val = timeDist(gen);
-            backendTime = (uint32_t) timeDist(gen);
-            //fprintf(stderr, "btime = %u, t -> %g\n", backendTime, val);
-        }
+        fprintf(stderr, "Throttle send rate by fill of backends of LB %s, CP at %s:%hu\n", lbId, cphost, grpcPort);
 
-        // Generate spread in buffer size
-        if (useSizeSpread) {
-            bufByteSize = (uint32_t) bufDist(gen);
-        }
+        tArg->reservation = new LbReservation(cphost, grpcPort, lbId, token);
+        tArg->gain   = throttleGain;
+        tArg->floor  = throttleFloor;
+        tArg->onset  = throttleFill;
+        tArg->period = throttlePeriod;
+        tArg->debug  = debug;
 
-        err = sendPacketizedBuf(bufByteSize, maxUdpPayload, backendTime, clientSocket,
-                                tick, protocol, entropy, version, dataId,
-                                0, delayPrescale, &delayCounter,
-                                debug, &packetsSent);
-        if (err < 0) {
-            // Should be more info in errno
-            fprintf(stderr, "\nsendPacketizedBuffer: errno = %d, %s\n\n", errno, strerror(errno));
-            exit(1);
+        pthread_t thdThrottle;
+        status = pthread_create(&thdThrottle, NULL, throttleThread, (void *) tArg);
+        if (status != 0) {
+            fprintf(stderr, "\n ******* error creating throttle thread\n\n");
+            return -1;
         }
+    }
 
-        bufsSent++;
-        totalBufsSent++;
-        totalBytes   += bufByteSize;
-        totalPackets += packetsSent;
-        totalEvents++;
-        offset = 0;
-        tick += tickPrescale;
-
-        if (sendSync) {
-            clock_gettime(CLOCK_MONOTONIC, &tEnd);
-            syncTime = 1000000000UL * (tEnd.tv_sec - tStart.tv_sec) + (tEnd.tv_nsec - tStart.tv_nsec);
-
-            // if >= 1 sec ...
-            if (syncTime >= 1000000000UL) {
-                // Calculate buf or event rate in Hz
-                evtRate = bufsSent*1000000000/syncTime;
-
-                // Send sync message to same destination
-                if (debug) fprintf(stderr, "send tick %" PRIu64 ", evtRate %" PRIu64 "\n\n", tick, evtRate);
-
-                auto now = std::chrono::system_clock::now();
-                std::time_t now_c = std::chrono::system_clock::to_time_t(now);
-                char timestamp[20];
-                strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", std::localtime(&now_c));
-                fprintf(
-                    stdout,
-                    "%s,%d,%f,%d\n",
-                    timestamp,
-                    (int)tick,
-                    (double)evtRate,
-                    (int)totalBufsSent
-                );
-                fflush(stdout);
-
-                setSyncData(syncBuf, version, dataId, tick, evtRate, syncTime);
-                err = send(cpSocket, syncBuf, 28, 0);
-                if (err == -1) {
-                    fprintf(stderr, "\npacketBlasterNew: error sending sync, errno = %d, %s\n\n", errno, strerror(errno));
-                    return (-1);
-                }
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Start one sending thread for each destination
 
-                tStart = tEnd;
-                bufsSent = 0;
-            }
+    // If there are as many cores given as destinations, each destination gets its own
+    int coreCount = 0;
+    while (coreCount < 10 && cores[coreCount] > -1) coreCount++;
+
+    pthread_t thdSenders[MAX_DESTINATIONS];
+
+    for (int i=0; i < destinationCount; i++) {
+        senderThreadArg *dArg = (senderThreadArg *) calloc(1, sizeof(senderThreadArg));
+        if (dArg == nullptr) {
+            fprintf(stderr, "out of mem\n");
+            return -1;
         }
 
+        dArg->index        = i;
+        dArg->clientSocket = clientSockets[i];
+        dArg->core         = (destinationCount > 1 && coreCount >= destinationCount) ? cores[i] : -1;
+        dArg->settings     = &settings;
 
-        // delay if any
-        if (delay > 0) {
-            if (--delayCounter < 1) {
-                uint32_t nextDelay = delay;
-                if (useDelaySpread) {
-                    nextDelay = std::round(delayDist(gen));
-                }
-                std::this_thread::sleep_for(std::chrono::microseconds(nextDelay));
-                delayCounter = delayPrescale;
-            }
+        status = pthread_create(&thdSenders[i], NULL, senderThread, (void *) dArg);
+        if (status != 0) {
+            fprintf(stderr, "\n ******* error creating sending thread\n\n");
+            return -1;
         }
+    }
 
+    for (int i=0; i < destinationCount; i++) {
+        pthread_join(thdSenders[i], nullptr);
     }
 
     return 0;